@@ -0,0 +1,32 @@
+#!/usr/bin/env lua
+-- Benchmark: single vs. multithreaded bandwidth of hostmem allocation
+-- (zeroing), copy and clear, for an increasing number of threads.
+--
+-- Usage: lua memcpy.lua [MB] [MAXTHREADS]    (default 1024 MB, up to 8 threads)
+
+local cl = require('mooncl')
+
+local MB = tonumber(arg[1]) or 1024
+local MAXTHREADS = tonumber(arg[2]) or 8
+local SIZE = MB*1024*1024
+
+local function bench(name, f)
+   local t = cl.now()
+   f()
+   local dt = cl.since(t)
+   return string.format("%s %8.1f MB/s", name, MB/dt)
+end
+
+local nthreads = 1
+while nthreads <= MAXTHREADS do
+   cl.hostmem_threads(nthreads, nil, true)
+   local src, dst
+   local r1 = bench("alloc", function() src = cl.aligned_alloc(4096, SIZE) end)
+   dst = cl.aligned_alloc(4096, SIZE)
+   local r2 = bench("copy", function() dst:copy(0, SIZE, src, 0) end)
+   local r3 = bench("clear", function() dst:clear(0, SIZE, 0xff) end)
+   print(string.format("%2d threads: %s, %s, %s", nthreads, r1, r2, r3))
+   src:free(); dst:free()
+   nthreads = nthreads*2
+end
+cl.hostmem_threads(1)
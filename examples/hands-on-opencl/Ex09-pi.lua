@@ -76,15 +76,10 @@ cl.set_kernel_arg(kernel, 3, d_partial_sums)
 local rtime = cl.now()
 cl.enqueue_ndrange_kernel(queue, kernel, 1, nil, {nsteps/ITERS}, {work_group_size})
 
--- Read back the partial sums and unpack them:
+-- Read back the partial sums:
 cl.enqueue_read_buffer(queue, d_partial_sums, true, 0, h_psum:size(), h_psum:ptr())
-local psum = h_psum:read(0, nil, 'float')
 -- complete the sum and compute the final integral value on the host
-local pi_res = 0.0
-for i = 1, nwork_groups do
-   pi_res = pi_res + psum[i]
-end
-pi_res = pi_res * step_size
+local pi_res = h_psum:reduce('float', 'sum') * step_size
 
 rtime = cl.since(rtime)
 
@@ -53,21 +53,87 @@ function cl.build_program(program, devices, options)
 end
 
 function cl.make_program_with_source(context, source, devices, options)
+   -- If the program binary cache is enabled, try it first:
+   local cached = cl.program_cache() and cl.program_cache_load(context, source, devices, options)
+   if cached then return cached end
    local ok, program = pcall(cl.create_program_with_source, context, source)
    if not ok then error(program, 2) end
    local ok, errmsg = pcall(cl.build_program, program, devices, options)
    if not ok then error(errmsg, 2) end
+   if cl.program_cache() then cl.program_cache_store(program, source, options) end
    return program
 end
 
 function cl.make_program_with_sourcefile(context, filename, devices, options)
-   local ok, program = pcall(cl.create_program_with_sourcefile, context, filename)
+   local f, errmsg = io.open(filename)
+   if not f then error(errmsg, 2) end
+   local source = f:read('a')
+   f:close()
+   local ok, program = pcall(cl.make_program_with_source, context, source, devices, options)
    if not ok then error(program, 2) end
-   local ok, errmsg = pcall(cl.build_program, program, devices, options)
-   if not ok then error(errmsg, 2) end
    return program
 end
 
+-- Memoization of programs and kernels --------------------------------
+
+local Programs = setmetatable({}, { __mode = 'k' }) -- context -> { key -> program }
+local Kernels = setmetatable({}, { __mode = 'k' }) -- program -> { name -> kernel }
+local MemoStats = { program_hits = 0, program_misses = 0, kernel_hits = 0, kernel_misses = 0 }
+
+local function program_key(source, devices, options)
+   local t = { options or "" }
+   if devices then for i, dev in ipairs(devices) do t[i+1] = tostring(dev) end end
+   t[#t+1] = source
+   return table.concat(t, '\0')
+end
+
+function cl.get_program(context, source, devices, options)
+-- Same as make_program_with_source(), but returns the existing program if one was already
+-- made by this function with the same source, devices and options on the same context.
+   local cache = Programs[context]
+   if not cache then cache = {}; Programs[context] = cache end
+   local key = program_key(source, devices, options)
+   local program = cache[key]
+   if program and cl.type(program) == 'program' then
+      MemoStats.program_hits = MemoStats.program_hits + 1
+      return program
+   end
+   local ok
+   ok, program = pcall(cl.make_program_with_source, context, source, devices, options)
+   if not ok then error(program, 2) end
+   cache[key] = program
+   MemoStats.program_misses = MemoStats.program_misses + 1
+   return program
+end
+
+function cl.get_kernel(program, name, clone)
+-- Returns the kernel created by this function for the given program and name, creating
+-- it the first time. If clone=true, returns instead a new kernel cloned from it (if
+-- clone_kernel() is supported, otherwise a newly created one).
+   local cache = Kernels[program]
+   if not cache then cache = {}; Kernels[program] = cache end
+   local kernel = cache[name]
+   if not kernel or cl.type(kernel) ~= 'kernel' then
+      local ok
+      ok, kernel = pcall(cl.create_kernel, program, name)
+      if not ok then error(kernel, 2) end
+      cache[name] = kernel
+      MemoStats.kernel_misses = MemoStats.kernel_misses + 1
+   else
+      MemoStats.kernel_hits = MemoStats.kernel_hits + 1
+   end
+   if not clone then return kernel end
+   local ok, cloned = pcall(cl.clone_kernel, kernel)
+   if ok then return cloned end
+   return cl.create_kernel(program, name)
+end
+
+function cl.memoization_stats()
+   local t = {}
+   for k, v in pairs(MemoStats) do t[k] = v end
+   return t
+end
+
 function cl.release_events(events)
    for _, ev in ipairs(events) do cl.release_event(ev) end
 end
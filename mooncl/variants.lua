@@ -0,0 +1,254 @@
+-- The MIT License (MIT)
+--
+-- Copyright (c) 2017 Stefano Trettel
+--
+-- Software repository: MoonCL, https://github.com/stetre/mooncl
+--
+-- Permission is hereby granted, free of charge, to any person obtaining a copy
+-- of this software and associated documentation files (the "Software"), to deal
+-- in the Software without restriction, including without limitation the rights
+-- to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+-- copies of the Software, and to permit persons to whom the Software is
+-- furnished to do so, subject to the following conditions:
+--
+-- The above copyright notice and this permission notice shall be included in all
+-- copies or substantial portions of the Software.
+--
+-- THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+-- IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+-- FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+-- AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+-- LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+-- OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+-- SOFTWARE.
+-- 
+
+-- *********************************************************************
+-- DO NOT require() THIS MODULE (it is loaded automatically by MoonCL)
+-- *********************************************************************
+
+
+local cl = mooncl -- require("mooncl")
+
+-- Kernel variants -------------------------------------------------------
+-- A variant set holds a program source parametrized by -D macros, and
+-- lazily builds (and caches, up to a given capacity with LRU eviction) the
+-- programs for the requested combinations of parameter values.
+-- The set owns the programs and kernels it creates, and deletes them when
+-- their variants are evicted or cleared.
+
+local VariantSet = {}
+VariantSet.__index = VariantSet
+
+local function sorted_keys(t)
+   local keys = {}
+   for k in pairs(t) do keys[#keys+1] = k end
+   table.sort(keys)
+   return keys
+end
+
+local function check_value(self, name, value)
+   local allowed = self.params[name]
+   if allowed == nil then
+      error("unknown variant parameter '"..tostring(name).."'", 3)
+   end
+   if type(allowed) == 'table' then
+      for _, v in ipairs(allowed) do if v == value then return end end
+      error("invalid value '"..tostring(value).."' for variant parameter '"..name.."'", 3)
+   end
+end
+
+local function make_options(self, values)
+-- Returns the build options for the given parameter values (which is also the variant's key)
+   for name, value in pairs(values) do check_value(self, name, value) end
+   local t = { self.options }
+   for _, name in ipairs(self.names) do
+      local value = values[name]
+      if value == nil then value = self.defaults[name] end
+      if value == nil then error("missing value for variant parameter '"..name.."'", 3) end
+      if type(value) == 'boolean' then value = value and 1 or 0 end
+      t[#t+1] = "-D"..name.."="..tostring(value)
+   end
+   return table.concat(t, " ")
+end
+
+local function touch(self, entry)
+   self.tick = self.tick + 1
+   entry.tick = self.tick
+end
+
+local function settle(self, key, entry)
+-- Waits for the asynchronous build of a precompiled variant to complete, and stores
+-- its binaries in the program cache. Returns true if the build succeeded.
+   cl.wait_builds(entry.program)
+   entry.pending = nil
+   if cl.check_build(entry.program) ~= 'success' then return false end
+   if cl.program_cache() then cl.program_cache_store(entry.program, self.source, key) end
+   return true
+end
+
+local function delete(self, key, entry)
+-- Removes a variant from the set and deletes its kernels and program (the set owns them)
+   self.entries[key] = nil
+   self.count = self.count - 1
+   for _, kernel in pairs(entry.kernels) do
+      if cl.type(kernel) == 'kernel' then kernel:delete() end
+   end
+   if cl.type(entry.program) == 'program' then entry.program:delete() end
+end
+
+local function evict(self)
+-- Evicts the least recently used variants in excess of capacity, waiting for their
+-- builds to complete if they are still pending.
+   while self.count > self.capacity do
+      local lru_key, lru
+      for key, entry in pairs(self.entries) do
+         if not lru or entry.tick < lru.tick then lru_key, lru = key, entry end
+      end
+      if lru.pending then settle(self, lru_key, lru) end
+      delete(self, lru_key, lru)
+      self.counters.evictions = self.counters.evictions + 1
+   end
+end
+
+local function insert(self, key, entry)
+   self.entries[key] = entry
+   self.count = self.count + 1
+   touch(self, entry)
+   evict(self)
+end
+
+local function finish_pending(self, key, entry)
+-- Completes the asynchronous build of a precompiled variant, raising an error (with
+-- the build logs) if it failed
+   if settle(self, key, entry) then return end
+   local t = { "build program failure ("..key..")" }
+   for i, dev in ipairs(cl.get_program_info(entry.program, 'devices')) do
+      t[#t+1] = "device-".. i .." log:"
+      t[#t+1] = cl.get_program_build_info(entry.program, dev, 'log')
+   end
+   delete(self, key, entry)
+   error(table.concat(t, '\n'), 3)
+end
+
+function VariantSet:variant(values, kernelname)
+-- Returns the program for the given parameter values, and the kernel named kernelname
+-- (default: the set's kernel name, if any), building the program if not cached.
+   local key = make_options(self, values or {})
+   local entry = self.entries[key]
+   if entry then
+      if entry.pending then finish_pending(self, key, entry) end
+      self.counters.hits = self.counters.hits + 1
+      touch(self, entry)
+   else
+      local ok, program = pcall(cl.make_program_with_source, self.context, self.source, self.devices, key)
+      if not ok then error(program, 2) end
+      entry = { program = program, kernels = {} }
+      self.counters.misses = self.counters.misses + 1
+      self.counters.built = self.counters.built + 1
+      insert(self, key, entry)
+   end
+   kernelname = kernelname or self.kernel
+   if not kernelname then return entry.program end
+   local kernel = entry.kernels[kernelname]
+   if not kernel or cl.type(kernel) ~= 'kernel' then
+      kernel = cl.create_kernel(entry.program, kernelname)
+      entry.kernels[kernelname] = kernel
+   end
+   return entry.program, kernel
+end
+
+local function combinations(self)
+-- Returns the list of all the combinations of the parameters' allowed values
+   local list = { {} }
+   for _, name in ipairs(self.names) do
+      local allowed = self.params[name]
+      if type(allowed) ~= 'table' then allowed = { self.defaults[name] } end
+      local expanded = {}
+      for _, values in ipairs(list) do
+         for _, v in ipairs(allowed) do
+            local t = {}
+            for k, x in pairs(values) do t[k] = x end
+            t[name] = v
+            expanded[#expanded+1] = t
+         end
+      end
+      list = expanded
+   end
+   return list
+end
+
+function VariantSet:precompile(list)
+-- Starts asynchronous builds for the given list of parameter values (default: the full
+-- matrix of allowed values), skipping the variants already cached. Returns the number
+-- of builds started. The builds complete in background, and variant() waits for them.
+   local n = 0
+   for _, values in ipairs(list or combinations(self)) do
+      local key = make_options(self, values)
+      if not self.entries[key] then
+         local program = cl.program_cache() and
+            cl.program_cache_load(self.context, self.source, self.devices, key)
+         if program then
+            insert(self, key, { program = program, kernels = {} })
+         else
+            program = cl.create_program_with_source(self.context, self.source)
+            local ok, errcode = cl.build_program_async(program, self.devices, key)
+            if not ok then error(errcode, 2) end
+            insert(self, key, { program = program, kernels = {}, pending = true })
+            self.counters.built = self.counters.built + 1
+            n = n + 1
+         end
+      end
+   end
+   return n
+end
+
+function VariantSet:wait(timeout)
+-- Waits for all the pending precompilations to complete (or timeout seconds).
+-- The completed ones are settled, so that they become evictable. The failed ones
+-- stay pending, so that variant() reports their build errors.
+   local programs = {}
+   for _, entry in pairs(self.entries) do
+      if entry.pending then programs[#programs+1] = entry.program end
+   end
+   if #programs == 0 then return true end
+   local done = cl.wait_builds(programs, timeout)
+   for key, entry in pairs(self.entries) do
+      if entry.pending and cl.check_build(entry.program) == 'success' then settle(self, key, entry) end
+   end
+   return done
+end
+
+function VariantSet:stats()
+   local t = { cached = self.count, capacity = self.capacity }
+   for k, v in pairs(self.counters) do t[k] = v end
+   return t
+end
+
+function VariantSet:clear()
+-- Deletes all the cached variants (waiting for pending builds first)
+   self:wait()
+   for key, entry in pairs(self.entries) do delete(self, key, entry) end
+end
+
+function cl.kernel_variants(context, source, spec)
+-- spec = { params = { NAME = {values} | true }, [defaults = {NAME = value}],
+--          [options = string], [devices = {device}], [kernel = name], [capacity = integer] }
+   spec = spec or {}
+   local self = setmetatable({}, VariantSet)
+   self.context = context
+   self.source = source
+   self.params = spec.params or {}
+   self.defaults = spec.defaults or {}
+   self.options = spec.options or ""
+   self.devices = spec.devices
+   self.kernel = spec.kernel
+   self.capacity = spec.capacity or 64
+   if type(self.capacity) ~= 'number' or self.capacity < 1 then error("invalid capacity", 2) end
+   self.names = sorted_keys(self.params)
+   self.entries = {} -- options -> { program, kernels, tick, pending }
+   self.count = 0
+   self.tick = 0
+   self.counters = { hits = 0, misses = 0, evictions = 0, built = 0 }
+   return self
+end
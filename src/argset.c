@@ -0,0 +1,464 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Stefano Trettel
+ *
+ * Software repository: MoonCL, https://github.com/stetre/mooncl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "internal.h"
+
+/* Kernel argument sets.
+ * An argset caches the kinds of the arguments of a kernel, and sets all of them
+ * in a single call, skipping those whose value has not changed since the last call.
+ */
+
+#define SLOT_MEM        1   /* buffer, image, or pipe */
+#define SLOT_SAMPLER    2
+#define SLOT_QUEUE      3
+#define SLOT_LOCAL      4   /* __local memory (the value is its size) */
+#define SLOT_PRIM       5   /* scalar or vector of a primitive type */
+#define SLOT_BYTES      6   /* binary string (e.g. a struct) */
+
+typedef struct {
+    int kind;       /* SLOT_XXX */
+    int type;       /* primitive type (SLOT_PRIM) */
+    cl_uint n;      /* no. of elements (SLOT_PRIM), 1 for scalars */
+    int applied;    /* a value was already set */
+    size_t size;    /* size of the value last set */
+    ud_t *ud;       /* userdata of the object last set (SLOT_MEM, SLOT_SAMPLER, SLOT_QUEUE) */
+    union {
+        void *object;
+        cl_double align_;
+        char data[KERNELARG_MAXINLINE];
+    } u;            /* value last set */
+} slot_t;
+
+struct mooncl_argset_s {
+    cl_kernel kernel;
+    cl_uint count;  /* no. of arguments */
+    slot_t slot[];
+};
+
+static const struct {
+    const char *name;
+    int type;
+} PrimTypes[] = {
+    { "char", NONCL_TYPE_CHAR },
+    { "uchar", NONCL_TYPE_UCHAR },
+    { "short", NONCL_TYPE_SHORT },
+    { "ushort", NONCL_TYPE_USHORT },
+    { "int", NONCL_TYPE_INT },
+    { "uint", NONCL_TYPE_UINT },
+    { "long", NONCL_TYPE_LONG },
+    { "ulong", NONCL_TYPE_ULONG },
+    { "half", NONCL_TYPE_HALF },
+    { "float", NONCL_TYPE_FLOAT },
+    { "double", NONCL_TYPE_DOUBLE },
+    { NULL, 0 }
+};
+
+static int ParsePrimType(const char *s, slot_t *slot)
+/* Parses a type name such as 'float' or 'float4'. Returns 1 on success. */
+    {
+    size_t len, i;
+    unsigned long n = 1;
+    char *end;
+
+    len = strlen(s);
+    while(len > 0 && s[len-1] >= '0' && s[len-1] <= '9') len--;
+    if(s[len] != '\0')
+        {
+        n = strtoul(s + len, &end, 10);
+        if(n != 2 && n != 3 && n != 4 && n != 8 && n != 16)
+            return 0;
+        }
+    for(i = 0; PrimTypes[i].name != NULL; i++)
+        {
+        if(strlen(PrimTypes[i].name) == len && strncmp(s, PrimTypes[i].name, len) == 0)
+            {
+            slot->kind = SLOT_PRIM;
+            slot->type = PrimTypes[i].type;
+            slot->n = n;
+            return 1;
+            }
+        }
+    return 0;
+    }
+
+static int ParseDescriptor(const char *s, slot_t *slot)
+    {
+    if(strcmp(s, "mem") == 0) slot->kind = SLOT_MEM;
+    else if(strcmp(s, "sampler") == 0) slot->kind = SLOT_SAMPLER;
+    else if(strcmp(s, "queue") == 0) slot->kind = SLOT_QUEUE;
+    else if(strcmp(s, "local") == 0) slot->kind = SLOT_LOCAL;
+    else if(strcmp(s, "bytes") == 0) slot->kind = SLOT_BYTES;
+    else return ParsePrimType(s, slot);
+    return 1;
+    }
+
+static void PushDescriptor(lua_State *L, slot_t *slot)
+    {
+    switch(slot->kind)
+        {
+        case SLOT_MEM: lua_pushstring(L, "mem"); break;
+        case SLOT_SAMPLER: lua_pushstring(L, "sampler"); break;
+        case SLOT_QUEUE: lua_pushstring(L, "queue"); break;
+        case SLOT_LOCAL: lua_pushstring(L, "local"); break;
+        case SLOT_BYTES: lua_pushstring(L, "bytes"); break;
+        case SLOT_PRIM:
+            pushprimtype(L, slot->type);
+            if(slot->n > 1)
+                {
+                lua_pushinteger(L, slot->n);
+                lua_concat(L, 2);
+                }
+            break;
+        default: lua_pushnil(L);
+        }
+    }
+
+static cl_int FromArgInfo(cl_kernel kernel, cl_uint index, slot_t *slot)
+/* Determines the kind of the argument from clGetKernelArgInfo() */
+    {
+    cl_int ec;
+    cl_kernel_arg_address_qualifier qualifier;
+    char name[128];
+
+    ec = cl.GetKernelArgInfo(kernel, index, CL_KERNEL_ARG_ADDRESS_QUALIFIER, sizeof(qualifier), &qualifier, NULL);
+    if(ec == CL_SUCCESS)
+        ec = cl.GetKernelArgInfo(kernel, index, CL_KERNEL_ARG_TYPE_NAME, sizeof(name), name, NULL);
+    if(ec)
+        return ec;
+    name[sizeof(name) - 1] = '\0';
+
+    switch(qualifier)
+        {
+        case CL_KERNEL_ARG_ADDRESS_GLOBAL:
+        case CL_KERNEL_ARG_ADDRESS_CONSTANT: slot->kind = SLOT_MEM; return CL_SUCCESS;
+        case CL_KERNEL_ARG_ADDRESS_LOCAL: slot->kind = SLOT_LOCAL; return CL_SUCCESS;
+        default: break;
+        }
+    if(strncmp(name, "image", 5) == 0 || strncmp(name, "pipe", 4) == 0)
+        slot->kind = SLOT_MEM;
+    else if(strcmp(name, "sampler_t") == 0)
+        slot->kind = SLOT_SAMPLER;
+    else if(strcmp(name, "queue_t") == 0)
+        slot->kind = SLOT_QUEUE;
+    else if(!ParsePrimType(name, slot))
+        slot->kind = SLOT_BYTES;
+    return CL_SUCCESS;
+    }
+
+static int freeargset(lua_State *L, ud_t *ud)
+    {
+    cl_argset argset = (cl_argset)ud->handle;
+    if(!freeuserdata(L, ud, "argset")) return 0;
+    Free(L, argset);
+    return 0;
+    }
+
+static int CreateKernelArgSet(lua_State *L)
+    {
+    cl_int ec;
+    cl_uint count, i;
+    ud_t *ud, *kernel_ud;
+    cl_argset argset;
+    cl_kernel kernel = checkkernel(L, 1, &kernel_ud);
+
+    ec = cl.GetKernelInfo(kernel, CL_KERNEL_NUM_ARGS, sizeof(count), &count, NULL);
+    CheckError(L, ec);
+    if(!lua_isnoneornil(L, 2))
+        {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        if(luaL_len(L, 2) != count)
+            return luaL_argerror(L, 2, "table length must be the number of kernel args");
+        }
+    else if(!cl.GetKernelArgInfo)
+        return luaL_argerror(L, 2, "missing types (kernel arg info not available)");
+
+    argset = (cl_argset)Malloc(L, sizeof(argset_t) + count * sizeof(slot_t));
+    argset->kernel = kernel;
+    argset->count = count;
+#define CLEANUP() do { Free(L, argset); } while(0)
+    for(i = 0; i < count; i++)
+        {
+        if(lua_isnoneornil(L, 2))
+            {
+            ec = FromArgInfo(kernel, i, &argset->slot[i]);
+            if(ec == CL_KERNEL_ARG_INFO_NOT_AVAILABLE)
+                {
+                CLEANUP();
+                return luaL_argerror(L, 2, "missing types (kernel arg info not available)");
+                }
+            if(ec)
+                { CLEANUP(); CheckError(L, ec); }
+            continue;
+            }
+        lua_rawgeti(L, 2, i+1);
+        if(lua_type(L, -1) != LUA_TSTRING || !ParseDescriptor(lua_tostring(L, -1), &argset->slot[i]))
+            {
+            CLEANUP();
+            return luaL_argerror(L, 2, lua_pushfstring(L, "invalid type for arg %d", i));
+            }
+        lua_pop(L, 1);
+        }
+#undef CLEANUP
+    ud = newuserdata(L, argset, kernel_ud, ARGSET_MT, "argset");
+    ud->program = kernel_ud->program;
+    ud->destructor = freeargset;
+    return 1;
+    }
+
+static int PackElement(lua_State *L, int arg, int type, char *dst)
+/* Converts the element at arg to the given primitive type and writes it at dst */
+    {
+    int isnum;
+    lua_Integer ival;
+    lua_Number nval;
+    switch(type)
+        {
+#define P(T, what, v) do {                                  \
+            v = lua_to##what##x(L, arg, &isnum);            \
+            if(!isnum) return ERR_TYPE;                     \
+            *(T*)dst = (T)v;                                \
+        } while(0)
+        case NONCL_TYPE_CHAR:   P(cl_char, integer, ival); break;
+        case NONCL_TYPE_UCHAR:  P(cl_uchar, integer, ival); break;
+        case NONCL_TYPE_SHORT:  P(cl_short, integer, ival); break;
+        case NONCL_TYPE_USHORT: P(cl_ushort, integer, ival); break;
+        case NONCL_TYPE_INT:    P(cl_int, integer, ival); break;
+        case NONCL_TYPE_UINT:   P(cl_uint, integer, ival); break;
+        case NONCL_TYPE_LONG:   P(cl_long, integer, ival); break;
+        case NONCL_TYPE_ULONG:  P(cl_ulong, integer, ival); break;
+        case NONCL_TYPE_HALF:
+            nval = lua_tonumberx(L, arg, &isnum);
+            if(!isnum) return ERR_TYPE;
+            *(cl_half*)dst = tohalf(nval);
+            break;
+        case NONCL_TYPE_FLOAT:  P(cl_float, number, nval); break;
+        case NONCL_TYPE_DOUBLE: P(cl_double, number, nval); break;
+        default: return ERR_UNKNOWN;
+#undef P
+        }
+    return ERR_SUCCESS;
+    }
+
+static int CheckValue(lua_State *L, int arg, slot_t *slot, slot_t *value)
+/* Checks the value at arg for the given slot and stores it in value->u/size/ud.
+ * Returns ERR_SUCCESS or an ERR_XXX code.
+ */
+    {
+    int err, isnum;
+    cl_uint i, n;
+    size_t esize;
+    lua_Integer size;
+
+    value->ud = NULL;
+    switch(slot->kind)
+        {
+        case SLOT_MEM:
+            value->u.object = testmemobject(L, arg, &value->ud);
+            value->size = sizeof(cl_mem);
+            return value->u.object ? ERR_SUCCESS : ERR_TYPE;
+        case SLOT_SAMPLER:
+            value->u.object = testsampler(L, arg, &value->ud);
+            value->size = sizeof(cl_sampler);
+            return value->u.object ? ERR_SUCCESS : ERR_TYPE;
+        case SLOT_QUEUE:
+            value->u.object = testqueue(L, arg, &value->ud);
+            value->size = sizeof(cl_queue);
+            return value->u.object ? ERR_SUCCESS : ERR_TYPE;
+        case SLOT_LOCAL:
+            size = lua_tointegerx(L, arg, &isnum);
+            if(!isnum) return ERR_TYPE;
+            if(size <= 0) return ERR_VALUE;
+            value->size = (size_t)size;
+            return ERR_SUCCESS;
+        case SLOT_PRIM:
+            esize = sizeofprimtype(slot->type);
+            if(slot->n == 1)
+                {
+                value->size = esize;
+                return PackElement(L, arg, slot->type, value->u.data);
+                }
+            if(lua_type(L, arg) != LUA_TTABLE)
+                return ERR_TABLE;
+            n = lua_rawlen(L, arg);
+            if(n != slot->n)
+                return ERR_LENGTH;
+            /* 3-component vectors have the same size as 4-component ones */
+            value->size = (n == 3 ? 4 : n) * esize;
+            memset(value->u.data, 0, value->size);
+            for(i = 0; i < n; i++)
+                {
+                lua_rawgeti(L, arg, i+1);
+                err = PackElement(L, -1, slot->type, value->u.data + i * esize);
+                lua_pop(L, 1);
+                if(err) return err;
+                }
+            return ERR_SUCCESS;
+        case SLOT_BYTES:
+            if(lua_type(L, arg) != LUA_TSTRING)
+                return ERR_TYPE;
+            return ERR_SUCCESS;
+        default:
+            break;
+        }
+    return ERR_UNKNOWN;
+    }
+
+static int Apply(lua_State *L)
+/* n = argset:apply({values}) 
+ * Sets the kernel arguments, and returns the number of clSetKernelArg() calls.
+ */
+    {
+    int err;
+    cl_int ec;
+    cl_uint i, n;
+    const void *arg_value;
+    size_t arg_size;
+    slot_t *slot;
+    slot_t value;
+    cl_argset argset = checkargset(L, 1, NULL);
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    n = 0;
+    for(i = 0; i < argset->count; i++)
+        {
+        slot = &argset->slot[i];
+        lua_rawgeti(L, 2, i+1);
+        if(lua_isnil(L, -1)) /* leave unchanged */
+            { lua_pop(L, 1); continue; }
+        err = CheckValue(L, -1, slot, &value);
+        if(err)
+            return luaL_error(L, "arg %d: %s", i, errstring(err));
+
+        switch(slot->kind)
+            {
+            case SLOT_MEM:
+            case SLOT_SAMPLER:
+            case SLOT_QUEUE:
+                if(slot->applied && slot->u.object == value.u.object && slot->ud == value.ud)
+                    { lua_pop(L, 1); continue; }
+                arg_value = &value.u.object;
+                arg_size = value.size;
+                break;
+            case SLOT_LOCAL:
+                if(slot->applied && slot->size == value.size)
+                    { lua_pop(L, 1); continue; }
+                arg_value = NULL;
+                arg_size = value.size;
+                break;
+            case SLOT_PRIM:
+                if(slot->applied && memcmp(slot->u.data, value.u.data, value.size) == 0)
+                    { lua_pop(L, 1); continue; }
+                arg_value = value.u.data;
+                arg_size = value.size;
+                break;
+            case SLOT_BYTES: /* always set */
+                arg_value = lua_tolstring(L, -1, &arg_size);
+                break;
+            default:
+                return unexpected(L);
+            }
+
+        ec = cl.SetKernelArg(argset->kernel, i, arg_size, arg_value);
+        if(ec)
+            {
+            slot->applied = 0;
+            pusherrcode(L, ec);
+            return luaL_error(L, "arg %d: %s", i, lua_tostring(L, -1));
+            }
+        lua_pop(L, 1);
+        n++;
+        slot->applied = 1;
+        slot->size = arg_size;
+        slot->ud = value.ud;
+        if(slot->kind != SLOT_BYTES && slot->kind != SLOT_LOCAL)
+            memcpy(&slot->u, &value.u, value.size);
+        }
+    lua_pushinteger(L, n);
+    return 1;
+    }
+
+static int Invalidate(lua_State *L)
+/* Forces the next apply() to set all the args */
+    {
+    cl_uint i;
+    cl_argset argset = checkargset(L, 1, NULL);
+    for(i = 0; i < argset->count; i++)
+        argset->slot[i].applied = 0;
+    return 0;
+    }
+
+static int Types(lua_State *L)
+    {
+    cl_uint i;
+    cl_argset argset = checkargset(L, 1, NULL);
+    lua_newtable(L);
+    for(i = 0; i < argset->count; i++)
+        {
+        PushDescriptor(L, &argset->slot[i]);
+        lua_rawseti(L, -2, i+1);
+        }
+    return 1;
+    }
+
+static int Kernel(lua_State *L)
+    {
+    cl_argset argset = checkargset(L, 1, NULL);
+    return pushkernel(L, argset->kernel);
+    }
+
+RAW_FUNC(argset)
+TYPE_FUNC(argset)
+DELETE_FUNC(argset)
+
+static const struct luaL_Reg Methods[] = 
+    {
+        { "raw", Raw },
+        { "type", Type },
+        { "free", Delete },
+        { "kernel", Kernel },
+        { "types", Types },
+        { "apply", Apply },
+        { "invalidate", Invalidate },
+        { NULL, NULL } /* sentinel */
+    };
+
+static const struct luaL_Reg MetaMethods[] = 
+    {
+        { "__gc",  Delete },
+        { NULL, NULL } /* sentinel */
+    };
+
+static const struct luaL_Reg Functions[] = 
+    {
+        { "create_kernel_arg_set", CreateKernelArgSet },
+        { NULL, NULL } /* sentinel */
+    };
+
+void mooncl_open_argset(lua_State *L)
+    {
+    udata_define(L, ARGSET_MT, Methods, MetaMethods);
+    luaL_setfuncs(L, Functions, 0);
+    }
+
@@ -0,0 +1,310 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Stefano Trettel
+ *
+ * Software repository: MoonCL, https://github.com/stetre/mooncl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "internal.h"
+
+/* Typed arrays.
+ *
+ * An array is an hostmem whose memory is interpreted as a sequence of elements of
+ * a given primtype, that can be accessed individually with a[i] (1-based) and #a.
+ * Since arrays inherit from hostmem, they can be used wherever an hostmem is
+ * accepted (e.g. as host pointer when creating buffers, or as source/destination
+ * in read/write commands), and all the hostmem methods apply to them.
+ */
+
+#define ALIGNMENT 64
+
+static int ToElement(lua_State *L, int arg, int type, void *dst)
+/* Converts the value at arg and writes it at dst */
+    {
+    int isnum;
+    lua_Integer ival;
+    lua_Number nval;
+    switch(type)
+        {
+#define P(T, what, v) do {                                  \
+            v = lua_to##what##x(L, arg, &isnum);            \
+            if(!isnum) return ERR_TYPE;                     \
+            *(T*)dst = (T)v;                                \
+        } while(0)
+        case NONCL_TYPE_CHAR:   P(cl_char, integer, ival); break;
+        case NONCL_TYPE_UCHAR:  P(cl_uchar, integer, ival); break;
+        case NONCL_TYPE_SHORT:  P(cl_short, integer, ival); break;
+        case NONCL_TYPE_USHORT: P(cl_ushort, integer, ival); break;
+        case NONCL_TYPE_INT:    P(cl_int, integer, ival); break;
+        case NONCL_TYPE_UINT:   P(cl_uint, integer, ival); break;
+        case NONCL_TYPE_LONG:   P(cl_long, integer, ival); break;
+        case NONCL_TYPE_ULONG:  P(cl_ulong, integer, ival); break;
+        case NONCL_TYPE_HALF:
+            nval = lua_tonumberx(L, arg, &isnum);
+            if(!isnum) return ERR_TYPE;
+            *(cl_half*)dst = tohalf(nval);
+            break;
+        case NONCL_TYPE_FLOAT:  P(cl_float, number, nval); break;
+        case NONCL_TYPE_DOUBLE: P(cl_double, number, nval); break;
+        default: return ERR_UNKNOWN;
+#undef P
+        }
+    return ERR_SUCCESS;
+    }
+
+static void PushElement(lua_State *L, int type, const void *src)
+    {
+    switch(type)
+        {
+        case NONCL_TYPE_CHAR:   lua_pushinteger(L, *(cl_char*)src); break;
+        case NONCL_TYPE_UCHAR:  lua_pushinteger(L, *(cl_uchar*)src); break;
+        case NONCL_TYPE_SHORT:  lua_pushinteger(L, *(cl_short*)src); break;
+        case NONCL_TYPE_USHORT: lua_pushinteger(L, *(cl_ushort*)src); break;
+        case NONCL_TYPE_INT:    lua_pushinteger(L, *(cl_int*)src); break;
+        case NONCL_TYPE_UINT:   lua_pushinteger(L, *(cl_uint*)src); break;
+        case NONCL_TYPE_LONG:   lua_pushinteger(L, *(cl_long*)src); break;
+        case NONCL_TYPE_ULONG:  lua_pushinteger(L, *(cl_ulong*)src); break;
+        case NONCL_TYPE_HALF:   lua_pushnumber(L, fromhalf(*(cl_half*)src)); break;
+        case NONCL_TYPE_FLOAT:  lua_pushnumber(L, *(cl_float*)src); break;
+        case NONCL_TYPE_DOUBLE: lua_pushnumber(L, *(cl_double*)src); break;
+        default: lua_pushnil(L);
+        }
+    }
+
+static cl_array NewArray(lua_State *L, int type, char *ptr, size_t n, ud_t *parent_ud)
+/* If parent_ud is NULL, the array owns the memory: ptr must have been allocated with
+ * hostmemalloc(), or be NULL to have the memory for n elements allocated here.
+ */
+    {
+    ud_t *ud;
+    cl_array array = (cl_array)MallocNoErr(L, sizeof(array_t));
+    if(!array)
+        {
+        if(!parent_ud && ptr) hostmemfree(ptr);
+        luaL_error(L, errstring(ERR_MEMORY));
+        return NULL;
+        }
+    array->type = type;
+    array->esize = sizeofprimtype(type);
+    array->n = n;
+    array->hostmem.size = n * array->esize;
+    array->hostmem.ref = LUA_NOREF;
+    if(!parent_ud && !ptr)
+        {
+        ptr = (char*)hostmemalloc(ALIGNMENT, array->hostmem.size);
+        if(!ptr)
+            {
+            Free(L, array);
+            luaL_error(L, errstring(ERR_MEMORY));
+            return NULL;
+            }
+        }
+    array->hostmem.ptr = ptr;
+    ud = newhostmemobject(L, &array->hostmem, parent_ud, ARRAY_MT, "array");
+    if(!parent_ud)
+        MarkAllocated(ud);
+    return array;
+    }
+
+static int Create(lua_State *L)
+/* array = array(primtype, n)
+ * array = array(primtype, {values})
+ */
+    {
+    int err;
+    size_t n, size;
+    lua_Integer len;
+    char *ptr;
+    cl_array array;
+    int type = checkprimtype(L, 1);
+    size_t esize = sizeofprimtype(type);
+    if(lua_type(L, 2) == LUA_TTABLE)
+        {
+        n = countdata(L, 2, 1);
+        if(n == 0)
+            return luaL_argerror(L, 2, errstring(ERR_EMPTY));
+        if(n > SIZE_MAX / esize)
+            return luaL_argerror(L, 2, errstring(ERR_LENGTH));
+        /* pack before creating the object, so that nothing is left behind on errors */
+        size = n * esize;
+        ptr = (char*)hostmemalloc(ALIGNMENT, size);
+        if(!ptr)
+            return luaL_error(L, errstring(ERR_MEMORY));
+        err = packdata(L, 2, type, ptr, size, NULL);
+        if(err)
+            {
+            hostmemfree(ptr);
+            return luaL_argerror(L, 2, errstring(err));
+            }
+        NewArray(L, type, ptr, n, NULL);
+        return 1;
+        }
+    len = luaL_checkinteger(L, 2);
+    if(len < 1 || (uint64_t)len > SIZE_MAX / esize)
+        return luaL_argerror(L, 2, errstring(ERR_LENGTH));
+    array = NewArray(L, type, NULL, (size_t)len, NULL);
+    parallelmemset(array->hostmem.ptr, 0, array->hostmem.size);
+    return 1;
+    }
+
+static cl_array TestArray(lua_State *L, int arg)
+/* Fast check for the metamethods */
+    {
+    ud_t *ud = (ud_t*)luaL_testudata(L, arg, ARRAY_MT);
+    return (ud && IsValid(ud)) ? (cl_array)ud->handle : NULL;
+    }
+
+static int Index(lua_State *L)
+    {
+    int isint;
+    lua_Integer i;
+    cl_array array;
+    if(lua_type(L, 2) == LUA_TNUMBER && (array = TestArray(L, 1)) != NULL)
+        {
+        i = lua_tointegerx(L, 2, &isint);
+        if(!isint || i < 1 || (size_t)i > array->n)
+            return 0; /* nil, as for tables */
+        PushElement(L, array->type, array->hostmem.ptr + (i-1) * array->esize);
+        return 1;
+        }
+    /* look up the methods table (upvalue) */
+    lua_pushvalue(L, 2);
+    lua_gettable(L, lua_upvalueindex(1));
+    return 1;
+    }
+
+static int NewIndex(lua_State *L)
+    {
+    int isint;
+    lua_Integer i;
+    cl_array array = checkarray(L, 1, NULL);
+    i = lua_tointegerx(L, 2, &isint);
+    if(!isint)
+        return luaL_argerror(L, 2, "integer index expected");
+    if(i < 1 || (size_t)i > array->n)
+        return luaL_argerror(L, 2, "index out of range");
+    if(ToElement(L, 3, array->type, array->hostmem.ptr + (i-1) * array->esize) != ERR_SUCCESS)
+        return luaL_argerror(L, 3, errstring(ERR_TYPE));
+    return 0;
+    }
+
+static int Len(lua_State *L)
+    {
+    cl_array array = checkarray(L, 1, NULL);
+    lua_pushinteger(L, array->n);
+    return 1;
+    }
+
+static void CheckRange(lua_State *L, int arg, cl_array array, size_t *first, size_t *last)
+/* Checks the optional 1-based range [i, j] at arg, arg+1 (default: all the elements) */
+    {
+    *first = luaL_optinteger(L, arg, 1);
+    *last = luaL_optinteger(L, arg+1, array->n);
+    if(*first < 1 || *first > array->n)
+        luaL_argerror(L, arg, "index out of range");
+    if(*last < *first || *last > array->n)
+        luaL_argerror(L, arg+1, "index out of range");
+    }
+
+static int Slice(lua_State *L)
+/* slice = array:slice(i, [j]) */
+    {
+    size_t first, last;
+    ud_t *parent_ud;
+    cl_array slice;
+    cl_array array = checkarray(L, 1, &parent_ud);
+    luaL_checkinteger(L, 2);
+    CheckRange(L, 2, array, &first, &last);
+    slice = NewArray(L, array->type, array->hostmem.ptr + (first-1) * array->esize,
+                        last - first + 1, parent_ud);
+    /* anchor the parent, so that it is not collected while the slice is in use */
+    lua_pushvalue(L, 1);
+    slice->hostmem.ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    return 1;
+    }
+
+static int ToTable(lua_State *L)
+/* {values} = array:totable([i], [j]) */
+    {
+    size_t first, last;
+    cl_array array = checkarray(L, 1, NULL);
+    CheckRange(L, 2, array, &first, &last);
+    return pushdata(L, array->type, array->hostmem.ptr + (first-1) * array->esize,
+                    (last - first + 1) * array->esize);
+    }
+
+static int Fill(lua_State *L)
+/* array:fill(value, [i], [j]) */
+    {
+    size_t first, last, k;
+    char *p;
+    cl_array array = checkarray(L, 1, NULL);
+    CheckRange(L, 3, array, &first, &last);
+    p = array->hostmem.ptr + (first-1) * array->esize;
+    if(ToElement(L, 2, array->type, p) != ERR_SUCCESS)
+        return luaL_argerror(L, 2, errstring(ERR_TYPE));
+    for(k = first; k < last; k++, p += array->esize)
+        memcpy(p + array->esize, p, array->esize);
+    return 0;
+    }
+
+static int Primtype(lua_State *L)
+    {
+    cl_array array = checkarray(L, 1, NULL);
+    pushprimtype(L, array->type);
+    return 1;
+    }
+
+TYPE_FUNC(array)
+DELETE_FUNC(array)
+
+static const struct luaL_Reg Methods[] = 
+    {
+        { "type", Type },
+        { "primtype", Primtype },
+        { "slice", Slice },
+        { "totable", ToTable },
+        { "fill", Fill },
+        { NULL, NULL } /* sentinel */
+    };
+
+static const struct luaL_Reg MetaMethods[] = 
+    {
+        { "__gc",  Delete },
+        { "__newindex",  NewIndex },
+        { "__len",  Len },
+        { NULL, NULL } /* sentinel */
+    };
+
+static const struct luaL_Reg Functions[] = 
+    {
+        { "array", Create },
+        { NULL, NULL } /* sentinel */
+    };
+
+void mooncl_open_array(lua_State *L)
+    {
+    udata_define(L, ARRAY_MT, Methods, MetaMethods);
+    udata_inherit(L, ARRAY_MT, HOSTMEM_MT);
+    udata_setindex(L, ARRAY_MT, Index);
+    luaL_setfuncs(L, Functions, 0);
+    }
+
@@ -0,0 +1,504 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Stefano Trettel
+ *
+ * Software repository: MoonCL, https://github.com/stetre/mooncl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "internal.h"
+
+/* Batched command submission.
+ *
+ * A command is a table {name, arg1, arg2, ...} where name is the name of the
+ * corresponding enqueue function without the 'enqueue_' prefix, and the args are
+ * the same as for that function, except for the queue.
+ * In wait lists, an integer i denotes the event generated by the i-th command
+ * of the same list. Such events are created internally and released when no
+ * longer needed, unless the caller also asked for them (ge=true).
+ */
+
+static const char *CommandNames[] = {
+    "read_buffer",
+    "write_buffer",
+    "copy_buffer",
+    "fill_buffer",
+    "ndrange_kernel",
+    "task",
+    "marker",
+    "barrier",
+    "set_kernel_arg",
+    NULL
+};
+
+void *anchoredalloc(lua_State *L, int anchor, size_t size)
+/* Allocates a memory block whose lifetime is bound to the table at anchor */
+    {
+    void *ptr = lua_newuserdata(L, size);
+    lua_rawseti(L, anchor, lua_rawlen(L, anchor) + 1);
+    return ptr;
+    }
+
+#define Error(L, index, pos, msg) \
+    luaL_error((L), "command %d, element %d: %s", (index), (pos), (msg))
+
+static cl_mem CheckBuffer(lua_State *L, int arg, int pos, cl_uint index, ud_t **udp)
+    {
+    cl_mem mem;
+    lua_rawgeti(L, arg, pos);
+    mem = testbuffer(L, -1, udp);
+    if(!mem) 
+        Error(L, index, pos, "expected buffer");
+    lua_pop(L, 1);
+    return mem;
+    }
+
+static cl_kernel CheckKernel(lua_State *L, int arg, int pos, cl_uint index, ud_t **udp)
+    {
+    cl_kernel kernel;
+    lua_rawgeti(L, arg, pos);
+    kernel = testkernel(L, -1, udp);
+    if(!kernel) 
+        Error(L, index, pos, "expected kernel");
+    lua_pop(L, 1);
+    return kernel;
+    }
+
+static size_t CheckSize(lua_State *L, int arg, int pos, cl_uint index)
+    {
+    int isnum;
+    lua_Integer val;
+    lua_rawgeti(L, arg, pos);
+    val = lua_tointegerx(L, -1, &isnum);
+    if(!isnum || val < 0)
+        Error(L, index, pos, "expected non-negative integer");
+    lua_pop(L, 1);
+    return (size_t)val;
+    }
+
+static int OptBoolean(lua_State *L, int arg, int pos, int d)
+    {
+    int val;
+    lua_rawgeti(L, arg, pos);
+    val = lua_isboolean(L, -1) ? lua_toboolean(L, -1) : d;
+    lua_pop(L, 1);
+    return val;
+    }
+
+static void *CheckPtr(lua_State *L, int arg, int pos, cl_uint index, size_t *size, ud_t **udp)
+/* lightuserdata or hostmem (in the latter case, sets *size to its size) */
+    {
+    void *ptr;
+    cl_hostmem hostmem;
+    lua_rawgeti(L, arg, pos);
+    if(lua_type(L, -1) == LUA_TLIGHTUSERDATA)
+        ptr = lua_touserdata(L, -1);
+    else
+        {
+        hostmem = testhostmem(L, -1, udp);
+        if(!hostmem)
+            Error(L, index, pos, "expected lightuserdata or hostmem");
+        ptr = hostmem->ptr;
+        *size = hostmem->size;
+        }
+    lua_pop(L, 1);
+    return ptr;
+    }
+
+static int OptSize3(lua_State *L, int arg, int pos, cl_uint index, cl_uint work_dim, size_t dst[3])
+/* Returns 1 if the list is present, 0 otherwise */
+    {
+    cl_uint i, count;
+    lua_rawgeti(L, arg, pos);
+    if(lua_isnil(L, -1))
+        { lua_pop(L, 1); return 0; }
+    if(lua_type(L, -1) != LUA_TTABLE)
+        Error(L, index, pos, errstring(ERR_TABLE));
+    count = lua_rawlen(L, -1);
+    if(count == 0)
+        { lua_pop(L, 1); return 0; }
+    if(count != work_dim)
+        Error(L, index, pos, "table length must be work_dim");
+    for(i = 0; i < count; i++)
+        dst[i] = CheckSize(L, lua_gettop(L), i+1, index);
+    lua_pop(L, 1);
+    return 1;
+    }
+
+static void CheckWaitList(lua_State *L, int arg, int pos, int anchor, command_t *cmds, cl_uint index)
+    {
+    int isnum;
+    cl_uint i, j;
+    lua_Integer ref;
+    waitentry_t *wait;
+    command_t *cmd = &cmds[index-1];
+
+    cmd->wc = 0;
+    lua_rawgeti(L, arg, pos);
+    if(lua_isnil(L, -1))
+        { lua_pop(L, 1); return; }
+    if(lua_type(L, -1) != LUA_TTABLE)
+        Error(L, index, pos, errstring(ERR_TABLE));
+    cmd->wc = lua_rawlen(L, -1);
+    if(cmd->wc > COMMAND_MAXINLINEWAIT)
+        cmd->wait = (waitentry_t*)anchoredalloc(L, anchor, cmd->wc * sizeof(waitentry_t));
+    wait = commandwait(cmd);
+    for(i = 0; i < cmd->wc; i++)
+        {
+        lua_rawgeti(L, -1, i+1);
+        wait[i].event = NULL;
+        wait[i].ud = NULL;
+        wait[i].index = 0;
+        if(lua_type(L, -1) == LUA_TNUMBER)
+            {
+            ref = lua_tointegerx(L, -1, &isnum);
+            if(!isnum || ref < 1 || ref >= (lua_Integer)index)
+                Error(L, index, pos, "invalid reference to a previous command");
+            j = (cl_uint)ref;
+            switch(cmds[j-1].code)
+                {
+                case CMD_SET_KERNEL_ARG:
+                    Error(L, index, pos, "referenced command does not generate events");
+                    break;
+                default:
+                    cmds[j-1].needevent = 1;
+                }
+            wait[i].index = j;
+            }
+        else
+            {
+            wait[i].event = testevent(L, -1, &wait[i].ud);
+            if(!wait[i].event)
+                Error(L, index, pos, "expected event or command index");
+            }
+        lua_pop(L, 1);
+        }
+    lua_pop(L, 1);
+    }
+
+static void CheckKernelArg(lua_State *L, int arg, int pos, int anchor, command_t *cmd, cl_uint index)
+    {
+    int err, faulty_arg, base, i, last;
+    void *data;
+    last = lua_rawlen(L, arg);
+    if(last < pos + 1) last = pos + 1;
+    base = lua_gettop(L) + 1;
+    luaL_checkstack(L, last - pos + 1, "too many elements, cannot grow Lua stack");
+    for(i = pos; i <= last; i++)
+        lua_rawgeti(L, arg, i);
+    err = testkernelarg(L, base, &cmd->arg, &faulty_arg);
+    if(err)
+        Error(L, index, pos + faulty_arg - base, errstring(err));
+    if(lua_type(L, base) == LUA_TSTRING)
+        cmd->arg_type = testprimtype(L, base, &err);
+    else if(lua_type(L, base) == LUA_TUSERDATA)
+        {
+        if(!testmemobject(L, base, &cmd->objects[2]) && !testsampler(L, base, &cmd->objects[2]))
+            testqueue(L, base, &cmd->objects[2]);
+        }
+    if(cmd->arg.allocated)
+        {
+        data = anchoredalloc(L, anchor, cmd->arg.size);
+        memcpy(data, cmd->arg.value, cmd->arg.size);
+        Free(L, (void*)cmd->arg.value);
+        cmd->arg.value = data;
+        cmd->arg.allocated = 0;
+        }
+    lua_settop(L, base - 1);
+    }
+
+void checkcommand(lua_State *L, int arg, int anchor, command_t *cmds, cl_uint index)
+/* Checks the command table at arg and stores it in cmds[index-1].
+ * cmds[0 .. index-2] must contain the previous commands in the same list.
+ * Any memory needed by the command is anchored to the table at anchor. The 
+ * caller must ensure that the command table itself (and thus the objects and 
+ * strings it references) is not collected while cmds is in use.
+ */
+    {
+    int code, pos, isnil;
+    size_t size;
+    const char *name;
+    command_t *cmd = &cmds[index-1];
+
+    arg = lua_absindex(L, arg);
+    if(lua_type(L, arg) != LUA_TTABLE)
+        luaL_error(L, "command %d: %s", index, errstring(ERR_TABLE));
+    memset(cmd, 0, sizeof(command_t));
+
+    lua_rawgeti(L, arg, 1);
+    name = lua_tostring(L, -1);
+    if(!name)
+        Error(L, index, 1, "expected command name");
+    for(code = 0; CommandNames[code] != NULL; code++)
+        if(strcmp(name, CommandNames[code]) == 0) break;
+    if(CommandNames[code] == NULL)
+        Error(L, index, 1, lua_pushfstring(L, "invalid command '%s'", name));
+    lua_pop(L, 1);
+    cmd->code = code;
+
+    switch(code)
+        {
+        case CMD_READ_BUFFER:
+        case CMD_WRITE_BUFFER:
+            cmd->mem = CheckBuffer(L, arg, 2, index, &cmd->objects[0]);
+            lua_rawgeti(L, arg, 3);
+            if(!lua_isboolean(L, -1))
+                Error(L, index, 3, "expected boolean");
+            cmd->blocking = lua_toboolean(L, -1);
+            lua_pop(L, 1);
+            cmd->offset = CheckSize(L, arg, 4, index);
+            cmd->ptr = CheckPtr(L, arg, 6, index, &cmd->size, &cmd->objects[1]);
+            if(cmd->code == CMD_READ_BUFFER && cmd->objects[1] && IsReadOnly(cmd->objects[1]))
+                Error(L, index, 6, "read-only hostmem");
+            lua_rawgeti(L, arg, 5);
+            isnil = lua_isnil(L, -1);
+            lua_pop(L, 1);
+            if(!isnil || !cmd->objects[1])
+                { /* size given, or ptr is a lightuserdata */
+                size = CheckSize(L, arg, 5, index);
+                if(cmd->objects[1] && size > cmd->size)
+                    luaL_error(L, "command %d: %s", index, errstring(ERR_BOUNDARIES));
+                cmd->size = size;
+                }
+            if(!testbufferboundaries(L, cmd->mem, cmd->offset, cmd->size))
+                luaL_error(L, "command %d: %s", index, errstring(ERR_BOUNDARIES));
+            pos = 7;
+            break;
+        case CMD_COPY_BUFFER:
+            cmd->mem = CheckBuffer(L, arg, 2, index, &cmd->objects[0]);
+            cmd->mem2 = CheckBuffer(L, arg, 3, index, &cmd->objects[1]);
+            cmd->offset = CheckSize(L, arg, 4, index);
+            cmd->offset2 = CheckSize(L, arg, 5, index);
+            cmd->size = CheckSize(L, arg, 6, index);
+            if(!testbufferboundaries(L, cmd->mem, cmd->offset, cmd->size) ||
+               !testbufferboundaries(L, cmd->mem2, cmd->offset2, cmd->size))
+                luaL_error(L, "command %d: %s", index, errstring(ERR_BOUNDARIES));
+            pos = 7;
+            break;
+        case CMD_FILL_BUFFER:
+            cmd->mem = CheckBuffer(L, arg, 2, index, &cmd->objects[0]);
+            lua_rawgeti(L, arg, 3);
+            if(lua_type(L, -1) != LUA_TSTRING)
+                Error(L, index, 3, "expected string");
+            cmd->pattern = lua_tolstring(L, -1, &cmd->pattern_size);
+            lua_pop(L, 1);
+            cmd->offset = CheckSize(L, arg, 4, index);
+            cmd->size = CheckSize(L, arg, 5, index);
+            if(!testbufferboundaries(L, cmd->mem, cmd->offset, cmd->size))
+                luaL_error(L, "command %d: %s", index, errstring(ERR_BOUNDARIES));
+            pos = 6;
+            break;
+        case CMD_NDRANGE_KERNEL:
+            cmd->kernel = CheckKernel(L, arg, 2, index, &cmd->objects[0]);
+            cmd->work_dim = CheckSize(L, arg, 3, index);
+            if(cmd->work_dim == 0 || cmd->work_dim > 3)
+                Error(L, index, 3, "work_dim must be 1, 2, or 3");
+            cmd->has_offset = OptSize3(L, arg, 4, index, cmd->work_dim, cmd->global_offset);
+            if(!OptSize3(L, arg, 5, index, cmd->work_dim, cmd->global_size))
+                Error(L, index, 5, "missing global_work_size");
+            cmd->has_local = OptSize3(L, arg, 6, index, cmd->work_dim, cmd->local_size);
+            pos = 7;
+            break;
+        case CMD_TASK:
+            cmd->kernel = CheckKernel(L, arg, 2, index, &cmd->objects[0]);
+            cmd->work_dim = 1;
+            cmd->global_size[0] = cmd->local_size[0] = 1;
+            cmd->has_local = 1;
+            pos = 3;
+            break;
+        case CMD_MARKER:
+        case CMD_BARRIER:
+            pos = 2;
+            break;
+        case CMD_SET_KERNEL_ARG:
+            cmd->kernel = CheckKernel(L, arg, 2, index, &cmd->objects[0]);
+            cmd->arg_index = CheckSize(L, arg, 3, index);
+            CheckKernelArg(L, arg, 4, anchor, cmd, index);
+            return;
+        default:
+            unexpected(L);
+            return;
+        }
+
+    CheckWaitList(L, arg, pos, anchor, cmds, index);
+    cmd->ge = OptBoolean(L, arg, pos + 1, 0);
+    if(cmd->ge) cmd->needevent = 1;
+    }
+
+cl_uint checkcommandobjects(command_t *cmds, cl_uint n)
+/* Returns the position of the first command that references a deleted object,
+ * or 0 if all the referenced objects are still valid.
+ */
+    {
+    cl_uint i, j;
+    waitentry_t *wait;
+    for(i = 0; i < n; i++)
+        {
+        for(j = 0; j < 3; j++)
+            if(cmds[i].objects[j] && !IsValid(cmds[i].objects[j])) return i+1;
+        wait = commandwait(&cmds[i]);
+        for(j = 0; j < cmds[i].wc; j++)
+            if(wait[j].ud && !IsValid(wait[j].ud)) return i+1;
+        }
+    return 0;
+    }
+
+cl_int execcommands(cl_queue queue, command_t *cmds, cl_uint n, cl_event *events, cl_event *wl, cl_uint *failed)
+/* Executes the commands cmds[0 .. n-1] in order, storing their events in events[].
+ * wl must have room for the longest wait list.
+ * On error, returns the error code and sets *failed to the position of the failed 
+ * command. Events generated by the commands up to that point are left in events[],
+ * and must be released by the caller.
+ */
+    {
+    cl_uint i, j;
+    cl_int ec = CL_SUCCESS;
+    cl_event *ev;
+    cl_event *we;
+    waitentry_t *wait;
+    command_t *cmd;
+
+    memset(events, 0, n * sizeof(cl_event));
+    *failed = 0;
+    for(i = 0; i < n; i++)
+        {
+        cmd = &cmds[i];
+        ev = cmd->needevent ? &events[i] : NULL;
+        wait = commandwait(cmd);
+        for(j = 0; j < cmd->wc; j++)
+            wl[j] = wait[j].index ? events[wait[j].index - 1] : wait[j].event;
+        we = cmd->wc > 0 ? wl : NULL;
+        switch(cmd->code)
+            {
+            case CMD_READ_BUFFER:
+                ec = cl.EnqueueReadBuffer(queue, cmd->mem, cmd->blocking, cmd->offset, cmd->size,
+                        cmd->ptr, cmd->wc, we, ev);
+                break;
+            case CMD_WRITE_BUFFER:
+                ec = cl.EnqueueWriteBuffer(queue, cmd->mem, cmd->blocking, cmd->offset, cmd->size,
+                        cmd->ptr, cmd->wc, we, ev);
+                break;
+            case CMD_COPY_BUFFER:
+                ec = cl.EnqueueCopyBuffer(queue, cmd->mem, cmd->mem2, cmd->offset, cmd->offset2,
+                        cmd->size, cmd->wc, we, ev);
+                break;
+            case CMD_FILL_BUFFER:
+                ec = cl.EnqueueFillBuffer(queue, cmd->mem, cmd->pattern, cmd->pattern_size,
+                        cmd->offset, cmd->size, cmd->wc, we, ev);
+                break;
+            case CMD_NDRANGE_KERNEL:
+            case CMD_TASK:
+                ec = cl.EnqueueNDRangeKernel(queue, cmd->kernel, cmd->work_dim,
+                        cmd->has_offset ? cmd->global_offset : NULL, cmd->global_size,
+                        cmd->has_local ? cmd->local_size : NULL, cmd->wc, we, ev);
+                break;
+            case CMD_MARKER:
+                ec = cl.EnqueueMarkerWithWaitList(queue, cmd->wc, we, ev);
+                break;
+            case CMD_BARRIER:
+                ec = cl.EnqueueBarrierWithWaitList(queue, cmd->wc, we, ev);
+                break;
+            case CMD_SET_KERNEL_ARG:
+                ec = cl.SetKernelArg(cmd->kernel, cmd->arg_index, cmd->arg.size, kernelargvalue(&cmd->arg));
+                break;
+            default:
+                ec = CL_INVALID_OPERATION;
+            }
+        if(ec)
+            { *failed = i+1; return ec; }
+        }
+    return CL_SUCCESS;
+    }
+
+void releasecommandevents(cl_event *events, cl_uint n)
+    {
+    cl_uint i;
+    for(i = 0; i < n; i++)
+        {
+        if(events[i])
+            { cl.ReleaseEvent(events[i]); events[i] = NULL; }
+        }
+    }
+
+static int EnqueueBatch(lua_State *L)
+    {
+    ud_t *ud;
+    cl_int ec;
+    cl_uint n, i, maxwc, failed;
+    int anchor;
+    command_t *cmds;
+    cl_event *events, *wl;
+    cl_queue queue = checkqueue(L, 1, &ud);
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+    n = luaL_len(L, 2);
+    lua_newtable(L);
+    if(n == 0) return 1;
+
+    lua_newtable(L);
+    anchor = lua_gettop(L);
+    cmds = (command_t*)anchoredalloc(L, anchor, n * sizeof(command_t));
+    events = (cl_event*)anchoredalloc(L, anchor, n * sizeof(cl_event));
+
+    maxwc = 0;
+    for(i = 0; i < n; i++)
+        {
+        lua_rawgeti(L, 2, i+1);
+        checkcommand(L, -1, anchor, cmds, i+1);
+        lua_pop(L, 1);
+        if(cmds[i].wc > maxwc) maxwc = cmds[i].wc;
+        }
+    wl = maxwc > 0 ? (cl_event*)anchoredalloc(L, anchor, maxwc * sizeof(cl_event)) : NULL;
+
+    ec = execcommands(queue, cmds, n, events, wl, &failed);
+    if(ec)
+        {
+        releasecommandevents(events, n);
+        pusherrcode(L, ec);
+        return luaL_error(L, "command %d: %s", failed, lua_tostring(L, -1));
+        }
+
+    for(i = 0; i < n; i++)
+        {
+        if(!events[i]) continue;
+        if(cmds[i].ge)
+            {
+            newevent(L, ud->context, events[i]);
+            lua_rawseti(L, anchor - 1, i+1);
+            }
+        else
+            cl.ReleaseEvent(events[i]);
+        events[i] = NULL;
+        }
+    lua_pop(L, 1); /* anchor */
+    return 1;
+    }
+
+static const struct luaL_Reg Functions[] = 
+    {
+        { "enqueue_batch", EnqueueBatch },
+        { NULL, NULL } /* sentinel */
+    };
+
+void mooncl_open_batch(lua_State *L)
+    {
+    luaL_setfuncs(L, Functions, 0);
+    }
+
@@ -29,6 +29,7 @@ typedef struct {
     size_t size;
     size_t origin;
     cl_mem_flags flags;
+    cl_buffer slab; /* pooled sub buffers: the slab the region was carved from */
 } udinfo_t;
 
 int testbufferboundaries(lua_State *L, cl_buffer buffer, size_t offset, size_t size)
@@ -53,9 +54,13 @@ static int freebuffer(lua_State *L, ud_t *ud)
     {
     cl_buffer buffer = (cl_buffer)ud->handle;
     int sub_buffer = IsSubBuffer(ud);
+    cl_bufferpool pool = IsPooled(ud) ? (cl_bufferpool)ud->parent_ud->handle : NULL;
+    udinfo_t udinfo = *(udinfo_t*)ud->info; /* ud->info is released by freeuserdata() */
     freechildren(L, BUFFER_MT, ud); /* sub buffers */
     if(!freeuserdata(L, ud, sub_buffer ? "sub buffer" : "buffer")) return 0;
     ReleaseAll(MemObject, MEM, buffer);
+    if(pool)
+        bufferpoolrelease(L, pool, udinfo.slab, udinfo.origin, udinfo.size);
     return 0;
     }
 
@@ -71,9 +76,8 @@ static void DestructorCallback(cl_buffer buffer, void *luastate)
 static ud_t *newbuffer(lua_State *L, cl_context context, cl_buffer buffer, void *udinfo)
     {
     ud_t *ud;
-    ud = newuserdata(L, buffer, BUFFER_MT, "buffer");
+    ud = newuserdata(L, buffer, UD(context), BUFFER_MT, "buffer");
     ud->context = context;
-    ud->parent_ud = UD(context);
     ud->clext = ud->parent_ud->clext;
     ud->destructor = freebuffer;  
     ud->info = udinfo;
@@ -84,9 +88,8 @@ static ud_t *newbuffer(lua_State *L, cl_context context, cl_buffer buffer, void
 static ud_t *newsubbuffer(lua_State *L, cl_buffer parent, cl_buffer buffer, void *udinfo)
     {
     ud_t *ud;
-    ud = newuserdata(L, buffer, BUFFER_MT, "sub buffer");
+    ud = newuserdata(L, buffer, UD(parent), BUFFER_MT, "sub buffer");
     ud->context = UD(parent)->context;
-    ud->parent_ud = UD(parent);
     ud->clext = ud->parent_ud->clext;
     ud->destructor = freebuffer;  
     ud->info = udinfo;
@@ -95,6 +98,29 @@ static ud_t *newsubbuffer(lua_State *L, cl_buffer parent, cl_buffer buffer, void
     return ud;
     }
 
+ud_t *newpooledbuffer(lua_State *L, ud_t *pool_ud, cl_buffer slab, cl_buffer buffer, size_t origin, size_t size)
+/* Creates the userdata for a sub buffer carved by a buffer pool from one of its slabs */
+    {
+    ud_t *ud;
+    udinfo_t *udinfo = (udinfo_t*)MallocNoErr(L, sizeof(udinfo_t));
+    if(!udinfo)
+        return NULL;
+    udinfo->origin = origin;
+    udinfo->size = size;
+    udinfo->flags = 0;
+    udinfo->slab = slab;
+    ud = newuserdata(L, buffer, pool_ud, BUFFER_MT, "sub buffer");
+    ud->context = pool_ud->context;
+    ud->clext = pool_ud->clext;
+    ud->destructor = freebuffer;
+    ud->info = udinfo;
+    MarkSubBuffer(ud);
+    MarkBufferRegion(ud);
+    MarkPooled(ud);
+    cl.SetMemObjectDestructorCallback(buffer, DestructorCallback, L);
+    return ud;
+    }
+
 static int CreateBuffer(lua_State *L)
     {
     cl_int ec;
@@ -117,14 +143,29 @@ static int CreateBuffer(lua_State *L)
 //  else
 //      {
         size = luaL_checkinteger(L, 3);
-        host_ptr = optlightuserdata(L, 4);
 //      }
+    if(lua_isnoneornil(L, 4))
+        host_ptr = NULL;
+    else
+        {
+        size_t host_size;
+        ud_t *hostmem_ud;
+        host_ptr = checkhostptr(L, 4, &host_size, &hostmem_ud); /* lightuserdata or hostmem */
+        if(hostmem_ud)
+            {
+            if(size > host_size)
+                return luaL_argerror(L, 3, errstring(ERR_BOUNDARIES));
+            if(IsReadOnly(hostmem_ud) && (flags & CL_MEM_USE_HOST_PTR) && !(flags & CL_MEM_READ_ONLY))
+                return luaL_argerror(L, 4, "read-only hostmem requires the 'read only' flag");
+            }
+        }
 
     udinfo = (udinfo_t*)MallocNoErr(L, sizeof(udinfo_t));
     if(!udinfo)
         return luaL_error(L, errstring(ERR_MEMORY));
     udinfo->flags = flags;
     udinfo->origin = 0;
+    udinfo->slab = NULL;
     udinfo->size = size;
 
 //  DBG("host_ptr = %p\n",host_ptr);
@@ -165,6 +206,7 @@ static int CreateBufferRegion(lua_State *L) /* CreateSubBuffer */
     udinfo->origin = region.origin;
     udinfo->size = region.size;
     udinfo->flags = flags;
+    udinfo->slab = NULL;
 
     buffer = cl.CreateSubBuffer(parent_buffer, flags, CL_BUFFER_CREATE_TYPE_REGION, &region, &ec);
     if(ec)
@@ -198,6 +240,7 @@ static int CreateFromGLBuffer(lua_State *L)
         return luaL_error(L, errstring(ERR_MEMORY));
     udinfo->flags = flags;
     udinfo->origin = 0;
+    udinfo->slab = NULL;
     //udinfo->size = size;
 
     buffer = context_ud->clext->CreateFromGLBuffer(context, flags, bufobj, &ec);
@@ -0,0 +1,395 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Stefano Trettel
+ *
+ * Software repository: MoonCL, https://github.com/stetre/mooncl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "internal.h"
+
+/* Device buffer pools.
+ *
+ * A pool allocates large buffers ('slabs') with clCreateBuffer(), and serves
+ * allocations by carving sub buffers out of them. When a pooled sub buffer is
+ * deleted, its region goes back to the free list of its slab, where it is
+ * coalesced with adjacent free regions.
+ * Regions are aligned to the largest CL_DEVICE_MEM_BASE_ADDR_ALIGN of the
+ * context's devices, as required for sub buffer origins.
+ * Pooled sub buffers are children of the pool.
+ */
+
+typedef struct {
+    size_t offset;
+    size_t size;
+} range_t;
+
+typedef struct {
+    cl_buffer mem;
+    size_t size;
+    size_t used;    /* bytes allocated from this slab */
+    range_t *free;  /* free regions, sorted by offset */
+    size_t nfree;
+    size_t cap;
+} slab_t;
+
+struct mooncl_bufferpool_s {
+    cl_context context;
+    cl_mem_flags flags;
+    size_t slab_size;
+    size_t alignment;
+    slab_t *slabs;
+    size_t nslabs;
+    size_t cap;
+    size_t capacity;    /* total bytes in slabs */
+    size_t used;        /* bytes currently allocated */
+    size_t high_water;  /* max. value reached by used */
+    size_t allocations;
+    size_t slab_allocations;
+};
+
+#define RoundUp(n, a) (((n) + (a) - 1) & ~((a) - 1))
+
+static int Reserve(lua_State *L, void **array, size_t *cap, size_t needed, size_t elemsize)
+/* Grows an array to hold at least needed elements. Returns 0 on failure */
+    {
+    void *p;
+    size_t newcap;
+    if(needed <= *cap) return 1;
+    newcap = 2 * (*cap) + 8;
+    if(newcap < needed) newcap = needed;
+    p = MallocNoErr(L, newcap * elemsize);
+    if(!p) return 0;
+    if(*array)
+        {
+        memcpy(p, *array, (*cap) * elemsize);
+        Free(L, *array);
+        }
+    *array = p;
+    *cap = newcap;
+    return 1;
+    }
+
+static void InsertFree(lua_State *L, slab_t *slab, size_t offset, size_t size)
+/* Adds a region to the free list of the slab, coalescing with its neighbours */
+    {
+    size_t i = 0;
+    range_t *r;
+    while(i < slab->nfree && slab->free[i].offset < offset) i++;
+    /* merge with the previous region */
+    if(i > 0 && slab->free[i-1].offset + slab->free[i-1].size == offset)
+        {
+        r = &slab->free[i-1];
+        r->size += size;
+        /* ... and possibly with the next one */
+        if(i < slab->nfree && r->offset + r->size == slab->free[i].offset)
+            {
+            r->size += slab->free[i].size;
+            memmove(&slab->free[i], &slab->free[i+1], (slab->nfree - i - 1) * sizeof(range_t));
+            slab->nfree--;
+            }
+        return;
+        }
+    /* merge with the next region */
+    if(i < slab->nfree && offset + size == slab->free[i].offset)
+        {
+        slab->free[i].offset = offset;
+        slab->free[i].size += size;
+        return;
+        }
+    if(!Reserve(L, (void**)&slab->free, &slab->cap, slab->nfree + 1, sizeof(range_t)))
+        return; /* out of memory: the region is leaked until the pool is deleted */
+    memmove(&slab->free[i+1], &slab->free[i], (slab->nfree - i) * sizeof(range_t));
+    slab->free[i].offset = offset;
+    slab->free[i].size = size;
+    slab->nfree++;
+    }
+
+static int TakeFree(slab_t *slab, size_t size, size_t *offset)
+/* First fit. Returns 1 and the offset if the slab has a free region of at least size bytes */
+    {
+    size_t i;
+    for(i = 0; i < slab->nfree; i++)
+        {
+        if(slab->free[i].size < size) continue;
+        *offset = slab->free[i].offset;
+        slab->free[i].offset += size;
+        slab->free[i].size -= size;
+        if(slab->free[i].size == 0)
+            {
+            memmove(&slab->free[i], &slab->free[i+1], (slab->nfree - i - 1) * sizeof(range_t));
+            slab->nfree--;
+            }
+        return 1;
+        }
+    return 0;
+    }
+
+void bufferpoolrelease(lua_State *L, cl_bufferpool pool, cl_buffer slab, size_t origin, size_t size)
+/* Called by the buffer destructor to give back the region of a pooled sub buffer */
+    {
+    size_t i;
+    size = RoundUp(size, pool->alignment);
+    for(i = 0; i < pool->nslabs; i++)
+        {
+        if(pool->slabs[i].mem != slab) continue;
+        InsertFree(L, &pool->slabs[i], origin, size);
+        pool->slabs[i].used -= size;
+        pool->used -= size;
+        return;
+        }
+    }
+
+static void ReleaseSlab(cl_bufferpool pool, size_t i)
+    {
+    slab_t *slab = &pool->slabs[i];
+    cl.ReleaseMemObject(slab->mem);
+    pool->capacity -= slab->size;
+    }
+
+static int freebufferpool(lua_State *L, ud_t *ud)
+    {
+    size_t i;
+    cl_bufferpool pool = (cl_bufferpool)ud->handle;
+    freechildren(L, BUFFER_MT, ud); /* pooled sub buffers */
+    if(!freeuserdata(L, ud, "bufferpool")) return 0;
+    for(i = 0; i < pool->nslabs; i++)
+        {
+        ReleaseSlab(pool, i);
+        Free(L, pool->slabs[i].free);
+        }
+    Free(L, pool->slabs);
+    Free(L, pool);
+    return 0;
+    }
+
+static size_t BaseAddrAlign(lua_State *L, cl_context context)
+/* Returns the largest CL_DEVICE_MEM_BASE_ADDR_ALIGN (in bytes) among the context's devices */
+    {
+    cl_int ec;
+    cl_uint i, bits, count = 0;
+    size_t alignment = 1;
+    cl_device *devices;
+    ec = cl.GetContextInfo(context, CL_CONTEXT_NUM_DEVICES, sizeof(count), &count, NULL);
+    CheckError(L, ec);
+    devices = (cl_device*)Malloc(L, count * sizeof(cl_device));
+    ec = cl.GetContextInfo(context, CL_CONTEXT_DEVICES, count * sizeof(cl_device), devices, NULL);
+    if(ec)
+        { Free(L, devices); CheckError(L, ec); return 0; }
+    for(i = 0; i < count; i++)
+        {
+        ec = cl.GetDeviceInfo(devices[i], CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(bits), &bits, NULL);
+        if(ec)
+            { Free(L, devices); CheckError(L, ec); return 0; }
+        if(bits/8 > alignment) alignment = bits/8;
+        }
+    Free(L, devices);
+    return alignment;
+    }
+
+static int Create(lua_State *L)
+/* pool = create_buffer_pool(context, flags, slab_size, [alignment]) */
+    {
+    ud_t *ud, *context_ud;
+    cl_bufferpool pool;
+    size_t alignment;
+    cl_context context = checkcontext(L, 1, &context_ud);
+    cl_mem_flags flags = checkflags(L, 2);
+    size_t slab_size = luaL_checkinteger(L, 3);
+    size_t min_alignment = luaL_optinteger(L, 4, 1);
+    if(flags & (CL_MEM_USE_HOST_PTR | CL_MEM_COPY_HOST_PTR))
+        return luaL_argerror(L, 2, "host pointer flags are not allowed");
+    if(slab_size == 0)
+        return luaL_argerror(L, 3, errstring(ERR_VALUE));
+    if(min_alignment == 0 || (min_alignment & (min_alignment - 1)) != 0)
+        return luaL_argerror(L, 4, "alignment must be a power of 2");
+    alignment = BaseAddrAlign(L, context);
+    if(alignment < min_alignment) alignment = min_alignment;
+
+    pool = (cl_bufferpool)MallocNoErr(L, sizeof(bufferpool_t));
+    if(!pool)
+        return luaL_error(L, errstring(ERR_MEMORY));
+    memset(pool, 0, sizeof(bufferpool_t));
+    pool->context = context;
+    pool->flags = flags;
+    pool->alignment = alignment;
+    pool->slab_size = RoundUp(slab_size, alignment);
+
+    ud = newuserdata(L, pool, context_ud, BUFFERPOOL_MT, "bufferpool");
+    ud->context = context;
+    ud->clext = context_ud->clext;
+    ud->destructor = freebufferpool;
+    return 1;
+    }
+
+static slab_t *NewSlab(lua_State *L, cl_bufferpool pool, size_t size)
+    {
+    cl_int ec;
+    slab_t *slab;
+    cl_buffer mem;
+    if(!Reserve(L, (void**)&pool->slabs, &pool->cap, pool->nslabs + 1, sizeof(slab_t)))
+        { luaL_error(L, errstring(ERR_MEMORY)); return NULL; }
+    mem = cl.CreateBuffer(pool->context, pool->flags, size, NULL, &ec);
+    if(ec)
+        { pusherrcode(L, ec); lua_error(L); return NULL; }
+    slab = &pool->slabs[pool->nslabs++];
+    memset(slab, 0, sizeof(slab_t));
+    slab->mem = mem;
+    slab->size = size;
+    InsertFree(L, slab, 0, size);
+    pool->capacity += size;
+    pool->slab_allocations++;
+    return slab;
+    }
+
+static int Alloc(lua_State *L)
+/* buffer = pool:alloc(size) */
+    {
+    cl_int ec;
+    ud_t *pool_ud;
+    size_t i, offset = 0, rsize;
+    slab_t *slab = NULL;
+    cl_buffer buffer;
+    cl_buffer_region region;
+    cl_bufferpool pool = checkbufferpool(L, 1, &pool_ud);
+    size_t size = luaL_checkinteger(L, 2);
+    if(size == 0)
+        return luaL_argerror(L, 2, errstring(ERR_VALUE));
+    rsize = RoundUp(size, pool->alignment);
+
+    for(i = 0; i < pool->nslabs; i++)
+        if(TakeFree(&pool->slabs[i], rsize, &offset))
+            { slab = &pool->slabs[i]; break; }
+    if(!slab)
+        {
+        /* oversized requests get a dedicated slab */
+        slab = NewSlab(L, pool, rsize > pool->slab_size ? rsize : pool->slab_size);
+        TakeFree(slab, rsize, &offset);
+        }
+
+    region.origin = offset;
+    region.size = size;
+    buffer = cl.CreateSubBuffer(slab->mem, 0, CL_BUFFER_CREATE_TYPE_REGION, &region, &ec);
+    if(ec)
+        {
+        InsertFree(L, slab, offset, rsize);
+        CheckError(L, ec);
+        return 0;
+        }
+    if(!newpooledbuffer(L, pool_ud, slab->mem, buffer, offset, size))
+        {
+        cl.ReleaseMemObject(buffer);
+        InsertFree(L, slab, offset, rsize);
+        return luaL_error(L, errstring(ERR_MEMORY));
+        }
+    slab->used += rsize;
+    pool->used += rsize;
+    if(pool->used > pool->high_water) pool->high_water = pool->used;
+    pool->allocations++;
+    return 1;
+    }
+
+static int Stats(lua_State *L)
+/* {stats} = pool:stats() */
+    {
+    size_t i, j, nfree = 0, largest = 0, free;
+    cl_bufferpool pool = checkbufferpool(L, 1, NULL);
+    for(i = 0; i < pool->nslabs; i++)
+        {
+        nfree += pool->slabs[i].nfree;
+        for(j = 0; j < pool->slabs[i].nfree; j++)
+            if(pool->slabs[i].free[j].size > largest) largest = pool->slabs[i].free[j].size;
+        }
+    free = pool->capacity - pool->used;
+    lua_newtable(L);
+#define F(name, val) do { lua_pushinteger(L, (val)); lua_setfield(L, -2, name); } while(0)
+    F("slabs", pool->nslabs);
+    F("capacity", pool->capacity);
+    F("used", pool->used);
+    F("high_water", pool->high_water);
+    F("free", free);
+    F("free_regions", nfree);
+    F("largest_free", largest);
+    F("alignment", pool->alignment);
+    F("allocations", pool->allocations);
+    F("slab_allocations", pool->slab_allocations);
+#undef F
+    /* fraction of the free space not usable by an allocation as large as all of it */
+    lua_pushnumber(L, free > 0 ? 1.0 - (double)largest/(double)free : 0.0);
+    lua_setfield(L, -2, "fragmentation");
+    return 1;
+    }
+
+static int Trim(lua_State *L)
+/* n = pool:trim() releases unused slabs */
+    {
+    size_t i = 0, j = 0, n = 0;
+    cl_bufferpool pool = checkbufferpool(L, 1, NULL);
+    for(i = 0; i < pool->nslabs; i++)
+        {
+        if(pool->slabs[i].used == 0)
+            {
+            ReleaseSlab(pool, i);
+            Free(L, pool->slabs[i].free);
+            n++;
+            }
+        else
+            pool->slabs[j++] = pool->slabs[i];
+        }
+    pool->nslabs = j;
+    lua_pushinteger(L, n);
+    return 1;
+    }
+
+RAW_FUNC(bufferpool)
+TYPE_FUNC(bufferpool)
+CONTEXT_FUNC(bufferpool)
+DELETE_FUNC(bufferpool)
+
+static const struct luaL_Reg Methods[] = 
+    {
+        { "raw", Raw },
+        { "type", Type },
+        { "context", Context },
+        { "delete", Delete },
+        { "alloc", Alloc },
+        { "stats", Stats },
+        { "trim", Trim },
+        { NULL, NULL } /* sentinel */
+    };
+
+static const struct luaL_Reg MetaMethods[] = 
+    {
+        { "__gc",  Delete },
+        { NULL, NULL } /* sentinel */
+    };
+
+static const struct luaL_Reg Functions[] = 
+    {
+        { "create_buffer_pool", Create },
+        { NULL, NULL } /* sentinel */
+    };
+
+void mooncl_open_bufferpool(lua_State *L)
+    {
+    udata_define(L, BUFFERPOOL_MT, Methods, MetaMethods);
+    luaL_setfuncs(L, Functions, 0);
+    }
+
@@ -0,0 +1,254 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Stefano Trettel
+ *
+ * Software repository: MoonCL, https://github.com/stetre/mooncl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define _DEFAULT_SOURCE
+#include "internal.h"
+
+#if defined(LINUX)
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+/* Completion queue.
+ *
+ * Events registered with set_event_callback(event, 'complete', true) (or with
+ * an event handle) are pushed, when completed, in a lock-free bounded queue.
+ * The queue has multiple producers (the OpenCL callbacks, which may run in any
+ * driver thread) and a single consumer (the Lua state), and uses per-entry
+ * sequence numbers (D. Vyukov's bounded queue).
+ * On Linux, each push also increments an eventfd counter, so that the consumer
+ * can block on it, or add it to its own epoll/poll loop.
+ * If the queue is full, the completion is dropped and counted.
+ */
+
+typedef struct {
+    uint64_t seq;
+    cl_event event;
+    cl_int status;
+    lua_Integer handle; /* event handle, or 0 for event objects */
+} centry_t;
+
+#define QUEUE_SIZE 16384 /* must be a power of 2 */
+
+static centry_t *Queue = NULL;
+static uint64_t Tail = 0; /* next position to push (producers) */
+static uint64_t Head = 0; /* next position to pop (consumer) */
+static uint64_t Dropped = 0;
+#if defined(LINUX)
+static int Fd = -1;
+#endif
+
+int completioninit(lua_State *L)
+/* Initializes the queue (called before registering any callback that feeds it) */
+    {
+    uint64_t i;
+    if(Queue) return 0;
+    Queue = (centry_t*)MallocNoErr(L, QUEUE_SIZE * sizeof(centry_t));
+    if(!Queue) return ERR_MEMORY;
+    for(i = 0; i < QUEUE_SIZE; i++)
+        Queue[i].seq = i;
+    Tail = Head = 0;
+#if defined(LINUX)
+    Fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#endif
+    return 0;
+    }
+
+void completionpush(cl_event event, cl_int status, lua_Integer handle)
+/* Called by the event callbacks, possibly from driver threads */
+    {
+    centry_t *e;
+    uint64_t seq, pos = __atomic_load_n(&Tail, __ATOMIC_RELAXED);
+    while(1)
+        {
+        e = &Queue[pos & (QUEUE_SIZE - 1)];
+        seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+        if(seq == pos)
+            {
+            if(__atomic_compare_exchange_n(&Tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+            /* pos has been updated with the current Tail */
+            }
+        else if((int64_t)(seq - pos) < 0)
+            { /* full */
+            __atomic_add_fetch(&Dropped, 1, __ATOMIC_RELAXED);
+            return;
+            }
+        else
+            pos = __atomic_load_n(&Tail, __ATOMIC_RELAXED);
+        }
+    e->event = event;
+    e->status = status;
+    e->handle = handle;
+    __atomic_store_n(&e->seq, pos + 1, __ATOMIC_RELEASE);
+#if defined(LINUX)
+    if(Fd >= 0)
+        {
+        uint64_t one = 1;
+        ssize_t n = write(Fd, &one, sizeof(one));
+        (void)n;
+        }
+#endif
+    }
+
+static int Pop(centry_t *entry)
+/* Single consumer. Returns 0 if the queue is empty */
+    {
+    centry_t *e = &Queue[Head & (QUEUE_SIZE - 1)];
+    if(__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != Head + 1)
+        return 0;
+    *entry = *e;
+    __atomic_store_n(&e->seq, Head + QUEUE_SIZE, __ATOMIC_RELEASE);
+    Head++;
+    return 1;
+    }
+
+static int IsEmpty(void)
+    {
+    centry_t *e = &Queue[Head & (QUEUE_SIZE - 1)];
+    return __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != Head + 1;
+    }
+
+static void DrainFd(void)
+/* Resets the eventfd counter (non-blocking), so that it is readable again only
+ * when new completions are pushed after this point */
+    {
+#if defined(LINUX)
+    uint64_t count;
+    if(Fd >= 0 && read(Fd, &count, sizeof(count)) < 0) { /* EAGAIN: already zero */ }
+#endif
+    }
+
+static void Wait(double timeout)
+/* Waits until the queue is not empty, or the timeout expires (timeout < 0 means forever) */
+    {
+#if defined(LINUX)
+    struct pollfd pfd;
+    double t0 = now(), left = timeout;
+    if(Fd < 0) return;
+    while(IsEmpty())
+        {
+        pfd.fd = Fd;
+        pfd.events = POLLIN;
+        if(poll(&pfd, 1, timeout < 0 ? -1 : (int)(left * 1000 + 0.5)) < 0 && errno != EINTR)
+            return;
+        DrainFd();
+        if(timeout >= 0)
+            {
+            left = timeout - since(t0);
+            if(left <= 0) return;
+            }
+        }
+#else
+    double t0 = now();
+    while(IsEmpty())
+        {
+        if(timeout >= 0 && since(t0) >= timeout) return;
+        sleeep(0.0005);
+        }
+#endif
+    }
+
+static int WaitCompletions(lua_State *L)
+/* {event}, {status}, dropped = wait_completions([timeout], [maxcount]) */
+    {
+    centry_t entry;
+    ud_t *ud;
+    lua_Integer n = 0;
+    uint64_t dropped;
+    double timeout = luaL_optnumber(L, 1, -1);
+    lua_Integer maxcount = luaL_optinteger(L, 2, 0);
+    if(!Queue)
+        {
+        int err = completioninit(L);
+        if(err) return luaL_error(L, errstring(err));
+        }
+    if(timeout != 0)
+        Wait(timeout);
+    /* reset the eventfd before popping: entries pushed later will make it readable again */
+    DrainFd();
+    lua_newtable(L);
+    lua_newtable(L);
+    while((maxcount <= 0 || n < maxcount) && Pop(&entry))
+        {
+        if(entry.handle != 0)
+            lua_pushinteger(L, entry.handle);
+        else
+            {
+            ud = UD(entry.event);
+            if(!ud || !IsValid(ud)) continue; /* deleted meanwhile */
+            pushevent(L, entry.event);
+            }
+        lua_rawseti(L, -3, ++n);
+        if(entry.status < 0)
+            lua_pushinteger(L, entry.status);
+        else
+            lua_pushboolean(L, 1);
+        lua_rawseti(L, -2, n);
+        }
+#if defined(LINUX)
+    if(Fd >= 0 && !IsEmpty())
+        { /* entries left (maxcount): keep the eventfd readable */
+        uint64_t one = 1;
+        if(write(Fd, &one, sizeof(one)) < 0) { /* counter overflow: still readable */ }
+        }
+#endif
+    dropped = __atomic_exchange_n(&Dropped, 0, __ATOMIC_RELAXED);
+    lua_pushinteger(L, (lua_Integer)dropped);
+    return 3;
+    }
+
+static int CompletionFd(lua_State *L)
+/* fd = completion_fd() */
+    {
+#if defined(LINUX)
+    if(!Queue)
+        {
+        int err = completioninit(L);
+        if(err) return luaL_error(L, errstring(err));
+        }
+    if(Fd < 0)
+        return luaL_error(L, "eventfd: %s", strerror(errno));
+    lua_pushinteger(L, Fd);
+    return 1;
+#else
+    return notavailable(L);
+#endif
+    }
+
+static const struct luaL_Reg Functions[] = 
+    {
+        { "wait_completions", WaitCompletions },
+        { "completion_fd", CompletionFd },
+        { NULL, NULL } /* sentinel */
+    };
+
+void mooncl_open_completion(lua_State *L)
+    {
+    luaL_setfuncs(L, Functions, 0);
+    }
+
@@ -37,8 +37,10 @@ static int freecontext(lua_State *L, ud_t *ud)
     freechildren(L, COMMAND_QUEUE_MT, ud);
     freechildren(L, PROGRAM_MT, ud);
     freechildren(L, EVENT_MT, ud);
+    eventringpurge(context); /* events referenced by handles */
     freechildren(L, PIPE_MT, ud);
     freechildren(L, IMAGE_MT, ud);
+    freechildren(L, BUFFERPOOL_MT, ud); /* and their pooled sub buffers */
     freechildren(L, BUFFER_MT, ud);
     freechildren(L, SAMPLER_MT, ud);
     freechildren(L, SVM_MT, ud);
@@ -51,9 +53,8 @@ static int freecontext(lua_State *L, ud_t *ud)
 static ud_t *newcontext(lua_State *L, cl_platform platform, cl_context context)
     {
     ud_t *ud;
-    ud = newuserdata(L, context, CONTEXT_MT, "context");
+    ud = newuserdata(L, context, userdata(platform), CONTEXT_MT, "context");
     ud->platform = platform;
-    ud->parent_ud = userdata(platform);
     ud->clext = ud->parent_ud->clext;
     ud->destructor = freecontext;
     return ud;
@@ -106,6 +107,7 @@ static int CreateContext(lua_State *L)
     cl_context_properties props[3];
 
     cl_platform platform = checkplatform(L, 1, NULL);
+    ScratchReset(L);
     props[0] = CL_CONTEXT_PLATFORM;
     props[1] = (cl_context_properties)platform;
     props[2] = 0;
@@ -163,6 +165,8 @@ static int CreateContext(lua_State *L)
     if(from_type)
         createcontextdevices(L, platform, context); //@@ this may fail, causing memory loss
 
+    if(properties) Free(L, properties);
+    if(devices) Free(L, devices);
     ud = newcontext(L, platform, context);
     if(udinfo)
         {
@@ -138,78 +138,232 @@ static int FlattenTable(lua_State *L)
 
 /*-----------------------------------------------------------------------------*/
 
-#define PACK(T, what) /* what= number or integer */ \
-static int Pack##T(lua_State *L, size_t n, void *dst, size_t dstsize, int *faulty_element)  \
-    {                                       \
-    int isnum;                              \
-    size_t i;                               \
-    T *data = (T*)dst;                      \
-    if(faulty_element) *faulty_element = 0; \
-    if(dstsize < (n * sizeof(T)))           \
-        return ERR_LENGTH;                  \
-    for(i = 0; i < n; i++)                  \
-        {                                   \
-        lua_rawgeti(L, -1, i+1);            \
-        data[i] = lua_to##what##x(L, -1, &isnum); \
-        if(!isnum)                          \
-            {                               \
-            if(faulty_element) *faulty_element = i+1;   \
-            return ERR_TYPE; /* element i+1 is not a #what */ \
-            }                               \
-        lua_pop(L, 1);                      \
-        }                                   \
-    return 0;                               \
+/* Packing walks the values (a possibly nested table, or a list of arguments)
+ * once, converting them directly into the destination memory, without building
+ * a flattened copy. Runs of non-table elements are converted by type-specific
+ * loops, and nested tables are walked recursively.
+ */
+
+#define MAX_NESTING 64
+
+typedef struct {
+    int type;
+    size_t esize;
+    char *dst;
+    size_t cap;     /* capacity, in elements */
+    size_t count;   /* no. of elements packed so far */
+} packer_t;
+
+#define PACKRUN(T, what) /* what= number or integer */                              \
+static size_t PackRun##T(lua_State *L, int idx, lua_Integer i, size_t m, T *dst, int *err) \
+/* Packs up to m elements of the table at idx, starting from the i-th.              \
+ * Stops at the first nested table, and returns the no. of elements packed.         \
+ */                                                                                 \
+    {                                                                               \
+    int isnum;                                                                      \
+    size_t k;                                                                       \
+    for(k = 0; k < m; k++)                                                          \
+        {                                                                           \
+        if(lua_rawgeti(L, idx, i + k) == LUA_TTABLE)                                \
+            { lua_pop(L, 1); break; }                                               \
+        dst[k] = (T)lua_to##what##x(L, -1, &isnum);                                 \
+        lua_pop(L, 1);                                                              \
+        if(!isnum)                                                                  \
+            { *err = ERR_TYPE; break; }                                             \
+        }                                                                           \
+    return k;                                                                       \
     }
 
-#define PACK_NUMBERS(T)     PACK(T, number)
-#define PACK_INTEGERS(T)    PACK(T, integer)
-
-PACK_NUMBERS(cl_half)
-PACK_NUMBERS(cl_float)
-PACK_NUMBERS(cl_double)
-PACK_INTEGERS(cl_char)
-PACK_INTEGERS(cl_uchar)
-PACK_INTEGERS(cl_short)
-PACK_INTEGERS(cl_ushort)
-PACK_INTEGERS(cl_int)
-PACK_INTEGERS(cl_uint)
-PACK_INTEGERS(cl_long)
-PACK_INTEGERS(cl_ulong)
+PACKRUN(cl_float, number)
+PACKRUN(cl_double, number)
+PACKRUN(cl_char, integer)
+PACKRUN(cl_uchar, integer)
+PACKRUN(cl_short, integer)
+PACKRUN(cl_ushort, integer)
+PACKRUN(cl_int, integer)
+PACKRUN(cl_uint, integer)
+PACKRUN(cl_long, integer)
+PACKRUN(cl_ulong, integer)
+
+#define HALF_BLOCK 64
+
+static size_t PackRuncl_half(lua_State *L, int idx, lua_Integer i, size_t m, cl_half *dst, int *err)
+/* Values that are exactly representable as floats (the common case) are converted
+ * in blocks with tohalfv(), the others one by one with tohalf(), so that no double
+ * rounding occurs.
+ */
+    {
+    int isnum, exact;
+    size_t k = 0, j, b, e;
+    lua_Number val[HALF_BLOCK];
+    float fval[HALF_BLOCK];
+    while(k < m)
+        {
+        b = (m - k) < HALF_BLOCK ? (m - k) : HALF_BLOCK;
+        exact = 1;
+        for(j = 0; j < b; j++)
+            {
+            if(lua_rawgeti(L, idx, i + k + j) == LUA_TTABLE)
+                { lua_pop(L, 1); break; }
+            val[j] = lua_tonumberx(L, -1, &isnum);
+            lua_pop(L, 1);
+            if(!isnum)
+                { *err = ERR_TYPE; break; }
+            fval[j] = (float)val[j];
+            if((lua_Number)fval[j] != val[j] && val[j] == val[j]) exact = 0;
+            }
+        if(exact)
+            tohalfv(fval, dst + k, j);
+        else
+            for(e = 0; e < j; e++) dst[k+e] = tohalf(val[e]);
+        k += j;
+        if(j < b) break; /* nested table or error */
+        }
+    return k;
+    }
 
-static int Pack(lua_State *L)
+static size_t PackRun(lua_State *L, int idx, lua_Integer i, size_t m, packer_t *p, int *err)
     {
-    int err = 0;
-    void *dst = NULL;
-    size_t dstsize = 0;
-    int type = checkprimtype(L, 1);
-    size_t n = toflattable(L, 2);
-    switch(type)
+    void *dst = p->dst + p->count * p->esize;
+    switch(p->type)
         {
-#define P(T) do { dstsize = n * sizeof(T);      \
-                  dst = Malloc(L, dstsize);     \
-                  err = Pack##T(L, n, dst, dstsize, NULL); } while(0)
-
-        case NONCL_TYPE_CHAR:   P(cl_char); break;
-        case NONCL_TYPE_UCHAR:  P(cl_uchar); break;
-        case NONCL_TYPE_SHORT:  P(cl_short); break;
-        case NONCL_TYPE_USHORT: P(cl_ushort); break;
-        case NONCL_TYPE_INT:    P(cl_int); break;
-        case NONCL_TYPE_UINT:   P(cl_uint); break;
-        case NONCL_TYPE_LONG:   P(cl_long); break;
-        case NONCL_TYPE_ULONG:  P(cl_ulong); break;
-        case NONCL_TYPE_HALF:   P(cl_half); break;
-        case NONCL_TYPE_FLOAT:  P(cl_float); break;
-        case NONCL_TYPE_DOUBLE: P(cl_double); break;
+#define P(T) return PackRun##T(L, idx, i, m, (T*)dst, err)
+        case NONCL_TYPE_CHAR:   P(cl_char);
+        case NONCL_TYPE_UCHAR:  P(cl_uchar);
+        case NONCL_TYPE_SHORT:  P(cl_short);
+        case NONCL_TYPE_USHORT: P(cl_ushort);
+        case NONCL_TYPE_INT:    P(cl_int);
+        case NONCL_TYPE_UINT:   P(cl_uint);
+        case NONCL_TYPE_LONG:   P(cl_long);
+        case NONCL_TYPE_ULONG:  P(cl_ulong);
+        case NONCL_TYPE_HALF:   P(cl_half);
+        case NONCL_TYPE_FLOAT:  P(cl_float);
+        case NONCL_TYPE_DOUBLE: P(cl_double);
         default:
-            return unexpected(L);
+            *err = ERR_UNKNOWN;
+            return 0;
 #undef P
         }
+    return 0;
+    }
+
+static int PackTable(lua_State *L, int idx, packer_t *p, int depth)
+    {
+    int err = 0;
+    size_t k, m;
+    lua_Integer i = 1;
+    lua_Integer len = lua_rawlen(L, idx);
+    while(i <= len)
+        {
+        m = len - i + 1;
+        if(m > p->cap - p->count) m = p->cap - p->count;
+        k = PackRun(L, idx, i, m, p, &err);
+        p->count += k;
+        i += k;
+        if(err) return err;
+        if(i > len) break;
+        /* the run stopped at a nested table, or because dst is full */
+        if(lua_rawgeti(L, idx, i) != LUA_TTABLE)
+            { lua_pop(L, 1); return ERR_LENGTH; }
+        if(depth >= MAX_NESTING || !lua_checkstack(L, 2))
+            { lua_pop(L, 1); return ERR_GENERIC; }
+        err = PackTable(L, lua_gettop(L), p, depth + 1);
+        lua_pop(L, 1);
+        if(err) return err;
+        i++;
+        }
+    return 0;
+    }
+
+static size_t CountTable(lua_State *L, int idx, int depth)
+    {
+    size_t n = 0;
+    lua_Integer i, len = lua_rawlen(L, idx);
+    for(i = 1; i <= len; i++)
+        {
+        if(lua_rawgeti(L, idx, i) == LUA_TTABLE && depth < MAX_NESTING && lua_checkstack(L, 2))
+            n += CountTable(L, lua_gettop(L), depth + 1);
+        else
+            n++;
+        lua_pop(L, 1);
+        }
+    return n;
+    }
+
+size_t countdata(lua_State *L, int arg, int deep)
+/* Returns the number of values at arg (a possibly nested table, or the list of
+ * arguments from arg to the top of the stack). If deep=0, nested tables are not
+ * visited and count as one, which gives the exact count for flat tables with no
+ * additional cost.
+ */
+    {
+    int i, top = lua_gettop(L);
+    size_t n = 0;
+    if(lua_type(L, arg) == LUA_TTABLE)
+        return deep ? CountTable(L, arg, 0) : lua_rawlen(L, arg);
+    for(i = arg; i <= top; i++)
+        n += (deep && lua_type(L, i) == LUA_TTABLE) ? CountTable(L, i, 0) : 1;
+    return n;
+    }
+
+int packdata(lua_State *L, int arg, int type, void *dst, size_t dstsize, size_t *count)
+/* Packs the values at arg (a possibly nested table, or the list of arguments from
+ * arg to the top of the stack) into dst, according to the given type.
+ * Returns ERR_LENGTH if they do not fit in dstsize bytes, and the number of packed
+ * elements in *count.
+ */
+    {
+    int err, i, top = lua_gettop(L);
+    packer_t p;
+    p.type = type;
+    p.esize = sizeofprimtype(type);
+    if(p.esize == 0) return ERR_UNKNOWN;
+    p.dst = (char*)dst;
+    p.cap = dstsize / p.esize;
+    p.count = 0;
+    if(lua_type(L, arg) == LUA_TTABLE)
+        err = PackTable(L, arg, &p, 0);
+    else
+        { /* there are few arguments (they are on the stack), so it is cheap
+           * to collect them in a table */
+        lua_createtable(L, top >= arg ? top - arg + 1 : 0, 0);
+        for(i = arg; i <= top; i++)
+            {
+            lua_pushvalue(L, i);
+            lua_rawseti(L, -2, i - arg + 1);
+            }
+        err = PackTable(L, lua_gettop(L), &p, 0);
+        lua_pop(L, 1);
+        }
+    if(count) *count = p.count;
+    return err;
+    }
+
+static int Pack(lua_State *L)
+    {
+    int err;
+    char *dst;
+    size_t count;
+    int type = checkprimtype(L, 1);
+    size_t esize = sizeofprimtype(type);
+    size_t n = countdata(L, 2, 0);
+    if(n == 0)
+        { lua_pushstring(L, ""); return 1; }
+    dst = (char*)Malloc(L, n * esize);
+    err = packdata(L, 2, type, dst, n * esize, &count);
+    if(err == ERR_LENGTH) /* nested tables: get the exact count and retry */
+        {
+        Free(L, dst);
+        n = countdata(L, 2, 1);
+        dst = (char*)Malloc(L, n * esize);
+        err = packdata(L, 2, type, dst, n * esize, &count);
+        }
     if(err)
         {
         Free(L, dst);
         return luaL_argerror(L, 2, errstring(err));
         }
-    lua_pushlstring(L, (char*)dst, dstsize);
+    lua_pushlstring(L, dst, count * esize);
     Free(L, dst);
     return 1;
     }
@@ -237,7 +391,27 @@ static int Unpack##T(lua_State *L, const void* data, size_t len) \
 #define UNPACK_INTEGERS(T)  UNPACK(T, integer)
 
 
-UNPACK_NUMBERS(cl_half)
+static int Unpackcl_half(lua_State *L, const void* data, size_t len)
+    {
+    size_t n, i, j, m;
+    float fval[HALF_BLOCK];
+    if((len < sizeof(cl_half)) || (len % sizeof(cl_half)) != 0)
+        return ERR_LENGTH;
+    n = len / sizeof(cl_half);
+    lua_newtable(L);
+    for(i = 0; i < n; i += m)
+        {
+        m = (n - i) < HALF_BLOCK ? (n - i) : HALF_BLOCK;
+        fromhalfv((const cl_half*)data + i, fval, m);
+        for(j = 0; j < m; j++)
+            {
+            lua_pushnumber(L, fval[j]);
+            lua_rawseti(L, -2, i+j+1);
+            }
+        }
+    return 0;
+    }
+
 UNPACK_NUMBERS(cl_float)
 UNPACK_NUMBERS(cl_double)
 UNPACK_INTEGERS(cl_char)
@@ -285,45 +459,11 @@ static int Unpack(lua_State *L)
 /*-----------------------------------------------------------------------------*/
 
 
-int testdata(lua_State *L, int type, size_t n, void *dst, size_t dstsize)
-/* expects, on top of the stack, a flat table containing n elements of the given type
- * dst must point to at least n * sizeofprimtype(type) bytes of memory, where
- * the data will be packed according to the given type
- */
-    {
-    int err = 0;
-    switch(type)
-        {
-#define P(T) do { err = Pack##T(L, n, dst, dstsize, NULL); } while(0)
-
-        case NONCL_TYPE_CHAR:   P(cl_char); break;
-        case NONCL_TYPE_UCHAR:  P(cl_uchar); break;
-        case NONCL_TYPE_SHORT:  P(cl_short); break;
-        case NONCL_TYPE_USHORT: P(cl_ushort); break;
-        case NONCL_TYPE_INT:    P(cl_int); break;
-        case NONCL_TYPE_UINT:   P(cl_uint); break;
-        case NONCL_TYPE_LONG:   P(cl_long); break;
-        case NONCL_TYPE_ULONG:  P(cl_ulong); break;
-        case NONCL_TYPE_HALF:   P(cl_half); break;
-        case NONCL_TYPE_FLOAT:  P(cl_float); break;
-        case NONCL_TYPE_DOUBLE: P(cl_double); break;
-        default:
-            return unexpected(L);
-#undef P
-        }
-    return err;
-    }
-
-
 int checkdata(lua_State *L, int arg, int type, void *dst, size_t dstsize)
     {
-    size_t n = toflattable(L, arg);
-    int err = testdata(L, type, n, dst, dstsize);
+    int err = packdata(L, arg, type, dst, dstsize, NULL);
     if(err)
-        {
-        lua_pop(L, 1); /* flat table */
         return luaL_argerror(L, arg, errstring(err));
-        }
     return 0;
     }
 
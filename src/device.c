@@ -38,10 +38,9 @@ static int freedevice(lua_State *L, ud_t *ud)
 static int newdevice(lua_State *L, cl_platform platform, cl_device device)
     {
     ud_t *ud;
-    ud = newuserdata(L, device, DEVICE_MT, "device");
+    ud = newuserdata(L, device, userdata(platform), DEVICE_MT, "device");
     ud->platform = platform;
     ud->device = device;
-    ud->parent_ud = userdata(platform);
     ud->clext = ud->parent_ud->clext;
     ud->destructor = freedevice;
     return 1;
@@ -51,10 +50,9 @@ static int newsubdevice(lua_State *L, cl_device parent, cl_device device)
     {
     ud_t *ud;
     ud_t *parent_ud = UD(parent);
-    ud = newuserdata(L, device, DEVICE_MT, "sub device");
+    ud = newuserdata(L, device, parent_ud, DEVICE_MT, "sub device");
     ud->platform = parent_ud->platform;
     ud->device = device;
-    ud->parent_ud = parent_ud;
     ud->clext = ud->parent_ud->clext;
     ud->destructor = freedevice;
     MarkSubDevice(ud);
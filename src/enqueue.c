@@ -63,16 +63,26 @@ static int EnqueueReadBuffer(lua_State *L)
     cl_event event = 0;
     cl_uint wc;
     cl_event *we;
+    size_t size = 0;
     cl_queue queue = checkqueue(L, 1, &ud);
     cl_buffer buffer = checkbuffer(L, 2, NULL);
     cl_bool blocking = checkboolean(L, 3);
     size_t offset = luaL_checkinteger(L, 4);
-    size_t size = luaL_checkinteger(L, 5);
-    void *ptr = checklightuserdata(L, 6);
+    ud_t *hostmem_ud;
+    void *ptr = checkhostptr(L, 6, &size, &hostmem_ud); /* lightuserdata or hostmem */
+    ScratchReset(L);
+    if(hostmem_ud && IsReadOnly(hostmem_ud))
+        return luaL_argerror(L, 6, "read-only hostmem");
+    if(!lua_isnoneornil(L, 5) || size == 0)
+        {
+        if(size > 0 && (size_t)luaL_checkinteger(L, 5) > size)
+            return luaL_argerror(L, 5, errstring(ERR_BOUNDARIES));
+        size = luaL_checkinteger(L, 5);
+        }
 
 //    checkbufferboundaries(L, buffer, offset, size);
 
-    ge = optboolean(L, 8, 0);
+    ge = optgetevent(L, 8);
     we = checkeventlist(L, 7, &wc, &err);
     if(err < 0)
         return luaL_argerror(L, 7, errstring(err));
@@ -83,7 +93,7 @@ static int EnqueueReadBuffer(lua_State *L)
     if(ec)
         { CheckError(L, ec); return 0; }        
     if(event)
-        return newevent(L, ud->context, event);
+        return pushenqueuedevent(L, ud->context, event, ge);
     return 0;
     }
 
@@ -95,16 +105,23 @@ static int EnqueueWriteBuffer(lua_State *L)
     cl_event event = 0;
     cl_uint wc;
     cl_event *we;
+    size_t size = 0;
     cl_queue queue = checkqueue(L, 1, &ud);
     cl_buffer buffer = checkbuffer(L, 2, NULL);
     cl_bool blocking = checkboolean(L, 3);
     size_t offset = luaL_checkinteger(L, 4);
-    size_t size = luaL_checkinteger(L, 5);
-    const void *ptr = checklightuserdata(L, 6);
+    const void *ptr = checkhostptr(L, 6, &size, NULL); /* lightuserdata or hostmem */
+    ScratchReset(L);
+    if(!lua_isnoneornil(L, 5) || size == 0)
+        {
+        if(size > 0 && (size_t)luaL_checkinteger(L, 5) > size)
+            return luaL_argerror(L, 5, errstring(ERR_BOUNDARIES));
+        size = luaL_checkinteger(L, 5);
+        }
 
 //    checkbufferboundaries(L, buffer, offset, size);
 
-    ge = optboolean(L, 8, 0);
+    ge = optgetevent(L, 8);
     we = checkeventlist(L, 7, &wc, &err);
     if(err < 0)
         return luaL_argerror(L, 7, errstring(err));
@@ -115,7 +132,7 @@ static int EnqueueWriteBuffer(lua_State *L)
     if(ec)
         { CheckError(L, ec); return 0; }        
     if(event)
-        return newevent(L, ud->context, event);
+        return pushenqueuedevent(L, ud->context, event, ge);
     return 0;
     }
 
@@ -134,11 +151,12 @@ static int EnqueueCopyBuffer(lua_State *L)
     size_t src_offset = luaL_checkinteger(L, 4);
     size_t dst_offset = luaL_checkinteger(L, 5);
     size_t size = luaL_checkinteger(L, 6);
+    ScratchReset(L);
 
     checkbufferboundaries(L, src_buffer, src_offset, size);
     checkbufferboundaries(L, dst_buffer, dst_offset, size);
 
-    ge = optboolean(L, 8, 0);
+    ge = optgetevent(L, 8);
     we = checkeventlist(L, 7, &wc, &err);
     if(err < 0)
         return luaL_argerror(L, 7, errstring(err));
@@ -150,7 +168,7 @@ static int EnqueueCopyBuffer(lua_State *L)
     if(ec)
         { CheckError(L, ec); return 0; }        
     if(event)
-        return newevent(L, ud->context, event);
+        return pushenqueuedevent(L, ud->context, event, ge);
     return 0;
     }
 
@@ -168,10 +186,11 @@ static int EnqueueFillBuffer(lua_State *L)
     const void *pattern = luaL_checklstring(L, 3, &pattern_size);
     size_t offset = luaL_checkinteger(L, 4);
     size_t size = luaL_checkinteger(L, 5);
+    ScratchReset(L);
 
     checkbufferboundaries(L, buffer, offset, size);
 
-    ge = optboolean(L, 7, 0);
+    ge = optgetevent(L, 7);
     we = checkeventlist(L, 6, &wc, &err);
     if(err < 0)
         return luaL_argerror(L, 6, errstring(err));
@@ -183,7 +202,7 @@ static int EnqueueFillBuffer(lua_State *L)
     if(ec)
         { CheckError(L, ec); return 0; }        
     if(event)
-        return newevent(L, ud->context, event);
+        return pushenqueuedevent(L, ud->context, event, ge);
     return 0;
     }
 
@@ -206,6 +225,7 @@ static int EnqueueReadBufferRect(lua_State *L)
     cl_queue queue = checkqueue(L, 1, &ud);
     cl_buffer buffer = checkbuffer(L, 2, NULL);
     cl_bool blocking = checkboolean(L, 3);
+    ScratchReset(L);
 
     err = checksize3(L, 4, buffer_origin);
     if(err) return luaL_argerror(L, 4, errstring(err));
@@ -220,7 +240,7 @@ static int EnqueueReadBufferRect(lua_State *L)
 
     ptr = checklightuserdata(L, 11);
 
-    ge = optboolean(L, 13, 0);
+    ge = optgetevent(L, 13);
     we = checkeventlist(L, 12, &wc, &err);
     if(err < 0)
         return luaL_argerror(L, 12, errstring(err));
@@ -233,7 +253,7 @@ static int EnqueueReadBufferRect(lua_State *L)
     if(ec)
         { CheckError(L, ec); return 0; }        
     if(event)
-        return newevent(L, ud->context, event);
+        return pushenqueuedevent(L, ud->context, event, ge);
     return 0;
     }
 
@@ -252,6 +272,7 @@ static int EnqueueWriteBufferRect(lua_State *L)
     cl_queue queue = checkqueue(L, 1, &ud);
     cl_buffer buffer = checkbuffer(L, 2, NULL);
     cl_bool blocking = checkboolean(L, 3);
+    ScratchReset(L);
 
     err = checksize3(L, 4, buffer_origin);
     if(err) return luaL_argerror(L, 4, errstring(err));
@@ -265,7 +286,7 @@ static int EnqueueWriteBufferRect(lua_State *L)
     host_slice_pitch = luaL_checkinteger(L, 10);
     ptr = checklightuserdata(L, 11);
 
-    ge = optboolean(L, 13, 0);
+    ge = optgetevent(L, 13);
     we = checkeventlist(L, 12, &wc, &err);
     if(err < 0)
         return luaL_argerror(L, 12, errstring(err));
@@ -278,7 +299,7 @@ static int EnqueueWriteBufferRect(lua_State *L)
     if(ec)
         { CheckError(L, ec); return 0; }        
     if(event)
-        return newevent(L, ud->context, event);
+        return pushenqueuedevent(L, ud->context, event, ge);
     return 0;
     }
 
@@ -296,6 +317,7 @@ static int EnqueueCopyBufferRect(lua_State *L)
     cl_queue queue = checkqueue(L, 1, &ud);
     cl_buffer src_buffer = checkbuffer(L, 2, NULL);
     cl_buffer dst_buffer = checkbuffer(L, 3, NULL);
+    ScratchReset(L);
 
     err = checksize3(L, 4, src_origin);
     if(err) return luaL_argerror(L, 4, errstring(err));
@@ -308,7 +330,7 @@ static int EnqueueCopyBufferRect(lua_State *L)
     dst_row_pitch = luaL_checkinteger(L, 9);
     dst_slice_pitch = luaL_checkinteger(L, 10);
 
-    ge = optboolean(L, 12, 0);
+    ge = optgetevent(L, 12);
     we = checkeventlist(L, 11, &wc, &err);
     if(err < 0)
         return luaL_argerror(L, 11, errstring(err));
@@ -321,7 +343,7 @@ static int EnqueueCopyBufferRect(lua_State *L)
     if(ec)
         { CheckError(L, ec); return 0; }        
     if(event)
-        return newevent(L, ud->context, event);
+        return pushenqueuedevent(L, ud->context, event, ge);
     return 0;
     }
 
@@ -343,6 +365,7 @@ static int EnqueueReadImage(lua_State *L)
     cl_queue queue = checkqueue(L, 1, &ud);
     cl_image image = checkimage(L, 2, NULL);
     cl_bool blocking = checkboolean(L, 3);
+    ScratchReset(L);
 
     err = checksize3(L, 4, origin);
     if(err) return luaL_argerror(L, 4, errstring(err));
@@ -353,7 +376,7 @@ static int EnqueueReadImage(lua_State *L)
 
     ptr = checklightuserdata(L, 8);
 
-    ge = optboolean(L, 10, 0);
+    ge = optgetevent(L, 10);
     we = checkeventlist(L, 9, &wc, &err);
     if(err < 0)
         return luaL_argerror(L, 9, errstring(err));
@@ -365,7 +388,7 @@ static int EnqueueReadImage(lua_State *L)
     if(ec)
         { CheckError(L, ec); return 0; }        
     if(event)
-        return newevent(L, ud->context, event);
+        return pushenqueuedevent(L, ud->context, event, ge);
     return 0;
     }
 
@@ -384,6 +407,7 @@ static int EnqueueWriteImage(lua_State *L)
     cl_queue queue = checkqueue(L, 1, &ud);
     cl_image image = checkimage(L, 2, NULL);
     cl_bool blocking = checkboolean(L, 3);
+    ScratchReset(L);
 
     err = checksize3(L, 4, origin);
     if(err) return luaL_argerror(L, 4, errstring(err));
@@ -394,7 +418,7 @@ static int EnqueueWriteImage(lua_State *L)
 
     ptr = checklightuserdata(L, 8);
 
-    ge = optboolean(L, 10, 0);
+    ge = optgetevent(L, 10);
     we = checkeventlist(L, 9, &wc, &err);
     if(err < 0)
         return luaL_argerror(L, 9, errstring(err));
@@ -406,7 +430,7 @@ static int EnqueueWriteImage(lua_State *L)
     if(ec)
         { CheckError(L, ec); return 0; }        
     if(event)
-        return newevent(L, ud->context, event);
+        return pushenqueuedevent(L, ud->context, event, ge);
     return 0;
     }
 
@@ -425,6 +449,7 @@ static int EnqueueFillImage(lua_State *L)
     cl_queue queue = checkqueue(L, 1, &ud);
     cl_image image = checkimage(L, 2, NULL);
     const void *fill_color = luaL_checklstring(L, 3, &fill_color_size);
+    ScratchReset(L);
     // fill_color may be either: float, float[4], int[4], uint[4]
     //  e.g. fill_color = cl.pack('float', { 0.1, 0.5, 0.0, 1.0 })
     //  e.g. fill_color = cl.pack('float', 0.1)
@@ -434,7 +459,7 @@ static int EnqueueFillImage(lua_State *L)
     err = checksize3(L, 5, region);
     if(err) return luaL_argerror(L, 5, errstring(err));
 
-    ge = optboolean(L, 7, 0);
+    ge = optgetevent(L, 7);
     we = checkeventlist(L, 6, &wc, &err);
     if(err < 0)
         return luaL_argerror(L, 6, errstring(err));
@@ -445,7 +470,7 @@ static int EnqueueFillImage(lua_State *L)
     if(ec)
         { CheckError(L, ec); return 0; }        
     if(event)
-        return newevent(L, ud->context, event);
+        return pushenqueuedevent(L, ud->context, event, ge);
     return 0;
     }
 
@@ -462,6 +487,7 @@ static int EnqueueCopyImage(lua_State *L)
     cl_queue queue = checkqueue(L, 1, &ud);
     cl_image src_image = checkimage(L, 2, NULL);
     cl_image dst_image = checkimage(L, 3, NULL);
+    ScratchReset(L);
 
     err = checksize3(L, 4, src_origin);
     if(err) return luaL_argerror(L, 4, errstring(err));
@@ -470,7 +496,7 @@ static int EnqueueCopyImage(lua_State *L)
     err = checksize3(L, 6, region);
     if(err) return luaL_argerror(L, 6, errstring(err));
 
-    ge = optboolean(L, 8, 0);
+    ge = optgetevent(L, 8);
     we = checkeventlist(L, 7, &wc, &err);
     if(err < 0)
         return luaL_argerror(L, 7, errstring(err));
@@ -482,7 +508,7 @@ static int EnqueueCopyImage(lua_State *L)
     if(ec)
         { CheckError(L, ec); return 0; }        
     if(event)
-        return newevent(L, ud->context, event);
+        return pushenqueuedevent(L, ud->context, event, ge);
     return 0;
     }
 
@@ -500,6 +526,7 @@ static int EnqueueCopyImageToBuffer(lua_State *L)
     cl_queue queue = checkqueue(L, 1, &ud);
     cl_image src_image = checkimage(L, 2, NULL);
     cl_buffer dst_buffer = checkbuffer(L, 3, NULL);
+    ScratchReset(L);
 
     err = checksize3(L, 4, src_origin);
     if(err) return luaL_argerror(L, 4, errstring(err));
@@ -507,7 +534,7 @@ static int EnqueueCopyImageToBuffer(lua_State *L)
     if(err) return luaL_argerror(L, 5, errstring(err));
     dst_offset = luaL_checkinteger(L, 6);
 
-    ge = optboolean(L, 8, 0);
+    ge = optgetevent(L, 8);
     we = checkeventlist(L, 7, &wc, &err);
     if(err < 0)
         return luaL_argerror(L, 7, errstring(err));
@@ -519,7 +546,7 @@ static int EnqueueCopyImageToBuffer(lua_State *L)
     if(ec)
         { CheckError(L, ec); return 0; }        
     if(event)
-        return newevent(L, ud->context, event);
+        return pushenqueuedevent(L, ud->context, event, ge);
     return 0;
     }
 
@@ -537,6 +564,7 @@ static int EnqueueCopyBufferToImage(lua_State *L)
     cl_queue queue = checkqueue(L, 1, &ud);
     cl_buffer src_buffer = checkbuffer(L, 2, NULL);
     cl_image dst_image = checkimage(L, 3, NULL);
+    ScratchReset(L);
 
     src_offset = luaL_checkinteger(L, 4);
     err = checksize3(L, 5, dst_origin);
@@ -544,7 +572,7 @@ static int EnqueueCopyBufferToImage(lua_State *L)
     err = checksize3(L, 6, region);
     if(err) return luaL_argerror(L, 6, errstring(err));
 
-    ge = optboolean(L, 8, 0);
+    ge = optgetevent(L, 8);
     we = checkeventlist(L, 7, &wc, &err);
     if(err < 0)
         return luaL_argerror(L, 7, errstring(err));
@@ -556,7 +584,7 @@ static int EnqueueCopyBufferToImage(lua_State *L)
     if(ec)
         { CheckError(L, ec); return 0; }        
     if(event)
-        return newevent(L, ud->context, event);
+        return pushenqueuedevent(L, ud->context, event, ge);
     return 0;
     }
 
@@ -579,10 +607,11 @@ static int EnqueueMapBuffer(lua_State *L)
     cl_map_flags flags = checkflags(L, 4);
     size_t offset = luaL_checkinteger(L, 5);
     size_t size = luaL_checkinteger(L, 6);
+    ScratchReset(L);
 
     checkbufferboundaries(L, buffer, offset, size);
 
-    ge = optboolean(L, 8, 0);
+    ge = optgetevent(L, 8);
     we = checkeventlist(L, 7, &wc, &err);
     if(err < 0)
         return luaL_argerror(L, 7, errstring(err));
@@ -596,7 +625,7 @@ static int EnqueueMapBuffer(lua_State *L)
     lua_pushlightuserdata(L, ptr);
     if(event)
         { 
-        newevent(L, ud->context, event);
+        pushenqueuedevent(L, ud->context, event, ge);
         return 2;
         }
     return 1;
@@ -617,12 +646,13 @@ static int EnqueueMapImage(lua_State *L)
     cl_image image = checkimage(L, 2, NULL);
     cl_bool blocking = checkboolean(L, 3);
     cl_map_flags flags = checkflags(L, 4);
+    ScratchReset(L);
     err = checksize3(L, 5, origin);
     if(err) return luaL_argerror(L, 5, errstring(err));
     err = checksize3(L, 6, region);
     if(err) return luaL_argerror(L, 6, errstring(err));
 
-    ge = optboolean(L, 8, 0);
+    ge = optgetevent(L, 8);
     we = checkeventlist(L, 7, &wc, &err);
     if(err < 0)
         return luaL_argerror(L, 7, errstring(err));
@@ -638,7 +668,7 @@ static int EnqueueMapImage(lua_State *L)
     lua_pushinteger(L, image_slice_pitch);
     if(event)
         { 
-        newevent(L, ud->context, event);
+        pushenqueuedevent(L, ud->context, event, ge);
         return 4;
         }
     return 3;
@@ -655,8 +685,9 @@ static int EnqueueUnmapMemObject(lua_State *L)
     cl_queue queue = checkqueue(L, 1, &ud);
     cl_mem mem = checkmemobject(L, 2, NULL);
     void *ptr = checklightuserdata(L, 3);
+    ScratchReset(L);
     
-    ge = optboolean(L, 6, 0);
+    ge = optgetevent(L, 6);
     we = checkeventlist(L, 5, &wc, &err);
     if(err < 0)
         return luaL_argerror(L, 5, errstring(err));
@@ -666,7 +697,7 @@ static int EnqueueUnmapMemObject(lua_State *L)
     if(ec)
         { CheckError(L, ec); return 0; }        
     if(event)
-        return newevent(L, ud->context, event);
+        return pushenqueuedevent(L, ud->context, event, ge);
     return 0;
     }
 
@@ -684,10 +715,11 @@ static int EnqueueSVMMap(lua_State *L)
     cl_map_flags flags = checkflags(L, 3);
     void *ptr = checklightuserdata(L, 4);
     size_t size = luaL_checkinteger(L, 5);
+    ScratchReset(L);
 
     CheckPfn_2_0(L, EnqueueSVMMap);
 
-    ge = optboolean(L, 7, 0);
+    ge = optgetevent(L, 7);
     we = checkeventlist(L, 6, &wc, &err);
     if(err < 0)
         return luaL_argerror(L, 6, errstring(err));
@@ -699,7 +731,7 @@ static int EnqueueSVMMap(lua_State *L)
 
     if(event)
         { 
-        newevent(L, ud->context, event);
+        pushenqueuedevent(L, ud->context, event, ge);
         return 1;
         }
     return 0;
@@ -716,10 +748,11 @@ static int EnqueueSVMUnmap(lua_State *L)
     cl_event *we;
     cl_queue queue = checkqueue(L, 1, &ud);
     void *ptr = checklightuserdata(L, 2);
+    ScratchReset(L);
     
     CheckPfn_2_0(L, EnqueueSVMUnmap);
 
-    ge = optboolean(L, 5, 0);
+    ge = optgetevent(L, 5);
     we = checkeventlist(L, 4, &wc, &err);
     if(err < 0)
         return luaL_argerror(L, 4, errstring(err));
@@ -729,7 +762,7 @@ static int EnqueueSVMUnmap(lua_State *L)
     if(ec)
         { CheckError(L, ec); return 0; }        
     if(event)
-        return newevent(L, ud->context, event);
+        return pushenqueuedevent(L, ud->context, event, ge);
     return 0;
     }
 
@@ -751,6 +784,7 @@ static int EnqueueSVMFree(lua_State *L)
     void ** ptrs = NULL;
     cl_svm *svms;
     cl_queue queue = checkqueue(L, 1, &ud);
+    ScratchReset(L);
 
     CheckPfn_2_0(L, EnqueueSVMFree);
 
@@ -773,7 +807,7 @@ static int EnqueueSVMFree(lua_State *L)
         svm_ud->destructor(L, svm_ud);
         }
     
-    ge = optboolean(L, 4, 0);
+    ge = optgetevent(L, 4);
     we = checkeventlist(L, 3, &wc, &err);
     if(err < 0)
         { CLEANUP(); return luaL_argerror(L, 3, errstring(err)); }
@@ -784,7 +818,7 @@ static int EnqueueSVMFree(lua_State *L)
     if(ec)
         { CheckError(L, ec); return 0; }        
     if(event)
-        return newevent(L, ud->context, event);
+        return pushenqueuedevent(L, ud->context, event, ge);
     return 0;
 #undef CLEANUP
     }
@@ -802,10 +836,11 @@ static int EnqueueSVMMemcpy(lua_State *L)
     void *dst_ptr = checklightuserdata(L, 3);
     const void *src_ptr = checklightuserdata(L, 4);
     size_t size = luaL_checkinteger(L, 5);
+    ScratchReset(L);
 
     CheckPfn_2_0(L, EnqueueSVMMemcpy);
 
-    ge = optboolean(L, 7, 0);
+    ge = optgetevent(L, 7);
     we = checkeventlist(L, 6, &wc, &err);
     if(err < 0)
         return luaL_argerror(L, 6, errstring(err));
@@ -817,7 +852,7 @@ static int EnqueueSVMMemcpy(lua_State *L)
 
     if(event)
         { 
-        newevent(L, ud->context, event);
+        pushenqueuedevent(L, ud->context, event, ge);
         return 1;
         }
     return 0;
@@ -836,10 +871,11 @@ static int EnqueueSVMMemFill(lua_State *L)
     void *svm_ptr = checklightuserdata(L, 2);
     const void *pattern = luaL_checklstring(L, 3, &pattern_size);
     size_t size = luaL_checkinteger(L, 4);
+    ScratchReset(L);
 
     CheckPfn_2_0(L, EnqueueSVMMemFill);
 
-    ge = optboolean(L, 6, 0);
+    ge = optgetevent(L, 6);
     we = checkeventlist(L, 5, &wc, &err);
     if(err < 0)
         return luaL_argerror(L, 5, errstring(err));
@@ -852,7 +888,7 @@ static int EnqueueSVMMemFill(lua_State *L)
 
     if(event)
         { 
-        newevent(L, ud->context, event);
+        pushenqueuedevent(L, ud->context, event, ge);
         return 1;
         }
     return 0;
@@ -872,7 +908,9 @@ static int EnqueueMigrateMemObjects(lua_State *L)
     cl_event *we = NULL;
     cl_queue queue = checkqueue(L, 1, &ud);
     cl_mem_migration_flags flags = checkflags(L, 2);
-    const cl_mem *mem_objects = checkmemobjectlist(L, 3, &count, &err);
+    const cl_mem *mem_objects;
+    ScratchReset(L);
+    mem_objects = checkmemobjectlist(L, 3, &count, &err);
     if(err)
         return luaL_argerror(L, 3, errstring(err));
 #define CLEANUP() do {              \
@@ -880,7 +918,7 @@ static int EnqueueMigrateMemObjects(lua_State *L)
     Free(L, we);            \
 } while(0)
     
-    ge = optboolean(L, 5, 0);
+    ge = optgetevent(L, 5);
     we = checkeventlist(L, 4, &wc, &err);
     if(err < 0)
         { CLEANUP(); return luaL_argerror(L, 4, errstring(err)); }
@@ -890,7 +928,7 @@ static int EnqueueMigrateMemObjects(lua_State *L)
     if(ec)
         { CheckError(L, ec); return 0; }        
     if(event)
-        return newevent(L, ud->context, event);
+        return pushenqueuedevent(L, ud->context, event, ge);
     return 0;
 #undef CLEANUP
     }
@@ -909,6 +947,7 @@ static int EnqueueSVMMigrateMem(lua_State *L)
     cl_svm *svms;
     cl_queue queue = checkqueue(L, 1, &ud);
     cl_mem_migration_flags flags = checkflags(L, 2);
+    ScratchReset(L);
 
     CheckPfn_2_1(L, EnqueueSVMMigrateMem);
 
@@ -939,7 +978,7 @@ static int EnqueueSVMMigrateMem(lua_State *L)
     for(i=0; i<count; i++)
         ptrs[i] = (char*)svms[i]->ptr + offsets[i];
     
-    ge = optboolean(L, 7, 0);
+    ge = optgetevent(L, 7);
     we = checkeventlist(L, 6, &wc, &err);
     if(err < 0)
         { CLEANUP(); return luaL_argerror(L, 6, errstring(err)); }
@@ -950,7 +989,7 @@ static int EnqueueSVMMigrateMem(lua_State *L)
     if(ec)
         { CheckError(L, ec); return 0; }        
     if(event)
-        return newevent(L, ud->context, event);
+        return pushenqueuedevent(L, ud->context, event, ge);
     return 0;
 #undef CLEANUP
     }
@@ -974,6 +1013,7 @@ static int EnqueueNDRangeKernel(lua_State *L)
     cl_queue queue = checkqueue(L, 1, &ud);
     cl_kernel kernel = checkkernel(L, 2, NULL);
     cl_uint work_dim = luaL_checkinteger(L, 3);
+    ScratchReset(L);
     if(work_dim == 0)
         return luaL_argerror(L, 3, "work_dim must be positive");
 #define CLEANUP() do {              \
@@ -1001,7 +1041,7 @@ static int EnqueueNDRangeKernel(lua_State *L)
     if(count > 0 && count != work_dim)
         { CLEANUP(); return luaL_argerror(L, 6, "table length must be work_dim"); }
 
-    ge = optboolean(L, 8, 0);
+    ge = optgetevent(L, 8);
     we = checkeventlist(L, 7, &wc, &err);
     if(err < 0)
         { CLEANUP(); return luaL_argerror(L, 7, errstring(err)); }
@@ -1009,11 +1049,10 @@ static int EnqueueNDRangeKernel(lua_State *L)
     ec = cl.EnqueueNDRangeKernel(queue, kernel, work_dim, 
             global_work_offset, global_work_size, local_work_size, wc, we, ge ? &event : NULL);
     CLEANUP();
-    Free(L, we);
     if(ec)
         { CheckError(L, ec); return 0; }        
     if(event)
-        return newevent(L, ud->context, event);
+        return pushenqueuedevent(L, ud->context, event, ge);
     return 0;
 #undef CLEANUP
     }
@@ -1032,8 +1071,9 @@ static int EnqueueTask(lua_State *L)
 
     cl_queue queue = checkqueue(L, 1, &ud);
     cl_kernel kernel = checkkernel(L, 2, NULL);
+    ScratchReset(L);
     
-    ge = optboolean(L, 4, 0);
+    ge = optgetevent(L, 4);
     we = checkeventlist(L, 3, &wc, &err);
     if(err < 0)
         { return luaL_argerror(L, 3, errstring(err)); }
@@ -1044,11 +1084,108 @@ static int EnqueueTask(lua_State *L)
     if(ec)
         { CheckError(L, ec); return 0; }        
     if(event)
-        return newevent(L, ud->context, event);
+        return pushenqueuedevent(L, ud->context, event, ge);
+    return 0;
+    }
+
+
+
+static int SetKernelArgs(lua_State *L, int arg, cl_kernel kernel)
+/* Sets the kernel args from the list at arg, whose elements are either objects or
+ * tables containing the set_kernel_arg() parameters following the arg index.
+ * Returns 0 on success, otherwise leaves an error message on the stack and returns -1.
+ */
+    {
+    int err, faulty_arg, base, j, n;
+    cl_uint i, count;
+    cl_int ec;
+    kernelarg_t ka;
+
+    count = lua_rawlen(L, arg);
+    for(i = 0; i < count; i++)
+        {
+        base = lua_gettop(L) + 1;
+        lua_rawgeti(L, arg, i+1);
+        if(lua_isnil(L, -1)) /* leave unchanged */
+            { lua_pop(L, 1); continue; }
+        if(lua_type(L, -1) == LUA_TTABLE)
+            {
+            n = lua_rawlen(L, base);
+            if(n < 2) n = 2; /* {nil, data} */
+            luaL_checkstack(L, n, "too many elements, cannot grow Lua stack");
+            for(j = 1; j <= n; j++)
+                lua_rawgeti(L, base, j);
+            lua_remove(L, base);
+            }
+        err = testkernelarg(L, base, &ka, &faulty_arg);
+        if(err)
+            {
+            lua_pushfstring(L, "arg %d: %s", i, errstring(err));
+            return -1;
+            }
+        ec = cl.SetKernelArg(kernel, i, ka.size, kernelargvalue(&ka));
+        if(ka.allocated) Free(L, (void*)ka.value);
+        lua_settop(L, base - 1);
+        if(ec)
+            {
+            pusherrcode(L, ec);
+            lua_pushfstring(L, "arg %d: %s", i, lua_tostring(L, -1));
+            return -1;
+            }
+        }
     return 0;
     }
 
+static int Launch(lua_State *L)
+    {
+    int err, ge;
+    ud_t *ud;
+    cl_int ec;
+    cl_event event = 0;
+    cl_uint wc, work_dim, count;
+    size_t *global_work_size = NULL;
+    size_t *local_work_size = NULL;
+    cl_event *we = NULL;
+    cl_queue queue = checkqueue(L, 1, &ud);
+    cl_kernel kernel = checkkernel(L, 2, NULL);
+#define CLEANUP() do {              \
+    Free(L, global_work_size);      \
+    Free(L, local_work_size);       \
+    Free(L, we);                    \
+} while(0)
+
+    ScratchReset(L);
+    if(!lua_isnoneornil(L, 5))
+        luaL_checktype(L, 5, LUA_TTABLE);
+
+    global_work_size = checksizelist(L, 3, &work_dim, &err);
+    if(err)
+        { CLEANUP(); return luaL_argerror(L, 3, errstring(err)); }
+
+    local_work_size = checksizelist(L, 4, &count, &err);
+    if(err < 0)
+        { CLEANUP(); return luaL_argerror(L, 4, errstring(err)); }
+    if(count > 0 && count != work_dim)
+        { CLEANUP(); return luaL_argerror(L, 4, "table length must be work_dim"); }
+
+    ge = optgetevent(L, 7);
+    we = checkeventlist(L, 6, &wc, &err);
+    if(err < 0)
+        { CLEANUP(); return luaL_argerror(L, 6, errstring(err)); }
+
+    if(!lua_isnoneornil(L, 5) && SetKernelArgs(L, 5, kernel) != 0)
+        { CLEANUP(); return lua_error(L); }
 
+    ec = cl.EnqueueNDRangeKernel(queue, kernel, work_dim, 
+            NULL, global_work_size, local_work_size, wc, we, ge ? &event : NULL);
+    CLEANUP();
+    if(ec)
+        { CheckError(L, ec); return 0; }        
+    if(event)
+        return pushenqueuedevent(L, ud->context, event, ge);
+    return 0;
+#undef CLEANUP
+    }
 
 
 #if 0
@@ -1096,8 +1233,9 @@ static int EnqueueMarkerWithWaitList(lua_State *L)
     cl_uint wc;
     cl_event *we;
     cl_queue queue = checkqueue(L, 1, &ud);
+    ScratchReset(L);
     
-    ge = optboolean(L, 3, 0);
+    ge = optgetevent(L, 3);
     we = checkeventlist(L, 2, &wc, &err);
     if(err < 0)
         return luaL_argerror(L, 2, errstring(err));
@@ -1107,7 +1245,7 @@ static int EnqueueMarkerWithWaitList(lua_State *L)
     if(ec)
         { CheckError(L, ec); return 0; }        
     if(event)
-        return newevent(L, ud->context, event);
+        return pushenqueuedevent(L, ud->context, event, ge);
     return 0;
     }
 
@@ -1121,8 +1259,9 @@ static int EnqueueBarrierWithWaitList(lua_State *L)
     cl_uint wc;
     cl_event *we;
     cl_queue queue = checkqueue(L, 1, &ud);
+    ScratchReset(L);
     
-    ge = optboolean(L, 3, 0);
+    ge = optgetevent(L, 3);
     we = checkeventlist(L, 2, &wc, &err);
     if(err < 0)
         return luaL_argerror(L, 2, errstring(err));
@@ -1132,7 +1271,7 @@ static int EnqueueBarrierWithWaitList(lua_State *L)
     if(ec)
         { CheckError(L, ec); return 0; }        
     if(event)
-        return newevent(L, ud->context, event);
+        return pushenqueuedevent(L, ud->context, event, ge);
     return 0;
     }
 
@@ -1146,6 +1285,7 @@ static int EnqueueAcquireGLObjects(lua_State *L)
     cl_event *we = NULL;
     const cl_mem *mem_objects;
     cl_queue queue = checkqueue(L, 1, &ud);
+    ScratchReset(L);
 
     CheckExtPfn(L, ud, EnqueueAcquireGLObjects);
     
@@ -1157,7 +1297,7 @@ static int EnqueueAcquireGLObjects(lua_State *L)
     Free(L, we);                    \
 } while(0)
     
-    ge = optboolean(L, 4, 0);
+    ge = optgetevent(L, 4);
     we = checkeventlist(L, 3, &wc, &err);
     if(err < 0)
         { CLEANUP(); return luaL_argerror(L, 3, errstring(err)); }
@@ -1167,7 +1307,7 @@ static int EnqueueAcquireGLObjects(lua_State *L)
     if(ec)
         { CheckError(L, ec); return 0; }        
     if(event)
-        return newevent(L, ud->context, event);
+        return pushenqueuedevent(L, ud->context, event, ge);
     return 0;
 #undef CLEANUP
     }
@@ -1182,6 +1322,7 @@ static int EnqueueReleaseGLObjects(lua_State *L)
     cl_event *we = NULL;
     const cl_mem *mem_objects;
     cl_queue queue = checkqueue(L, 1, &ud);
+    ScratchReset(L);
 
     CheckExtPfn(L, ud, EnqueueReleaseGLObjects);
     
@@ -1193,7 +1334,7 @@ static int EnqueueReleaseGLObjects(lua_State *L)
     Free(L, we);                    \
 } while(0)
     
-    ge = optboolean(L, 4, 0);
+    ge = optgetevent(L, 4);
     we = checkeventlist(L, 3, &wc, &err);
     if(err < 0)
         { CLEANUP(); return luaL_argerror(L, 3, errstring(err)); }
@@ -1203,7 +1344,7 @@ static int EnqueueReleaseGLObjects(lua_State *L)
     if(ec)
         { CheckError(L, ec); return 0; }        
     if(event)
-        return newevent(L, ud->context, event);
+        return pushenqueuedevent(L, ud->context, event, ge);
     return 0;
 #undef CLEANUP
     }
@@ -1234,6 +1375,7 @@ static const struct luaL_Reg Functions[] =
         { "enqueue_migrate_mem_objects", EnqueueMigrateMemObjects },
         { "enqueue_ndrange_kernel", EnqueueNDRangeKernel },
         { "enqueue_task", EnqueueTask },
+        { "launch", Launch },
 //      { "enqueue_native_kernel", EnqueueNativeKernel },
         { "enqueue_marker", EnqueueMarkerWithWaitList },
         { "enqueue_barrier", EnqueueBarrierWithWaitList },
@@ -30,14 +30,259 @@ typedef struct {
     int called_submitted;
     int called_running;
     int called_complete;
+    int notify_submitted; /* also push in the completion queue */
+    int notify_running;
+    int notify_complete;
     cl_int status_submitted;
     cl_int status_running;
     cl_int status_complete;
+    uint32_t ringslot; /* promoted event handles: 1-based slot in the ring, or 0 */
+    uint32_t ringgen;
 } udinfo_t;
 
+/* Event handles ---------------------------------------------------------
+ *
+ * Enqueue functions called with get_event='handle' do not create an event
+ * userdata. The event is instead stored in a slot of a C-side ring, and an
+ * integer handle is returned, that encodes the slot and its generation number.
+ * When the ring wraps around, the oldest event is released and its handle
+ * becomes stale. Event handles can be used in wait lists and with the
+ * get_event_info() and get_event_profiling_info() functions. If needed,
+ * they can be promoted to a full event userdata (which then owns the event).
+ */
+
+typedef struct {
+    cl_event event;
+    cl_context context;
+    uint32_t gen;
+    int promoted; /* the event is owned by a userdata */
+} ringslot_t;
+
+#define RING_DEFAULT_SIZE 1024
+#define RING_MAX_SIZE (1<<24)
+#define HANDLE(slot, gen) ((lua_Integer)(gen) << 24 | (lua_Integer)(slot))
+#define HANDLE_SLOT(h) ((uint32_t)((h) & (RING_MAX_SIZE - 1)))
+#define HANDLE_GEN(h) ((uint32_t)((h) >> 24))
+
+static ringslot_t *Ring = NULL;
+static uint32_t RingSize = 0;
+static uint32_t RingNext = 0;
+/* Generations are global and monotonic (not per slot), so that handles issued
+ * before a resize of the ring never match a slot of the new ring */
+static uint32_t NextGen = 1;
+
+static void RingRelease(lua_State *L)
+/* Releases the events owned by the ring, and the ring itself */
+    {
+    uint32_t i;
+    ud_t *ud;
+    for(i = 0; i < RingSize; i++)
+        {
+        if(!Ring[i].event) continue;
+        if(Ring[i].promoted)
+            { /* detach the userdata from the slot */
+            ud = UD(Ring[i].event);
+            if(ud && ud->info) ((udinfo_t*)ud->info)->ringslot = 0;
+            }
+        else
+            cl.ReleaseEvent(Ring[i].event);
+        }
+    Free(L, Ring);
+    Ring = NULL;
+    RingSize = RingNext = 0;
+    }
+
+static int RingAlloc(lua_State *L, uint32_t size)
+    {
+    ringslot_t *ring = (ringslot_t*)MallocNoErr(L, size * sizeof(ringslot_t));
+    if(!ring) return 0;
+    memset(ring, 0, size * sizeof(ringslot_t));
+    if(Ring) RingRelease(L);
+    Ring = ring;
+    RingSize = size;
+    RingNext = 0;
+    return 1;
+    }
+
+void eventringpurge(cl_context context)
+/* Releases the (non promoted) events of the given context, before it is released */
+    {
+    uint32_t i;
+    for(i = 0; i < RingSize; i++)
+        {
+        if(Ring[i].event && !Ring[i].promoted && Ring[i].context == context)
+            {
+            cl.ReleaseEvent(Ring[i].event);
+            Ring[i].event = NULL;
+            }
+        }
+    }
+
+static ringslot_t *RingResolve(lua_Integer handle)
+/* Returns the slot of a valid handle, or NULL if it is stale or invalid */
+    {
+    ringslot_t *s;
+    uint32_t slot = HANDLE_SLOT(handle);
+    if(handle <= 0 || slot >= RingSize) return NULL;
+    s = &Ring[slot];
+    if(s->gen != HANDLE_GEN(handle) || !s->event) return NULL;
+    return s;
+    }
+
+static int PushHandle(lua_State *L, cl_context context, cl_event event)
+    {
+    ringslot_t *s;
+    if(!Ring && !RingAlloc(L, RING_DEFAULT_SIZE))
+        return newevent(L, context, event); /* fallback */
+    s = &Ring[RingNext];
+    if(s->event && !s->promoted)
+        cl.ReleaseEvent(s->event); /* the oldest handle becomes stale */
+    if(s->promoted)
+        { /* the userdata keeps the event, detach it from the slot */
+        ud_t *ud = UD(s->event);
+        if(ud && ud->info) ((udinfo_t*)ud->info)->ringslot = 0;
+        }
+    s->event = event;
+    s->context = context;
+    s->promoted = 0;
+    s->gen = NextGen;
+    if(++NextGen == (1U << 31)) NextGen = 1; /* keep handles positive and nonzero */
+    lua_pushinteger(L, HANDLE(RingNext, s->gen));
+    RingNext = (RingNext + 1) % RingSize;
+    return 1;
+    }
+
+int optgetevent(lua_State *L, int arg)
+/* Checks the optional get_event argument of enqueue functions:
+ * false (default), true (return an event), or 'handle' (return an event handle).
+ */
+    {
+    const char *s;
+    if(lua_type(L, arg) != LUA_TSTRING)
+        return optboolean(L, arg, 0);
+    s = lua_tostring(L, arg);
+    if(strcmp(s, "handle") == 0)
+        return GET_EVENT_HANDLE;
+    return luaL_argerror(L, arg, errstring(ERR_VALUE));
+    }
+
+int pushenqueuedevent(lua_State *L, cl_context context, cl_event event, int ge)
+/* Pushes the event generated by an enqueue function, as requested by ge */
+    {
+    if(ge == GET_EVENT_HANDLE)
+        return PushHandle(L, context, event);
+    return newevent(L, context, event);
+    }
+
+static cl_event TestEventOrHandle(lua_State *L, int arg, int *err)
+    {
+    ringslot_t *s;
+    cl_event event;
+    *err = 0;
+    if(lua_type(L, arg) == LUA_TNUMBER && lua_isinteger(L, arg))
+        {
+        s = RingResolve(lua_tointeger(L, arg));
+        if(!s) { *err = ERR_VALUE; return NULL; }
+        return s->event;
+        }
+    event = testevent(L, arg, NULL);
+    if(!event) *err = ERR_TYPE;
+    return event;
+    }
+
+static cl_event CheckEventOrHandle(lua_State *L, int arg)
+    {
+    int err;
+    cl_event event = TestEventOrHandle(L, arg, &err);
+    if(err == ERR_VALUE)
+        luaL_argerror(L, arg, "stale event handle");
+    else if(err)
+        luaL_argerror(L, arg, errstring(err));
+    return event;
+    }
+
+cl_event* checkeventlist(lua_State *L, int arg, cl_uint *count, int *err)
+/* Same as checkxxxlist(), but also accepts event handles */
+    {
+    cl_event* list;
+    cl_uint i;
+
+    *count = 0;
+    *err = 0;
+    if(lua_isnoneornil(L, arg))
+        { *err = ERR_NOTPRESENT; return NULL; }
+    if(lua_type(L, arg) != LUA_TTABLE)
+        { *err = ERR_TABLE; return NULL; }
+    *count = luaL_len(L, arg);
+    if(*count == 0)
+        { *err = ERR_EMPTY; return NULL; }
+    list = (cl_event*)ScratchAlloc(L, sizeof(cl_event) * (*count));
+
+    if(!list)
+        { *count = 0; *err = ERR_MEMORY; return NULL; }
+
+    for(i=0; i<*count; i++)
+        {
+        lua_rawgeti(L, arg, i+1);
+        list[i] = TestEventOrHandle(L, -1, err);
+        lua_pop(L, 1);
+        if(!list[i])
+            { Free(L, list); *count = 0; return NULL; }
+        }
+    return list;
+    }
+
+static int Promote(lua_State *L)
+/* event = event(handle) */
+    {
+    ud_t *ud;
+    udinfo_t *udinfo;
+    lua_Integer handle = luaL_checkinteger(L, 1);
+    ringslot_t *s = RingResolve(handle);
+    if(!s)
+        return luaL_argerror(L, 1, "stale event handle");
+    if(s->promoted)
+        return pushevent(L, s->event);
+    udinfo = (udinfo_t*)Malloc(L, sizeof(udinfo_t));
+    memset(udinfo, 0, sizeof(udinfo_t));
+    udinfo->ringslot = HANDLE_SLOT(handle) + 1;
+    udinfo->ringgen = s->gen;
+    newevent(L, s->context, s->event);
+    ud = UD(s->event);
+    ud->info = udinfo;
+    s->promoted = 1;
+    return 1;
+    }
+
+static int EventRing(lua_State *L)
+/* size = event_ring([size]) */
+    {
+    lua_Integer size;
+    if(!lua_isnoneornil(L, 1))
+        {
+        size = luaL_checkinteger(L, 1);
+        if(size < 1 || size > RING_MAX_SIZE)
+            return luaL_argerror(L, 1, errstring(ERR_VALUE));
+        if(!RingAlloc(L, (uint32_t)size))
+            return luaL_error(L, errstring(ERR_MEMORY));
+        }
+    lua_pushinteger(L, RingSize > 0 ? RingSize : RING_DEFAULT_SIZE);
+    return 1;
+    }
+
+/* ----------------------------------------------------------------------- */
+
 static int freeevent(lua_State *L, ud_t *ud)
     {
     cl_event event = (cl_event)ud->handle;
+    udinfo_t *udinfo = (udinfo_t*)ud->info;
+    ringslot_t *s;
+    if(udinfo && udinfo->ringslot > 0 && udinfo->ringslot <= RingSize)
+        {
+        s = &Ring[udinfo->ringslot - 1];
+        if(s->promoted && s->gen == udinfo->ringgen)
+            { s->event = NULL; s->promoted = 0; } /* the handle becomes stale */
+        }
     if(!freeuserdata(L, ud, "event")) return 0;
     ReleaseAll(Event, EVENT, event);
     return 0;
@@ -46,9 +291,8 @@ static int freeevent(lua_State *L, ud_t *ud)
 int newevent(lua_State *L, cl_context context, cl_event event)
     {
     ud_t *ud;
-    ud = newuserdata(L, event, EVENT_MT, "event");
+    ud = newuserdata(L, event, UD(context), EVENT_MT, "event");
     ud->context = context;
-    ud->parent_ud = UD(context);
     ud->clext = ud->parent_ud->clext;
     ud->destructor = freeevent;
     return 1;
@@ -69,7 +313,9 @@ static int WaitForEvents(lua_State *L)
     cl_int ec;
     int err;
     cl_uint count;
-    cl_event *event_list = checkeventlist(L, 1, &count, &err);
+    cl_event *event_list;
+    ScratchReset(L);
+    event_list = checkeventlist(L, 1, &count, &err);
     if(err)
         return luaL_argerror(L, 1, errstring(err));
     ec = cl.WaitForEvents(count, event_list);
@@ -100,7 +346,7 @@ static int GetExecutionStatus(lua_State *L, cl_event obj)
 
 static int GetEventInfo(lua_State *L)
     {
-    cl_event event = checkevent(L, 1, NULL);
+    cl_event event = CheckEventOrHandle(L, 1);
     cl_event_info name = checkeventinfo(L, 2);
     switch(name)
         {
@@ -147,23 +393,56 @@ static void Callback_##what(cl_event event, cl_int status, void *user_data)
     if((event != (cl_event)ud->handle) || (udinfo == NULL)) return;             \
     udinfo->status_##what = status;                                             \
     udinfo->called_##what = 1;                                                  \
+    if(udinfo->notify_##what) completionpush(event, status, 0);                 \
     }
 CALLBACK_FUNC(submitted)
 CALLBACK_FUNC(running)
 CALLBACK_FUNC(complete)
 #undef CALLBACK_FUNC
 
+static void Callback_handle(cl_event event, cl_int status, void *user_data)
+/* Completion callback for event handles (user_data is the handle) */
+    {
+    completionpush(event, status, (lua_Integer)(intptr_t)user_data);
+    }
+
+static int SetHandleCallback(lua_State *L)
+/* set_event_callback(handle, 'complete') */
+    {
+    cl_int ec;
+    int err;
+    lua_Integer handle = lua_tointeger(L, 1);
+    cl_event event = CheckEventOrHandle(L, 1);
+    if(checkexecutionstatus(L, 2) != CL_COMPLETE)
+        return luaL_argerror(L, 2, "event handles support only the 'complete' type");
+    if((err = completioninit(L)) != 0)
+        return luaL_error(L, errstring(err));
+    ec = cl.SetEventCallback(event, CL_COMPLETE, Callback_handle, (void*)(intptr_t)handle);
+    CheckError(L, ec);
+    return 0;
+    }
+
 static int SetEventCallback(lua_State *L)
     {
     cl_int ec;
     ud_t *ud;
-    cl_event event = checkevent(L, 1, &ud);
-    cl_int type = checkexecutionstatus(L, 2);
-    udinfo_t *udinfo = (udinfo_t*)ud->info;
+    cl_event event;
+    cl_int type;
+    udinfo_t *udinfo;
+    int err, notify;
+    if(lua_type(L, 1) == LUA_TNUMBER)
+        return SetHandleCallback(L);
+    event = checkevent(L, 1, &ud);
+    type = checkexecutionstatus(L, 2);
+    notify = optboolean(L, 3, 0);
+    udinfo = (udinfo_t*)ud->info;
+    if(notify && (err = completioninit(L)) != 0)
+        return luaL_error(L, errstring(err));
     
     if(!udinfo)
         {
         udinfo = (udinfo_t*)Malloc(L, sizeof(udinfo_t));
+        memset(udinfo, 0, sizeof(udinfo_t));
         ud->info = udinfo;
         }
     
@@ -171,6 +450,7 @@ static int SetEventCallback(lua_State *L)
         {
 #define SET(what) do {                                              \
     udinfo->called_##what = 0;                                      \
+    udinfo->notify_##what = notify;                                 \
     ec = cl.SetEventCallback(event, type, Callback_##what, ud);     \
 } while(0)
         case CL_SUBMITTED:  SET(submitted); break;
@@ -227,7 +507,7 @@ GET_INFO_ULONG(GetProfiling, EventProfiling, event, profiling)
 
 static int GetEventProfilingInfo(lua_State *L)
     {
-    cl_event event = checkevent(L, 1, NULL);
+    cl_event event = CheckEventOrHandle(L, 1);
     cl_profiling_info name = checkprofilinginfo(L, 2);
     switch(name)
         {
@@ -280,6 +560,8 @@ static const struct luaL_Reg Functions[] =
         { "set_event_callback", SetEventCallback },
         { "check_event_callback", CheckEventCallback },
         { "get_event_profiling_info", GetEventProfilingInfo },
+        { "event", Promote },
+        { "event_ring", EventRing },
         { NULL, NULL } /* sentinel */
     };
 
@@ -0,0 +1,327 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Stefano Trettel
+ *
+ * Software repository: MoonCL, https://github.com/stetre/mooncl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "internal.h"
+
+/* Command graphs.
+ * A graph records a sequence of commands (see batch.c), pre-resolving their 
+ * arguments, and replays them on a queue without re-marshalling them.
+ * The Lua values referenced by the recorded commands (tables, objects, strings)
+ * are anchored to a table referenced in the registry, so that they are not 
+ * collected while the graph is alive.
+ */
+
+struct mooncl_graph_s {
+    command_t *cmds;    /* recorded commands */
+    cl_uint count;      /* number of recorded commands */
+    cl_uint size;       /* allocated room in cmds and events */
+    cl_event *events;   /* events generated during replay */
+    cl_event *wl;       /* wait list buffer */
+    cl_uint maxwc;      /* room in wl */
+    cl_uint nge;        /* number of commands with ge=true */
+    int anchor;         /* reference to the anchor table */
+};
+
+static int freegraph(lua_State *L, ud_t *ud)
+    {
+    cl_graph graph = (cl_graph)ud->handle;
+    if(!freeuserdata(L, ud, "graph")) return 0;
+    luaL_unref(L, LUA_REGISTRYINDEX, graph->anchor);
+    Free(L, graph->cmds);
+    Free(L, graph->events);
+    Free(L, graph->wl);
+    Free(L, graph);
+    return 0;
+    }
+
+static int CreateCommandGraph(lua_State *L)
+    {
+    ud_t *ud;
+    cl_graph graph = (cl_graph)Malloc(L, sizeof(graph_t));
+    lua_newtable(L);
+    graph->anchor = luaL_ref(L, LUA_REGISTRYINDEX);
+    ud = newuserdata(L, graph, NULL, GRAPH_MT, "graph");
+    ud->destructor = freegraph;
+    return 1;
+    }
+
+static void Grow(lua_State *L, cl_graph graph)
+    {
+    cl_uint size = graph->size == 0 ? 16 : graph->size * 2;
+    command_t *cmds = (command_t*)Malloc(L, size * sizeof(command_t));
+    cl_event *events = (cl_event*)MallocNoErr(L, size * sizeof(cl_event));
+    if(!events)
+        {
+        Free(L, cmds);
+        luaL_error(L, errstring(ERR_MEMORY));
+        return;
+        }
+    if(graph->count > 0)
+        memcpy(cmds, graph->cmds, graph->count * sizeof(command_t));
+    Free(L, graph->cmds);
+    Free(L, graph->events);
+    graph->cmds = cmds;
+    graph->events = events;
+    graph->size = size;
+    }
+
+static int Record(lua_State *L, const char *name)
+/* Records the command with the given name and the args at 2, 3, ..., top, 
+ * and returns its position in the graph.
+ */
+    {
+    int i, anchor, top;
+    cl_uint index;
+    command_t *cmd;
+    cl_event *wl;
+    cl_graph graph = checkgraph(L, 1, NULL);
+
+    top = lua_gettop(L);
+    if(graph->count == graph->size)
+        Grow(L, graph);
+    index = graph->count + 1;
+    cmd = &graph->cmds[index-1];
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, graph->anchor);
+    anchor = lua_gettop(L);
+    lua_createtable(L, top, 0);
+    lua_pushstring(L, name);
+    lua_rawseti(L, -2, 1);
+    for(i = 2; i <= top; i++)
+        {
+        lua_pushvalue(L, i);
+        lua_rawseti(L, -2, i);
+        }
+    checkcommand(L, -1, anchor, graph->cmds, index);
+    if(cmd->wc > graph->maxwc)
+        {
+        wl = (cl_event*)Malloc(L, cmd->wc * sizeof(cl_event));
+        Free(L, graph->wl);
+        graph->wl = wl;
+        graph->maxwc = cmd->wc;
+        }
+    lua_rawseti(L, anchor, lua_rawlen(L, anchor) + 1);
+    graph->count = index;
+    if(cmd->ge) graph->nge++;
+    lua_pushinteger(L, index);
+    return 1;
+    }
+
+#define RECORD_FUNC(name)                   \
+static int Record_##name(lua_State *L)      \
+    { return Record(L, ""#name); }
+
+RECORD_FUNC(read_buffer)
+RECORD_FUNC(write_buffer)
+RECORD_FUNC(copy_buffer)
+RECORD_FUNC(fill_buffer)
+RECORD_FUNC(ndrange_kernel)
+RECORD_FUNC(task)
+RECORD_FUNC(marker)
+RECORD_FUNC(barrier)
+RECORD_FUNC(set_kernel_arg)
+
+static int Count(lua_State *L)
+    {
+    cl_graph graph = checkgraph(L, 1, NULL);
+    lua_pushinteger(L, graph->count);
+    return 1;
+    }
+
+static command_t *CheckCommandIndex(lua_State *L, int arg, cl_graph graph)
+    {
+    lua_Integer index = luaL_checkinteger(L, arg);
+    if(index < 1 || (cl_uint)index > graph->count)
+        { luaL_argerror(L, arg, "invalid command index"); return NULL; }
+    return &graph->cmds[index-1];
+    }
+
+static int PatchOffset(lua_State *L)
+    {
+    cl_graph graph = checkgraph(L, 1, NULL);
+    command_t *cmd = CheckCommandIndex(L, 2, graph);
+    size_t offset = luaL_checkinteger(L, 3);
+    size_t offset2 = luaL_optinteger(L, 4, cmd->offset2);
+    switch(cmd->code)
+        {
+        case CMD_READ_BUFFER:
+        case CMD_WRITE_BUFFER:
+            /* the host side (ptr, size) is unchanged, and was checked at record time */
+            if(!testbufferboundaries(L, cmd->mem, offset, cmd->size))
+                return luaL_error(L, errstring(ERR_BOUNDARIES));
+            break;
+        case CMD_COPY_BUFFER:
+            if(!testbufferboundaries(L, cmd->mem, offset, cmd->size) ||
+               !testbufferboundaries(L, cmd->mem2, offset2, cmd->size))
+                return luaL_error(L, errstring(ERR_BOUNDARIES));
+            cmd->offset2 = offset2;
+            break;
+        case CMD_FILL_BUFFER:
+            if(!testbufferboundaries(L, cmd->mem, offset, cmd->size))
+                return luaL_error(L, errstring(ERR_BOUNDARIES));
+            break;
+        default:
+            return luaL_argerror(L, 2, "command has no buffer offset");
+        }
+    cmd->offset = offset;
+    return 0;
+    }
+
+static int PatchArg(lua_State *L)
+    {
+    int err, faulty_arg, i, top, anchor;
+    kernelarg_t ka;
+    ud_t *ud = NULL;
+    void *data;
+    cl_graph graph = checkgraph(L, 1, NULL);
+    command_t *cmd = CheckCommandIndex(L, 2, graph);
+    cl_uint index = luaL_checkinteger(L, 2);
+
+    if(cmd->code != CMD_SET_KERNEL_ARG)
+        return luaL_argerror(L, 2, "not a set_kernel_arg command");
+    if(cmd->arg_type != 0)
+        { /* the new value has the same type as the recorded one */
+        pushprimtype(L, cmd->arg_type);
+        lua_insert(L, 3);
+        }
+    err = testkernelarg(L, 3, &ka, &faulty_arg);
+    if(err)
+        return luaL_argerror(L, cmd->arg_type ? faulty_arg - 1 : faulty_arg, errstring(err));
+    if(lua_type(L, 3) == LUA_TUSERDATA)
+        {
+        if(!testmemobject(L, 3, &ud) && !testsampler(L, 3, &ud))
+            testqueue(L, 3, &ud);
+        }
+    /* Anchor the value (including any object it references), replacing the value
+     * anchored by a previous patch */
+    top = lua_gettop(L);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, graph->anchor);
+    anchor = lua_gettop(L);
+    lua_newtable(L);
+    for(i = 3; i <= top; i++)
+        {
+        lua_pushvalue(L, i);
+        lua_rawseti(L, -2, i - 2);
+        }
+    if(ka.allocated)
+        {
+        data = anchoredalloc(L, anchor + 1, ka.size);
+        memcpy(data, ka.value, ka.size);
+        Free(L, (void*)ka.value);
+        ka.value = data;
+        ka.allocated = 0;
+        }
+    lua_rawseti(L, anchor, -(lua_Integer)index);
+    cmd->arg = ka;
+    cmd->objects[2] = ud;
+    return 0;
+    }
+
+static int Replay(lua_State *L)
+    {
+    ud_t *qud;
+    cl_int ec;
+    cl_uint i, failed;
+    cl_graph graph = checkgraph(L, 1, NULL);
+    cl_queue queue = checkqueue(L, 2, &qud);
+
+    if(graph->count == 0) return 0;
+    failed = checkcommandobjects(graph->cmds, graph->count);
+    if(failed)
+        return luaL_error(L, "command %d: %s", failed, "referenced object was deleted");
+
+    ec = execcommands(queue, graph->cmds, graph->count, graph->events, graph->wl, &failed);
+    if(ec)
+        {
+        releasecommandevents(graph->events, graph->count);
+        pusherrcode(L, ec);
+        return luaL_error(L, "command %d: %s", failed, lua_tostring(L, -1));
+        }
+
+    if(graph->nge == 0)
+        {
+        releasecommandevents(graph->events, graph->count);
+        return 0;
+        }
+
+    lua_newtable(L);
+    for(i = 0; i < graph->count; i++)
+        {
+        if(!graph->events[i]) continue;
+        if(graph->cmds[i].ge)
+            {
+            newevent(L, qud->context, graph->events[i]);
+            lua_rawseti(L, -2, i+1);
+            }
+        else
+            cl.ReleaseEvent(graph->events[i]);
+        graph->events[i] = NULL;
+        }
+    return 1;
+    }
+
+RAW_FUNC(graph)
+TYPE_FUNC(graph)
+DELETE_FUNC(graph)
+
+static const struct luaL_Reg Methods[] = 
+    {
+        { "raw", Raw },
+        { "type", Type },
+        { "free", Delete },
+        { "read_buffer", Record_read_buffer },
+        { "write_buffer", Record_write_buffer },
+        { "copy_buffer", Record_copy_buffer },
+        { "fill_buffer", Record_fill_buffer },
+        { "ndrange_kernel", Record_ndrange_kernel },
+        { "task", Record_task },
+        { "marker", Record_marker },
+        { "barrier", Record_barrier },
+        { "set_kernel_arg", Record_set_kernel_arg },
+        { "count", Count },
+        { "patch_offset", PatchOffset },
+        { "patch_arg", PatchArg },
+        { "replay", Replay },
+        { NULL, NULL } /* sentinel */
+    };
+
+static const struct luaL_Reg MetaMethods[] = 
+    {
+        { "__gc",  Delete },
+        { NULL, NULL } /* sentinel */
+    };
+
+static const struct luaL_Reg Functions[] = 
+    {
+        { "create_command_graph", CreateCommandGraph },
+        { NULL, NULL } /* sentinel */
+    };
+
+void mooncl_open_graph(lua_State *L)
+    {
+    udata_define(L, GRAPH_MT, Methods, MetaMethods);
+    luaL_setfuncs(L, Functions, 0);
+    }
+
@@ -0,0 +1,179 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Stefano Trettel
+ *
+ * Software repository: MoonCL, https://github.com/stetre/mooncl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "internal.h"
+
+/* IEEE 754 binary16 ('half') conversions.
+ *
+ * The scalar conversions are exact bit manipulations with round-to-nearest-even,
+ * and handle subnormals, infinities and NaNs. The bulk conversions use the F16C
+ * instructions on x86 (if supported by the CPU at runtime) or NEON on aarch64,
+ * and fall back to the scalar ones otherwise.
+ */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_F16C_PATH
+#elif defined(__GNUC__) && defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON_PATH
+#endif
+
+static cl_half Round(uint64_t m, int shift)
+/* Returns m >> shift rounded to nearest, ties to even */
+    {
+    uint64_t q = m >> shift;
+    uint64_t rem = m & ((((uint64_t)1) << shift) - 1);
+    uint64_t halfway = ((uint64_t)1) << (shift - 1);
+    if(rem > halfway || (rem == halfway && (q & 1)))
+        q++;
+    return (cl_half)q;
+    }
+
+cl_half tohalf(double val)
+    {
+    uint64_t bits, mant;
+    int exp;
+    cl_half sign;
+    memcpy(&bits, &val, sizeof(bits));
+    sign = (cl_half)((bits >> 48) & 0x8000);
+    exp = (int)((bits >> 52) & 0x7ff);
+    mant = bits & ((((uint64_t)1) << 52) - 1);
+    if(exp == 0x7ff) /* inf or nan (keep the nan quiet and non-zero) */
+        return sign | 0x7c00 | (mant ? (0x200 | (cl_half)(mant >> 42)) : 0);
+    exp = exp - 1023 + 15; /* rebias */
+    if(exp >= 31) /* overflow */
+        return sign | 0x7c00;
+    if(exp <= 0) /* subnormal or zero */
+        {
+        if(exp < -10) /* less than half the smallest subnormal */
+            return sign;
+        return sign | Round(mant | (((uint64_t)1) << 52), 43 - exp);
+        }
+    /* normal: a carry out of the mantissa correctly bumps the exponent (up to inf) */
+    return sign + ((cl_half)exp << 10) + Round(mant, 42);
+    }
+
+float fromhalf(cl_half h)
+    {
+    uint32_t bits;
+    float val;
+    uint32_t sign = ((uint32_t)(h & 0x8000)) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    if(exp == 0)
+        {
+        val = (float)mant * 5.9604644775390625e-8f; /* 2^-24, exact */
+        return sign ? -val : val;
+        }
+    if(exp == 31)
+        bits = sign | 0x7f800000 | (mant << 13);
+    else
+        bits = sign | ((exp + 112) << 23) | (mant << 13);
+    memcpy(&val, &bits, sizeof(val));
+    return val;
+    }
+
+#if defined(HAVE_F16C_PATH)
+
+__attribute__((target("avx,f16c")))
+static size_t ToHalfF16C(const float *src, cl_half *dst, size_t n)
+    {
+    size_t i;
+    for(i = 0; i + 8 <= n; i += 8)
+        {
+        __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128((__m128i*)(dst + i), h);
+        }
+    return i;
+    }
+
+__attribute__((target("avx,f16c")))
+static size_t FromHalfF16C(const cl_half *src, float *dst, size_t n)
+    {
+    size_t i;
+    for(i = 0; i + 8 <= n; i += 8)
+        {
+        __m256 f = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(src + i)));
+        _mm256_storeu_ps(dst + i, f);
+        }
+    return i;
+    }
+
+static int HasF16C(void)
+    {
+    static int has = -1;
+    if(has < 0)
+        {
+        __builtin_cpu_init();
+        has = __builtin_cpu_supports("f16c") && __builtin_cpu_supports("avx");
+        }
+    return has;
+    }
+
+#define ToHalfBulk(src, dst, n) (HasF16C() ? ToHalfF16C((src), (dst), (n)) : 0)
+#define FromHalfBulk(src, dst, n) (HasF16C() ? FromHalfF16C((src), (dst), (n)) : 0)
+
+#elif defined(HAVE_NEON_PATH)
+
+static size_t ToHalfBulk(const float *src, cl_half *dst, size_t n)
+    {
+    size_t i;
+    for(i = 0; i + 4 <= n; i += 4)
+        vst1_u16(dst + i, vreinterpret_u16_f16(vcvt_f16_f32(vld1q_f32(src + i))));
+    return i;
+    }
+
+static size_t FromHalfBulk(const cl_half *src, float *dst, size_t n)
+    {
+    size_t i;
+    for(i = 0; i + 4 <= n; i += 4)
+        vst1q_f32(dst + i, vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(src + i))));
+    return i;
+    }
+
+#else
+
+#define ToHalfBulk(src, dst, n) 0
+#define FromHalfBulk(src, dst, n) 0
+
+#endif
+
+void tohalfv(const float *src, cl_half *dst, size_t n)
+/* Converts n floats to halves */
+    {
+    size_t i = ToHalfBulk(src, dst, n);
+    for(; i < n; i++)
+        dst[i] = tohalf(src[i]);
+    }
+
+void fromhalfv(const cl_half *src, float *dst, size_t n)
+/* Converts n halves to floats */
+    {
+    size_t i = FromHalfBulk(src, dst, n);
+    for(; i < n; i++)
+        dst[i] = fromhalf(src[i]);
+    }
+
@@ -24,9 +24,16 @@
  */
 
 
+#define _DEFAULT_SOURCE /* see man madvise(2) */
 #include "internal.h"
 
 #if defined(LINUX)
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
 #define AlignedAlloc aligned_alloc
 #define AlignedFree  free
 #elif defined(MINGW)
@@ -36,25 +43,63 @@
 #error "Cannot determine platform"
 #endif
 
+typedef struct { /* ud->info of mapped hostmems */
+    void *base;     /* address returned by mmap() */
+    size_t length;  /* length of the mapping */
+} mapinfo_t;
+
 static int freehostmem(lua_State *L, ud_t *ud)
     {
     cl_hostmem hostmem = (cl_hostmem)ud->handle;
     int allocated = IsAllocated(ud);
+    int mapped = IsMapped(ud);
+    cl_hostmempool pool = IsPooled(ud) ? (cl_hostmempool)ud->parent_ud->handle : NULL;
+    mapinfo_t mapinfo;
+    if(mapped)
+        mapinfo = *(mapinfo_t*)ud->info; /* ud->info is released by freeuserdata() */
+    freechildren(L, HOSTMEM_MT, ud); /* views */
+    freechildren(L, ARRAY_MT, ud); /* array slices */
     if(!freeuserdata(L, ud, "hostmem")) return 0;
-    if(allocated)
+    if(pool)
+        hostmempoolrelease(L, pool, hostmem->ptr, hostmem->size);
+    else if(allocated)
         AlignedFree(hostmem->ptr);
+#if defined(LINUX)
+    if(mapped)
+        munmap(mapinfo.base, mapinfo.length);
+#endif
+    luaL_unref(L, LUA_REGISTRYINDEX, hostmem->ref);
     Free(L, hostmem);
     return 0;
     }
 
-static ud_t *newhostmem(lua_State *L, cl_hostmem hostmem) 
+ud_t *newhostmemobject(lua_State *L, cl_hostmem hostmem, ud_t *parent_ud, const char *mt, const char *tracename)
+/* Creates the userdata for an hostmem, or for an object of a type that inherits from it */
     {
     ud_t *ud;
-    ud = newuserdata(L, hostmem, HOSTMEM_MT, "hostmem");
+    ud = newuserdata(L, hostmem, parent_ud, mt, tracename);
     ud->destructor = freehostmem;  
     return ud;
     }
 
+#define newhostmem(L, hostmem, parent_ud) newhostmemobject((L), (hostmem), (parent_ud), HOSTMEM_MT, "hostmem")
+
+void *hostmemalloc(size_t alignment, size_t size)
+/* Allocates memory to be released by the hostmem destructor (see MarkAllocated) */
+    {
+    if(size % alignment) size += alignment - (size % alignment); /* see aligned_alloc(3) */
+    return AlignedAlloc(alignment, size);
+    }
+
+cl_hostmem checkwritablehostmem(lua_State *L, int arg)
+    {
+    ud_t *ud;
+    cl_hostmem hostmem = checkhostmem(L, arg, &ud);
+    if(IsReadOnly(ud))
+        luaL_argerror(L, arg, "read-only hostmem");
+    return hostmem;
+    }
+
 static int CreateAllocated(lua_State *L, char *ptr, size_t size)
     {
     ud_t *ud;
@@ -67,18 +112,37 @@ static int CreateAllocated(lua_State *L, char *ptr, size_t size)
         }
     hostmem->ptr = ptr;
     hostmem->size = size;
-    ud = newhostmem(L, hostmem);
+    hostmem->ref = LUA_NOREF;
+    ud = newhostmem(L, hostmem, NULL);
     MarkAllocated(ud);
     return 1;
     }
 
+void hostmemfree(void *ptr)
+/* Releases memory allocated with hostmemalloc() */
+    {
+    AlignedFree(ptr);
+    }
+
+cl_hostmem newallocatedhostmem(lua_State *L, size_t alignment, size_t size)
+/* Allocates size bytes of uninitialized memory and pushes an hostmem encapsulating it */
+    {
+    char *ptr = (char*)hostmemalloc(alignment, size);
+    if(!ptr)
+        { luaL_error(L, "failed to allocate page aligned memory"); return NULL; }
+    CreateAllocated(L, ptr, size);
+    return (cl_hostmem)testhostmem(L, -1, NULL);
+    }
+
 static int CreatePack(lua_State *L, int arg, size_t alignment)
     {
     int err;
     char *ptr;
+    size_t count;
     int type = checkprimtype(L, arg);
-    size_t n = toflattable(L, arg+1);
-    size_t size = n * sizeofprimtype(type);
+    size_t esize = sizeofprimtype(type);
+    size_t n = countdata(L, arg+1, 0);
+    size_t size = n * esize;
 
     if(size == 0) 
         return luaL_argerror(L, arg+1, errstring(ERR_LENGTH));
@@ -87,14 +151,25 @@ static int CreatePack(lua_State *L, int arg, size_t alignment)
     if(!ptr)
         return luaL_error(L, "failed to allocate page aligned memory");
 
-    err = testdata(L, type, n, ptr, size);
-    if(err)
+    err = packdata(L, arg+1, type, ptr, size, &count);
+    if(err == ERR_LENGTH) /* nested tables: get the exact count and retry */
         {
-        free(ptr);
-        return luaL_argerror(L, arg+1, errstring(err));
+        AlignedFree(ptr);
+        size = countdata(L, arg+1, 1) * esize;
+        if(size == 0) 
+            return luaL_argerror(L, arg+1, errstring(ERR_LENGTH));
+        ptr = (char*)AlignedAlloc(alignment, size);
+        if(!ptr)
+            return luaL_error(L, "failed to allocate page aligned memory");
+        err = packdata(L, arg+1, type, ptr, size, &count);
+        }
+    if(err || count == 0)
+        {
+        AlignedFree(ptr);
+        return luaL_argerror(L, arg+1, errstring(err ? err : ERR_LENGTH));
         }
 
-    CreateAllocated(L, ptr, size);
+    CreateAllocated(L, ptr, count * esize);
     return 1;
     }
 
@@ -126,9 +201,9 @@ static int Create(lua_State *L, int arg, size_t alignment)
         return luaL_error(L, "failed to allocate page aligned memory");
             
     if(data)
-        memcpy(ptr, data, size);
+        parallelmemcpy(ptr, data, size);
     else
-        memset(ptr, 0, size);
+        parallelmemset(ptr, 0, size);
 
     CreateAllocated(L, ptr, size);
     return 1;
@@ -151,6 +226,7 @@ static int CreateHostmem(lua_State *L)
     size_t size;
     const char *ptr;
     cl_hostmem hostmem;
+    ud_t *ud;
 
     if(lua_type(L, 1) == LUA_TSTRING)
         {
@@ -167,22 +243,333 @@ static int CreateHostmem(lua_State *L)
 
     hostmem = (cl_hostmem)MallocNoErr(L, sizeof(hostmem_t));
     if(!hostmem)
+        return luaL_error(L, errstring(ERR_MEMORY));
+
+    hostmem->ptr = (char*)ptr;
+    hostmem->size = size;
+    hostmem->ref = LUA_NOREF;
+    if(lua_type(L, 1) == LUA_TSTRING)
+        { /* anchor the string, so that it is not collected while in use */
+        lua_pushvalue(L, 1);
+        hostmem->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        }
+    ud = newhostmem(L, hostmem, NULL);
+    if(lua_type(L, 1) == LUA_TSTRING)
+        MarkReadOnly(ud); /* Lua strings are immutable (and may be shared) */
+    return 1;
+    }
+
+#if defined(LINUX)
+static int CreateMmap(lua_State *L)
+/* hostmem = hostmem_mmap(path, [mode], [offset], [size], [options]) */
+    {
+    int fd, flags, prot, oflags, err;
+    ud_t *ud;
+    struct stat st;
+    cl_hostmem hostmem;
+    mapinfo_t *mapinfo;
+    void *base;
+    size_t pagesize, delta, length;
+    const char *path = luaL_checkstring(L, 1);
+    const char *mode = luaL_optstring(L, 2, "r");
+    size_t offset = luaL_optinteger(L, 3, 0);
+    size_t size = luaL_optinteger(L, 4, 0);
+    int sequential = 1, willneed = 0, populate = 0, hugepages = 0;
+
+    if(strcmp(mode, "r") == 0)
+        { oflags = O_RDONLY; prot = PROT_READ; flags = MAP_SHARED; }
+    else if(strcmp(mode, "w") == 0)
+        { oflags = O_RDWR; prot = PROT_READ | PROT_WRITE; flags = MAP_SHARED; }
+    else if(strcmp(mode, "c") == 0)
+        { oflags = O_RDONLY; prot = PROT_READ | PROT_WRITE; flags = MAP_PRIVATE; }
+    else
+        return luaL_argerror(L, 2, badvalue(L, mode));
+
+    if(!lua_isnoneornil(L, 5))
+        {
+        luaL_checktype(L, 5, LUA_TTABLE);
+#define OPT(name) do {                                                  \
+        lua_getfield(L, 5, ""#name);                                    \
+        if(!lua_isnil(L, -1)) name = lua_toboolean(L, -1);              \
+        lua_pop(L, 1);                                                  \
+    } while(0)
+        OPT(sequential);
+        OPT(willneed);
+        OPT(populate);
+        OPT(hugepages);
+#undef OPT
+        }
+
+    fd = open(path, oflags);
+    if(fd < 0)
+        return luaL_error(L, "cannot open '%s': %s", path, strerror(errno));
+    if(fstat(fd, &st) != 0)
+        {
+        err = errno;
+        close(fd);
+        return luaL_error(L, "cannot stat '%s': %s", path, strerror(err));
+        }
+    if(offset >= (size_t)st.st_size)
+        { close(fd); return luaL_argerror(L, 3, errstring(ERR_BOUNDARIES)); }
+    if(size == 0)
+        size = st.st_size - offset;
+    else if(size > (size_t)st.st_size - offset)
+        { close(fd); return luaL_argerror(L, 4, errstring(ERR_BOUNDARIES)); }
+
+    /* mmap() requires a page aligned offset */
+    pagesize = sysconf(_SC_PAGESIZE);
+    delta = offset % pagesize;
+    length = size + delta;
+#ifdef MAP_POPULATE
+    if(populate) flags |= MAP_POPULATE;
+#endif
+    base = mmap(NULL, length, prot, flags, fd, offset - delta);
+    err = errno;
+    close(fd); /* the mapping keeps a reference to the file */
+    if(base == MAP_FAILED)
+        return luaL_error(L, "cannot map '%s': %s", path, strerror(err));
+
+    /* advices are just hints, so errors are ignored */
+    if(sequential) (void)madvise(base, length, MADV_SEQUENTIAL);
+    if(willneed) (void)madvise(base, length, MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+    if(hugepages) (void)madvise(base, length, MADV_HUGEPAGE);
+#endif
+
+    hostmem = (cl_hostmem)MallocNoErr(L, sizeof(hostmem_t));
+    mapinfo = (mapinfo_t*)MallocNoErr(L, sizeof(mapinfo_t));
+    if(!hostmem || !mapinfo)
         {
         Free(L, hostmem);
+        Free(L, mapinfo);
+        munmap(base, length);
         return luaL_error(L, errstring(ERR_MEMORY));
         }
+    mapinfo->base = base;
+    mapinfo->length = length;
+    hostmem->ptr = (char*)base + delta;
+    hostmem->size = size;
+    hostmem->ref = LUA_NOREF;
+    ud = newhostmem(L, hostmem, NULL);
+    ud->info = mapinfo;
+    MarkMapped(ud);
+    if(!(prot & PROT_WRITE)) MarkReadOnly(ud);
+    return 1;
+    }
 
-    hostmem->ptr = (char*)ptr;
+/* Page allocation -------------------------------------------------------------*/
+
+#include <sys/syscall.h>
+#define MPOL_BIND_ 2 /* see <numaif.h> (not used, to avoid depending on libnuma) */
+#define HUGEPAGE_SIZE (2*1024*1024)
+
+#ifndef CL_DEVICE_PCI_BUS_INFO_KHR
+#define CL_DEVICE_PCI_BUS_INFO_KHR 0x410F
+#endif
+
+static int DeviceNode(cl_device device)
+/* Returns the NUMA node the device is attached to (from sysfs), or -1 if unknown */
+    {
+    FILE *f;
+    int node = -1;
+    char path[128];
+    cl_uint khr[4]; /* cl_device_pci_bus_info_khr: domain, bus, device, function */
+    union { cl_uint raw[6]; struct { cl_uint type; char unused[17]; cl_char bus, dev, fn; } pcie; } amd;
+    if(cl.GetDeviceInfo(device, CL_DEVICE_PCI_BUS_INFO_KHR, sizeof(khr), khr, NULL) == CL_SUCCESS)
+        snprintf(path, sizeof(path), "/sys/bus/pci/devices/%04x:%02x:%02x.%x/numa_node",
+                khr[0], khr[1], khr[2], khr[3]);
+    else if(cl.GetDeviceInfo(device, CL_DEVICE_TOPOLOGY_AMD, sizeof(amd), &amd, NULL) == CL_SUCCESS
+            && amd.pcie.type == 1 /* CL_DEVICE_TOPOLOGY_TYPE_PCIE_AMD */)
+        snprintf(path, sizeof(path), "/sys/bus/pci/devices/0000:%02x:%02x.%x/numa_node",
+                (cl_uchar)amd.pcie.bus, (cl_uchar)amd.pcie.dev, (cl_uchar)amd.pcie.fn);
+    else
+        return -1;
+    if((f = fopen(path, "r")) == NULL)
+        return -1;
+    if(fscanf(f, "%d", &node) != 1) node = -1;
+    fclose(f);
+    return node;
+    }
+
+static int CreatePageAlloc(lua_State *L)
+/* hostmem = page_alloc(size, [options]) */
+    {
+    int err, node = -1, prefault = 0, flags;
+    const char *hugepages = NULL;
+    ud_t *ud;
+    cl_hostmem hostmem;
+    mapinfo_t *mapinfo;
+    char *base, *ptr, *p;
+    size_t len, maplen, pagesize, head, tail;
+    unsigned long nodemask[16];
+    size_t size = luaL_checkinteger(L, 1);
+    if(size == 0)
+        return luaL_argerror(L, 1, errstring(ERR_VALUE));
+
+    if(!lua_isnoneornil(L, 2))
+        {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        lua_getfield(L, 2, "hugepages");
+        if(lua_type(L, -1) == LUA_TSTRING)
+            {
+            hugepages = lua_tostring(L, -1);
+            if(strcmp(hugepages, "transparent") != 0 && strcmp(hugepages, "explicit") != 0)
+                return luaL_argerror(L, 2, "invalid 'hugepages' field");
+            }
+        else if(lua_toboolean(L, -1))
+            hugepages = "transparent";
+        lua_pop(L, 1);
+        lua_getfield(L, 2, "node");
+        if(!lua_isnil(L, -1))
+            {
+            cl_device device = testdevice(L, -1, NULL);
+            if(device)
+                {
+                if((node = DeviceNode(device)) < 0)
+                    return luaL_argerror(L, 2, "cannot determine the NUMA node of the device");
+                }
+            else
+                {
+                node = luaL_checkinteger(L, -1);
+                if(node < 0 || node >= (int)(sizeof(nodemask)*8))
+                    return luaL_argerror(L, 2, "invalid 'node' field");
+                }
+            }
+        lua_pop(L, 1);
+        lua_getfield(L, 2, "prefault");
+        prefault = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+        }
+
+    pagesize = sysconf(_SC_PAGESIZE);
+    flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    if(hugepages && strcmp(hugepages, "explicit") == 0)
+        {
+#ifdef MAP_HUGETLB
+        len = maplen = (size + HUGEPAGE_SIZE - 1) & ~((size_t)HUGEPAGE_SIZE - 1);
+        base = (char*)mmap(NULL, maplen, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+        if(base == MAP_FAILED)
+            return luaL_error(L, "cannot allocate huge pages: %s", strerror(errno));
+        ptr = base;
+        pagesize = HUGEPAGE_SIZE;
+#else
+        return notavailable(L);
+#endif
+        }
+    else if(hugepages) /* transparent: align to the huge page size, and advise */
+        {
+        len = (size + HUGEPAGE_SIZE - 1) & ~((size_t)HUGEPAGE_SIZE - 1);
+        maplen = len + HUGEPAGE_SIZE;
+        base = (char*)mmap(NULL, maplen, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if(base == MAP_FAILED)
+            return luaL_error(L, "cannot map memory: %s", strerror(errno));
+        ptr = (char*)(((uintptr_t)base + HUGEPAGE_SIZE - 1) & ~((uintptr_t)HUGEPAGE_SIZE - 1));
+        /* release the unaligned head and tail */
+        head = ptr - base;
+        tail = maplen - head - len;
+        if(head > 0) munmap(base, head);
+        if(tail > 0) munmap(ptr + len, tail);
+        base = ptr;
+        maplen = len;
+#ifdef MADV_HUGEPAGE
+        (void)madvise(ptr, len, MADV_HUGEPAGE);
+#endif
+        }
+    else
+        {
+        len = maplen = (size + pagesize - 1) & ~(pagesize - 1);
+        base = ptr = (char*)mmap(NULL, maplen, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if(base == MAP_FAILED)
+            return luaL_error(L, "cannot map memory: %s", strerror(errno));
+        }
+
+    if(node >= 0)
+        {
+        memset(nodemask, 0, sizeof(nodemask));
+        nodemask[node / (8*sizeof(unsigned long))] |= 1UL << (node % (8*sizeof(unsigned long)));
+        if(syscall(SYS_mbind, ptr, len, MPOL_BIND_, nodemask, sizeof(nodemask)*8, 0) != 0)
+            {
+            err = errno;
+            munmap(base, maplen);
+            return luaL_error(L, "cannot bind memory to node %d: %s", node, strerror(err));
+            }
+        }
+
+    if(prefault) /* touch every page, after binding */
+        for(p = ptr; p < ptr + len; p += pagesize) *(volatile char*)p = 0;
+
+    hostmem = (cl_hostmem)MallocNoErr(L, sizeof(hostmem_t));
+    mapinfo = (mapinfo_t*)MallocNoErr(L, sizeof(mapinfo_t));
+    if(!hostmem || !mapinfo)
+        {
+        Free(L, hostmem);
+        Free(L, mapinfo);
+        munmap(base, maplen);
+        return luaL_error(L, errstring(ERR_MEMORY));
+        }
+    mapinfo->base = base;
+    mapinfo->length = maplen;
+    hostmem->ptr = ptr;
     hostmem->size = size;
-    newhostmem(L, hostmem);
+    hostmem->ref = LUA_NOREF;
+    ud = newhostmem(L, hostmem, NULL);
+    ud->info = mapinfo;
+    MarkMapped(ud);
+    return 1;
+    }
+
+#else
+static int CreateMmap(lua_State *L)
+    { return notavailable(L); }
+static int CreatePageAlloc(lua_State *L)
+    { return notavailable(L); }
+#endif
+
+static int View(lua_State *L)
+/* view = hostmem:view(offset, [size]) */
+    {
+    ud_t *ud, *parent_ud;
+    cl_hostmem view;
+    cl_hostmem hostmem = checkhostmem(L, 1, &parent_ud);
+    size_t offset = luaL_checkinteger(L, 2);
+    size_t size = luaL_optinteger(L, 3, offset < hostmem->size ? hostmem->size - offset : 0);
+    if((offset >= hostmem->size) || (size > hostmem->size - offset))
+        return luaL_error(L, errstring(ERR_BOUNDARIES));
+    if(size == 0)
+        return luaL_argerror(L, 3, errstring(ERR_LENGTH));
+
+    view = (cl_hostmem)Malloc(L, sizeof(hostmem_t));
+    view->ptr = hostmem->ptr + offset;
+    view->size = size;
+    /* anchor the parent, so that it is not collected while the view is in use */
+    lua_pushvalue(L, 1);
+    view->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    ud = newhostmem(L, view, parent_ud);
+    if(IsReadOnly(parent_ud)) MarkReadOnly(ud);
     return 1;
     }
 
+void *checkhostptr(lua_State *L, int arg, size_t *size, ud_t **udp)
+/* Checks if the value at arg is a lightuserdata or an hostmem, and returns the pointer.
+ * If it is an hostmem, *size is set to its size (otherwise it is left unchanged).
+ */
+    {
+    cl_hostmem hostmem;
+    if(udp) *udp = NULL;
+    if(lua_type(L, arg) == LUA_TLIGHTUSERDATA)
+        return lua_touserdata(L, arg);
+    hostmem = testhostmem(L, arg, udp);
+    if(!hostmem)
+        { luaL_argerror(L, arg, "expected lightuserdata or hostmem"); return NULL; }
+    *size = hostmem->size;
+    return hostmem->ptr;
+    }
+
 
 static int WriteData(lua_State *L)
     {
     size_t size;
-    cl_hostmem hostmem = checkhostmem(L, 1, NULL);
+    cl_hostmem hostmem = checkwritablehostmem(L, 1);
     size_t offset = luaL_checkinteger(L, 2);
     /* arg 3 should be nil */
     const char *data = luaL_checklstring(L, 4, &size);
@@ -190,13 +577,13 @@ static int WriteData(lua_State *L)
         return 0;
     if((offset >= hostmem->size) || (size > hostmem->size - offset))
         return luaL_error(L, errstring(ERR_BOUNDARIES));
-    memcpy(hostmem->ptr + offset, data, size);
+    parallelmemcpy(hostmem->ptr + offset, data, size);
     return 0;
     }
 
 static int CopyPtr(lua_State *L)
     {
-    cl_hostmem hostmem = checkhostmem(L, 1, NULL);
+    cl_hostmem hostmem = checkwritablehostmem(L, 1);
     size_t offset = luaL_checkinteger(L, 2);
     size_t size = luaL_checkinteger(L, 3);
     void *ptr = checklightuserdata(L, 4);
@@ -204,13 +591,13 @@ static int CopyPtr(lua_State *L)
         return 0;
     if((offset >= hostmem->size) || (size > hostmem->size - offset))
         return luaL_error(L, errstring(ERR_BOUNDARIES));
-    memcpy(hostmem->ptr + offset, ptr, size);
+    parallelmemcpy(hostmem->ptr + offset, ptr, size);
     return 0;
     }
 
 static int CopyHostmem(lua_State *L)
     {
-    cl_hostmem hostmem = checkhostmem(L, 1, NULL);
+    cl_hostmem hostmem = checkwritablehostmem(L, 1);
     size_t offset = luaL_checkinteger(L, 2);
     size_t size = luaL_checkinteger(L, 3);
     cl_hostmem srchostmem = checkhostmem(L, 4, NULL);
@@ -223,14 +610,14 @@ static int CopyHostmem(lua_State *L)
         return luaL_error(L, errstring(ERR_BOUNDARIES));
     if((srcoffset >= srchostmem->size) || (size > srchostmem->size - srcoffset))
         return luaL_error(L, errstring(ERR_BOUNDARIES));
-    memcpy(hostmem->ptr + offset, srchostmem->ptr + srcoffset, size);
+    parallelmemcpy(hostmem->ptr + offset, srchostmem->ptr + srcoffset, size);
     return 0;
     }
 
 
 static int WritePack(lua_State *L) 
     {
-    cl_hostmem hostmem = checkhostmem(L, 1, NULL);
+    cl_hostmem hostmem = checkwritablehostmem(L, 1);
     size_t offset = luaL_checkinteger(L, 2);
     int type = checkprimtype(L, 3);
     size_t size = hostmem->size - offset;
@@ -263,7 +650,7 @@ static int Clear(lua_State *L)
     size_t len;
     const char *s;
     char c;
-    cl_hostmem hostmem = checkhostmem(L, 1, NULL);
+    cl_hostmem hostmem = checkwritablehostmem(L, 1);
     size_t offset = luaL_checkinteger(L, 2);
     size_t size = luaL_checkinteger(L, 3);
 
@@ -281,7 +668,7 @@ static int Clear(lua_State *L)
         return luaL_error(L, errstring(ERR_BOUNDARIES));
     if(size == 0)
         return 0;
-    memset(hostmem->ptr + offset, c, size);
+    parallelmemset(hostmem->ptr + offset, c, size);
     return 0;
     }
 
@@ -363,6 +750,7 @@ static const struct luaL_Reg Methods[] =
         { "read", Read },
         { "ptr", Ptr },
         { "size", Size },
+        { "view", View },
         { NULL, NULL } /* sentinel */
     };
 
@@ -379,6 +767,8 @@ static const struct luaL_Reg Functions[] =
         { "malloc", CreateMalloc },
         { "aligned_alloc", CreateAlignedAlloc },
         { "hostmem", CreateHostmem },
+        { "hostmem_mmap", CreateMmap },
+        { "page_alloc", CreatePageAlloc },
         { "free",  Delete },
         { NULL, NULL } /* sentinel */
     };
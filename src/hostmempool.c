@@ -0,0 +1,285 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Stefano Trettel
+ *
+ * Software repository: MoonCL, https://github.com/stetre/mooncl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "internal.h"
+
+/* Hostmem pools.
+ *
+ * A pool serves hostmem allocations from a set of size classes. When a pooled
+ * hostmem is deleted, its block is kept in the free list of its class, to be
+ * reused by a later allocation of the same class, instead of being released.
+ * Allocations larger than the largest class are not pooled.
+ * Pooled hostmems are children of the pool, and keep it from being collected.
+ */
+
+typedef struct {
+    size_t size;    /* block size */
+    void **blocks;  /* free list (stack) */
+    size_t count;   /* no. of blocks in the free list */
+    size_t cap;     /* capacity of the free list */
+} sizeclass_t;
+
+struct mooncl_hostmempool_s {
+    size_t alignment;
+    cl_uint nclasses;
+    sizeclass_t *classes; /* sorted by increasing size */
+    size_t hits;        /* allocations served from a free list */
+    size_t misses;      /* allocations that needed new memory */
+    size_t retained;    /* bytes in free lists */
+    size_t outstanding; /* no. of pooled hostmems currently allocated */
+};
+
+static sizeclass_t *SizeClass(cl_hostmempool pool, size_t size)
+/* Returns the smallest class that fits size, or NULL */
+    {
+    cl_uint i;
+    for(i = 0; i < pool->nclasses; i++)
+        if(pool->classes[i].size >= size) return &pool->classes[i];
+    return NULL;
+    }
+
+static void Trim(cl_hostmempool pool, size_t keep)
+/* Releases free blocks, larger classes first, until at most keep bytes are retained */
+    {
+    cl_uint i = pool->nclasses;
+    sizeclass_t *sc;
+    while(i-- > 0 && pool->retained > keep)
+        {
+        sc = &pool->classes[i];
+        while(sc->count > 0 && pool->retained > keep)
+            {
+            hostmemfree(sc->blocks[--sc->count]);
+            pool->retained -= sc->size;
+            }
+        }
+    }
+
+void hostmempoolrelease(lua_State *L, cl_hostmempool pool, void *ptr, size_t size)
+/* Called by the hostmem destructor to give back a pooled block */
+    {
+    void **blocks;
+    sizeclass_t *sc = SizeClass(pool, size);
+    pool->outstanding--;
+    if(!sc)
+        { hostmemfree(ptr); return; } /* not pooled */
+    if(sc->count == sc->cap)
+        {
+        blocks = (void**)MallocNoErr(L, 2 * (sc->cap + 4) * sizeof(void*));
+        if(!blocks)
+            { hostmemfree(ptr); return; }
+        if(sc->count > 0)
+            memcpy(blocks, sc->blocks, sc->count * sizeof(void*));
+        Free(L, sc->blocks);
+        sc->blocks = blocks;
+        sc->cap = 2 * (sc->cap + 4);
+        }
+    sc->blocks[sc->count++] = ptr;
+    pool->retained += sc->size;
+    }
+
+static int freehostmempool(lua_State *L, ud_t *ud)
+    {
+    cl_uint i;
+    cl_hostmempool pool = (cl_hostmempool)ud->handle;
+    freechildren(L, HOSTMEM_MT, ud); /* outstanding blocks go back to the free lists */
+    if(!freeuserdata(L, ud, "hostmempool")) return 0;
+    Trim(pool, 0);
+    for(i = 0; i < pool->nclasses; i++)
+        Free(L, pool->classes[i].blocks);
+    Free(L, pool->classes);
+    Free(L, pool);
+    return 0;
+    }
+
+static int CompareSizes(const void *a, const void *b)
+    {
+    size_t x = *(const size_t*)a, y = *(const size_t*)b;
+    return (x > y) - (x < y);
+    }
+
+static int Create(lua_State *L)
+/* pool = hostmem_pool(alignment, {size}) */
+    {
+    int err;
+    ud_t *ud;
+    cl_uint i, count;
+    cl_hostmempool pool;
+    size_t *sizes;
+    size_t alignment = luaL_checkinteger(L, 1);
+    ScratchReset(L);
+    if(alignment == 0 || (alignment & (alignment - 1)) != 0)
+        return luaL_argerror(L, 1, "alignment must be a power of 2");
+    sizes = checksizelist(L, 2, &count, &err);
+    if(err)
+        return luaL_argerror(L, 2, errstring(err));
+    qsort(sizes, count, sizeof(size_t), CompareSizes);
+    if(sizes[0] == 0)
+        { Free(L, sizes); return luaL_argerror(L, 2, errstring(ERR_VALUE)); }
+
+    pool = (cl_hostmempool)MallocNoErr(L, sizeof(hostmempool_t));
+    if(!pool)
+        { Free(L, sizes); return luaL_error(L, errstring(ERR_MEMORY)); }
+    memset(pool, 0, sizeof(hostmempool_t));
+    pool->classes = (sizeclass_t*)MallocNoErr(L, count * sizeof(sizeclass_t));
+    if(!pool->classes)
+        { Free(L, pool); Free(L, sizes); return luaL_error(L, errstring(ERR_MEMORY)); }
+    memset(pool->classes, 0, count * sizeof(sizeclass_t));
+    pool->alignment = alignment;
+    for(i = 0; i < count; i++)
+        {
+        if(i > 0 && sizes[i] == sizes[i-1]) continue; /* duplicate */
+        pool->classes[pool->nclasses++].size = sizes[i];
+        }
+    Free(L, sizes);
+
+    ud = newuserdata(L, pool, NULL, HOSTMEMPOOL_MT, "hostmempool");
+    ud->destructor = freehostmempool;
+    return 1;
+    }
+
+static int Alloc(lua_State *L)
+/* hostmem = pool:alloc(size, [clear=false]) */
+    {
+    ud_t *ud, *pool_ud;
+    char *ptr = NULL;
+    cl_hostmem hostmem;
+    sizeclass_t *sc;
+    cl_hostmempool pool = checkhostmempool(L, 1, &pool_ud);
+    size_t size = luaL_checkinteger(L, 2);
+    int clear = optboolean(L, 3, 0);
+    if(size == 0)
+        return luaL_argerror(L, 2, errstring(ERR_VALUE));
+
+    sc = SizeClass(pool, size);
+    if(sc && sc->count > 0)
+        {
+        ptr = (char*)sc->blocks[--sc->count];
+        pool->retained -= sc->size;
+        pool->hits++;
+        }
+    else
+        {
+        ptr = (char*)hostmemalloc(pool->alignment, sc ? sc->size : size);
+        if(!ptr)
+            return luaL_error(L, errstring(ERR_MEMORY));
+        pool->misses++;
+        }
+    if(clear)
+        parallelmemset(ptr, 0, size);
+
+    hostmem = (cl_hostmem)MallocNoErr(L, sizeof(hostmem_t));
+    if(!hostmem)
+        {
+        hostmemfree(ptr);
+        return luaL_error(L, errstring(ERR_MEMORY));
+        }
+    hostmem->ptr = ptr;
+    hostmem->size = size;
+    /* anchor the pool, so that it is not collected while the block is in use */
+    lua_pushvalue(L, 1);
+    hostmem->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    ud = newhostmemobject(L, hostmem, pool_ud, HOSTMEM_MT, "hostmem");
+    MarkAllocated(ud);
+    MarkPooled(ud);
+    pool->outstanding++;
+    return 1;
+    }
+
+static int Stats(lua_State *L)
+/* {stats} = pool:stats() */
+    {
+    cl_uint i;
+    size_t blocks = 0;
+    cl_hostmempool pool = checkhostmempool(L, 1, NULL);
+    for(i = 0; i < pool->nclasses; i++)
+        blocks += pool->classes[i].count;
+    lua_newtable(L);
+#define F(name, val) do { lua_pushinteger(L, (val)); lua_setfield(L, -2, name); } while(0)
+    F("hits", pool->hits);
+    F("misses", pool->misses);
+    F("retained", pool->retained);
+    F("free_blocks", blocks);
+    F("outstanding", pool->outstanding);
+#undef F
+    return 1;
+    }
+
+static int TrimPool(lua_State *L)
+/* pool:trim([keep=0]) */
+    {
+    cl_hostmempool pool = checkhostmempool(L, 1, NULL);
+    size_t keep = luaL_optinteger(L, 2, 0);
+    Trim(pool, keep);
+    lua_pushinteger(L, pool->retained);
+    return 1;
+    }
+
+static int Sizes(lua_State *L)
+    {
+    cl_uint i;
+    cl_hostmempool pool = checkhostmempool(L, 1, NULL);
+    lua_newtable(L);
+    for(i = 0; i < pool->nclasses; i++)
+        {
+        lua_pushinteger(L, pool->classes[i].size);
+        lua_rawseti(L, -2, i+1);
+        }
+    return 1;
+    }
+
+RAW_FUNC(hostmempool)
+TYPE_FUNC(hostmempool)
+DELETE_FUNC(hostmempool)
+
+static const struct luaL_Reg Methods[] = 
+    {
+        { "raw", Raw },
+        { "type", Type },
+        { "free", Delete },
+        { "alloc", Alloc },
+        { "stats", Stats },
+        { "trim", TrimPool },
+        { "sizes", Sizes },
+        { NULL, NULL } /* sentinel */
+    };
+
+static const struct luaL_Reg MetaMethods[] = 
+    {
+        { "__gc",  Delete },
+        { NULL, NULL } /* sentinel */
+    };
+
+static const struct luaL_Reg Functions[] = 
+    {
+        { "hostmem_pool", Create },
+        { NULL, NULL } /* sentinel */
+    };
+
+void mooncl_open_hostmempool(lua_State *L)
+    {
+    udata_define(L, HOSTMEMPOOL_MT, Methods, MetaMethods);
+    luaL_setfuncs(L, Functions, 0);
+    }
+
@@ -0,0 +1,562 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Stefano Trettel
+ *
+ * Software repository: MoonCL, https://github.com/stetre/mooncl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "internal.h"
+
+/* Host-side operations on hostmem ranges (also available on arrays).
+ *
+ * Ranges are given by a byte offset (which must be a multiple of the element size)
+ * and a number of elements (defaulting to all the elements after the offset).
+ * The inner loops on float and double use GCC vector extensions, with multiple
+ * independent accumulators for reductions.
+ */
+
+#define VLEN 8 /* elements per vector */
+typedef float vfloat_t __attribute__((vector_size(VLEN * sizeof(float))));
+typedef double vdouble_t __attribute__((vector_size(VLEN * sizeof(double))));
+typedef int32_t vmask32_t __attribute__((vector_size(VLEN * sizeof(int32_t))));
+typedef int64_t vmask64_t __attribute__((vector_size(VLEN * sizeof(int64_t))));
+
+#define BLOCK 1024 /* elements per block, for partial sums and staged conversions */
+
+static void *CheckRange(lua_State *L, cl_hostmem hostmem, int type, int arg, size_t *count)
+/* Checks the range given by (offset, count) at arg, arg+1 */
+    {
+    size_t esize = sizeofprimtype(type);
+    size_t offset = luaL_optinteger(L, arg, 0);
+    if(offset > hostmem->size)
+        { luaL_argerror(L, arg, errstring(ERR_BOUNDARIES)); return NULL; }
+    if((offset % esize) != 0)
+        { luaL_argerror(L, arg, "offset must be a multiple of the element size"); return NULL; }
+    *count = luaL_optinteger(L, arg+1, (hostmem->size - offset) / esize);
+    if(*count > (hostmem->size - offset) / esize)
+        { luaL_argerror(L, arg+1, errstring(ERR_BOUNDARIES)); return NULL; }
+    return hostmem->ptr + offset;
+    }
+
+/*------------------------------------------------------------------------------*
+ | Reductions                                                                   |
+ *------------------------------------------------------------------------------*/
+
+#define OP_SUM 0
+#define OP_MIN 1
+#define OP_MAX 2
+static const char *OpNames[] = { "sum", "min", "max", NULL };
+
+static double SumFloat(const float *x, size_t n)
+/* Partial sums of blocks are accumulated in float vectors, and totalled in double */
+    {
+    size_t i, j, m;
+    vfloat_t acc, v;
+    double sum = 0;
+    for(i = 0; i < n; i += m)
+        {
+        m = (n - i) < BLOCK ? (n - i) : BLOCK;
+        memset(&acc, 0, sizeof(acc));
+        for(j = 0; j + VLEN <= m; j += VLEN)
+            {
+            memcpy(&v, x + i + j, sizeof(v));
+            acc += v;
+            }
+        for(; j < m; j++)
+            sum += x[i+j];
+        for(j = 0; j < VLEN; j++)
+            sum += acc[j];
+        }
+    return sum;
+    }
+
+static double SumDouble(const double *x, size_t n)
+    {
+    size_t i, j;
+    vdouble_t acc, v;
+    double sum = 0;
+    memset(&acc, 0, sizeof(acc));
+    for(i = 0; i + VLEN <= n; i += VLEN)
+        {
+        memcpy(&v, x + i, sizeof(v));
+        acc += v;
+        }
+    for(; i < n; i++)
+        sum += x[i];
+    for(j = 0; j < VLEN; j++)
+        sum += acc[j];
+    return sum;
+    }
+
+#define MINMAX_VEC(name, T, VT, VM, cmp)                            \
+static T name(const T *x, size_t n)                                 \
+/* n must be > 0 (nans are ignored, unless all elements are nans) */\
+    {                                                               \
+    size_t i, j;                                                    \
+    VT acc, v;                                                      \
+    VM mask;                                                        \
+    T r = x[0];                                                     \
+    for(i = 0; i < n && r != r; i++) r = x[i]; /* skip leading nans */ \
+    for(j = 0; j < VLEN; j++) acc[j] = r;                           \
+    for(; i + VLEN <= n; i += VLEN)                                 \
+        {                                                           \
+        memcpy(&v, x + i, sizeof(v));                               \
+        mask = (VM)(v cmp acc); /* select v where the comparison holds */ \
+        acc = (VT)(((VM)v & mask) | ((VM)acc & ~mask));             \
+        }                                                           \
+    for(; i < n; i++)                                               \
+        if(x[i] cmp r) r = x[i];                                    \
+    for(j = 0; j < VLEN; j++)                                       \
+        if(acc[j] cmp r) r = acc[j];                                \
+    return r;                                                       \
+    }
+
+MINMAX_VEC(MinFloat, float, vfloat_t, vmask32_t, <)
+MINMAX_VEC(MaxFloat, float, vfloat_t, vmask32_t, >)
+MINMAX_VEC(MinDouble, double, vdouble_t, vmask64_t, <)
+MINMAX_VEC(MaxDouble, double, vdouble_t, vmask64_t, >)
+
+#define REDUCE_INTEGER(T)                                           \
+static lua_Integer Reduce##T(const T *x, size_t n, int op)          \
+    {                                                               \
+    size_t i;                                                       \
+    T r; /* compare in T, so that large unsigned values are not negative */ \
+    if(op == OP_SUM)                                                \
+        {                                                           \
+        lua_Unsigned sum = 0; /* wraps around, as Lua integers */   \
+        for(i = 0; i < n; i++) sum += (lua_Unsigned)x[i];           \
+        return (lua_Integer)sum;                                    \
+        }                                                           \
+    r = x[0];                                                       \
+    if(op == OP_MIN)                                                \
+        { for(i = 1; i < n; i++) if(x[i] < r) r = x[i]; }           \
+    else                                                            \
+        { for(i = 1; i < n; i++) if(x[i] > r) r = x[i]; }           \
+    return (lua_Integer)r;                                          \
+    }
+
+REDUCE_INTEGER(cl_char)
+REDUCE_INTEGER(cl_uchar)
+REDUCE_INTEGER(cl_short)
+REDUCE_INTEGER(cl_ushort)
+REDUCE_INTEGER(cl_int)
+REDUCE_INTEGER(cl_uint)
+REDUCE_INTEGER(cl_long)
+REDUCE_INTEGER(cl_ulong)
+
+static double ReduceFloat(const float *x, size_t n, int op)
+    {
+    switch(op)
+        {
+        case OP_SUM: return SumFloat(x, n);
+        case OP_MIN: return MinFloat(x, n);
+        case OP_MAX: return MaxFloat(x, n);
+        }
+    return 0;
+    }
+
+static double ReduceHalf(const cl_half *x, size_t n, int op)
+/* Converts blocks to float and reduces them */
+    {
+    size_t i, m;
+    float f[BLOCK];
+    double r = 0, b;
+    for(i = 0; i < n; i += m)
+        {
+        m = (n - i) < BLOCK ? (n - i) : BLOCK;
+        fromhalfv(x + i, f, m);
+        b = ReduceFloat(f, m, op);
+        if(i == 0 || op == OP_SUM) r = (op == OP_SUM) ? r + b : b;
+        else if(op == OP_MIN ? (b < r || r != r) : (b > r || r != r)) r = b;
+        }
+    return r;
+    }
+
+static int Reduce(lua_State *L)
+/* result = hostmem:reduce(primtype, op, [offset], [count]) */
+    {
+    size_t n;
+    cl_hostmem hostmem = checkhostmem(L, 1, NULL);
+    int type = checkprimtype(L, 2);
+    int op = luaL_checkoption(L, 3, NULL, OpNames);
+    void *x = CheckRange(L, hostmem, type, 4, &n);
+    if(n == 0)
+        {
+        if(op != OP_SUM) return 0; /* nil */
+        lua_pushinteger(L, 0);
+        return 1;
+        }
+    switch(type)
+        {
+#define I(T) lua_pushinteger(L, Reduce##T((const T*)x, n, op)); break
+        case NONCL_TYPE_CHAR:   I(cl_char);
+        case NONCL_TYPE_UCHAR:  I(cl_uchar);
+        case NONCL_TYPE_SHORT:  I(cl_short);
+        case NONCL_TYPE_USHORT: I(cl_ushort);
+        case NONCL_TYPE_INT:    I(cl_int);
+        case NONCL_TYPE_UINT:   I(cl_uint);
+        case NONCL_TYPE_LONG:   I(cl_long);
+        case NONCL_TYPE_ULONG:  I(cl_ulong);
+#undef I
+        case NONCL_TYPE_HALF:   lua_pushnumber(L, ReduceHalf((const cl_half*)x, n, op)); break;
+        case NONCL_TYPE_FLOAT:  lua_pushnumber(L, ReduceFloat((const float*)x, n, op)); break;
+        case NONCL_TYPE_DOUBLE:
+            lua_pushnumber(L, op == OP_SUM ? SumDouble((const double*)x, n) :
+                              op == OP_MIN ? MinDouble((const double*)x, n) : MaxDouble((const double*)x, n));
+            break;
+        default:
+            return unexpected(L);
+        }
+    return 1;
+    }
+
+/*------------------------------------------------------------------------------*
+ | Conversions                                                                  |
+ *------------------------------------------------------------------------------*/
+
+static int IsInteger(int type)
+    {
+    return type != NONCL_TYPE_HALF && type != NONCL_TYPE_FLOAT && type != NONCL_TYPE_DOUBLE;
+    }
+
+/* Conversions are staged through a block of int64 (between integer types) or of
+ * doubles (otherwise), so that each type needs only a load and a store loop.
+ * Conversions from floating point to integer types saturate (nans give 0).
+ */
+#define LOAD(T, B)                                                  \
+static void Load##T##B(const void *src, B *dst, size_t n)           \
+    {                                                               \
+    size_t i;                                                       \
+    for(i = 0; i < n; i++) dst[i] = (B)((const T*)src)[i];          \
+    }
+
+#define STORE_INT(T, minval, maxval)                                \
+static void Store##T##int64_t(const int64_t *src, void *dst, size_t n) \
+    {                                                               \
+    size_t i;                                                       \
+    for(i = 0; i < n; i++) ((T*)dst)[i] = (T)src[i];                \
+    }                                                               \
+static void Store##T##double(const double *src, void *dst, size_t n) \
+    {                                                               \
+    size_t i;                                                       \
+    double v;                                                       \
+    for(i = 0; i < n; i++)                                          \
+        {                                                           \
+        v = src[i];                                                 \
+        ((T*)dst)[i] = (v != v) ? 0 : (v <= (double)(minval)) ? (minval) :  \
+                       (v >= (double)(maxval)) ? (maxval) : (T)v;   \
+        }                                                           \
+    }
+
+#define INTEGER_TYPE(T, minval, maxval) LOAD(T, int64_t) LOAD(T, double) STORE_INT(T, minval, maxval)
+
+INTEGER_TYPE(cl_char, CL_CHAR_MIN, CL_CHAR_MAX)
+INTEGER_TYPE(cl_uchar, 0, CL_UCHAR_MAX)
+INTEGER_TYPE(cl_short, CL_SHRT_MIN, CL_SHRT_MAX)
+INTEGER_TYPE(cl_ushort, 0, CL_USHRT_MAX)
+INTEGER_TYPE(cl_int, CL_INT_MIN, CL_INT_MAX)
+INTEGER_TYPE(cl_uint, 0, CL_UINT_MAX)
+INTEGER_TYPE(cl_long, CL_LONG_MIN, CL_LONG_MAX)
+INTEGER_TYPE(cl_ulong, 0, CL_ULONG_MAX)
+LOAD(cl_float, double)
+LOAD(cl_double, double)
+
+static void Loadcl_halfdouble(const void *src, double *dst, size_t n)
+    {
+    size_t i;
+    float f[BLOCK];
+    fromhalfv((const cl_half*)src, f, n); /* n <= BLOCK */
+    for(i = 0; i < n; i++) dst[i] = f[i];
+    }
+
+static void Storecl_floatdouble(const double *src, void *dst, size_t n)
+    {
+    size_t i;
+    for(i = 0; i < n; i++) ((cl_float*)dst)[i] = (cl_float)src[i];
+    }
+
+static void Storecl_doubledouble(const double *src, void *dst, size_t n)
+    { memcpy(dst, src, n * sizeof(double)); }
+
+static void Storecl_halfdouble(const double *src, void *dst, size_t n)
+    {
+    size_t i;
+    for(i = 0; i < n; i++) ((cl_half*)dst)[i] = tohalf(src[i]);
+    }
+
+typedef void (*loadint_t)(const void*, int64_t*, size_t);
+typedef void (*storeint_t)(const int64_t*, void*, size_t);
+typedef void (*loaddbl_t)(const void*, double*, size_t);
+typedef void (*storedbl_t)(const double*, void*, size_t);
+
+static loadint_t LoadInt(int type)
+    {
+    switch(type)
+        {
+#define F(T) return Load##T##int64_t
+        case NONCL_TYPE_CHAR:   F(cl_char);
+        case NONCL_TYPE_UCHAR:  F(cl_uchar);
+        case NONCL_TYPE_SHORT:  F(cl_short);
+        case NONCL_TYPE_USHORT: F(cl_ushort);
+        case NONCL_TYPE_INT:    F(cl_int);
+        case NONCL_TYPE_UINT:   F(cl_uint);
+        case NONCL_TYPE_LONG:   F(cl_long);
+        case NONCL_TYPE_ULONG:  F(cl_ulong);
+#undef F
+        }
+    return NULL;
+    }
+
+static storeint_t StoreInt(int type)
+    {
+    switch(type)
+        {
+#define F(T) return Store##T##int64_t
+        case NONCL_TYPE_CHAR:   F(cl_char);
+        case NONCL_TYPE_UCHAR:  F(cl_uchar);
+        case NONCL_TYPE_SHORT:  F(cl_short);
+        case NONCL_TYPE_USHORT: F(cl_ushort);
+        case NONCL_TYPE_INT:    F(cl_int);
+        case NONCL_TYPE_UINT:   F(cl_uint);
+        case NONCL_TYPE_LONG:   F(cl_long);
+        case NONCL_TYPE_ULONG:  F(cl_ulong);
+#undef F
+        }
+    return NULL;
+    }
+
+static loaddbl_t LoadDouble(int type)
+    {
+    switch(type)
+        {
+#define F(T) return Load##T##double
+        case NONCL_TYPE_CHAR:   F(cl_char);
+        case NONCL_TYPE_UCHAR:  F(cl_uchar);
+        case NONCL_TYPE_SHORT:  F(cl_short);
+        case NONCL_TYPE_USHORT: F(cl_ushort);
+        case NONCL_TYPE_INT:    F(cl_int);
+        case NONCL_TYPE_UINT:   F(cl_uint);
+        case NONCL_TYPE_LONG:   F(cl_long);
+        case NONCL_TYPE_ULONG:  F(cl_ulong);
+        case NONCL_TYPE_HALF:   F(cl_half);
+        case NONCL_TYPE_FLOAT:  F(cl_float);
+        case NONCL_TYPE_DOUBLE: F(cl_double);
+#undef F
+        }
+    return NULL;
+    }
+
+static storedbl_t StoreDouble(int type)
+    {
+    switch(type)
+        {
+#define F(T) return Store##T##double
+        case NONCL_TYPE_CHAR:   F(cl_char);
+        case NONCL_TYPE_UCHAR:  F(cl_uchar);
+        case NONCL_TYPE_SHORT:  F(cl_short);
+        case NONCL_TYPE_USHORT: F(cl_ushort);
+        case NONCL_TYPE_INT:    F(cl_int);
+        case NONCL_TYPE_UINT:   F(cl_uint);
+        case NONCL_TYPE_LONG:   F(cl_long);
+        case NONCL_TYPE_ULONG:  F(cl_ulong);
+        case NONCL_TYPE_HALF:   F(cl_half);
+        case NONCL_TYPE_FLOAT:  F(cl_float);
+        case NONCL_TYPE_DOUBLE: F(cl_double);
+#undef F
+        }
+    return NULL;
+    }
+
+static void ConvertData(int srctype, const char *src, int dsttype, char *dst, size_t n)
+    {
+    size_t i, m;
+    size_t srcsize = sizeofprimtype(srctype);
+    size_t dstsize = sizeofprimtype(dsttype);
+    int64_t ibuf[BLOCK];
+    double dbuf[BLOCK];
+
+    if(srctype == dsttype)
+        { memmove(dst, src, n * srcsize); return; }
+    /* direct (vectorized) paths */
+    if(srctype == NONCL_TYPE_FLOAT && dsttype == NONCL_TYPE_HALF)
+        { tohalfv((const float*)src, (cl_half*)dst, n); return; }
+    if(srctype == NONCL_TYPE_HALF && dsttype == NONCL_TYPE_FLOAT)
+        { fromhalfv((const cl_half*)src, (float*)dst, n); return; }
+
+    if(IsInteger(srctype) && IsInteger(dsttype))
+        {
+        loadint_t load = LoadInt(srctype);
+        storeint_t store = StoreInt(dsttype);
+        for(i = 0; i < n; i += m)
+            {
+            m = (n - i) < BLOCK ? (n - i) : BLOCK;
+            load(src + i*srcsize, ibuf, m);
+            store(ibuf, dst + i*dstsize, m);
+            }
+        }
+    else
+        {
+        loaddbl_t load = LoadDouble(srctype);
+        storedbl_t store = StoreDouble(dsttype);
+        for(i = 0; i < n; i += m)
+            {
+            m = (n - i) < BLOCK ? (n - i) : BLOCK;
+            load(src + i*srcsize, dbuf, m);
+            store(dbuf, dst + i*dstsize, m);
+            }
+        }
+    }
+
+static int Convert(lua_State *L)
+/* dst = hostmem:convert(srctype, dsttype, [offset], [count], [dst], [dstoffset]) */
+    {
+    size_t n, dstoffset, dstlen;
+    char *dstptr;
+    cl_hostmem dst;
+    cl_hostmem hostmem = checkhostmem(L, 1, NULL);
+    int srctype = checkprimtype(L, 2);
+    int dsttype = checkprimtype(L, 3);
+    void *src = CheckRange(L, hostmem, srctype, 4, &n);
+    size_t dstsize = sizeofprimtype(dsttype);
+    if(n == 0)
+        return luaL_argerror(L, 5, errstring(ERR_LENGTH));
+    dstlen = n * dstsize;
+
+    if(lua_isnoneornil(L, 6))
+        {
+        dst = newallocatedhostmem(L, 64, dstlen);
+        dstptr = dst->ptr;
+        }
+    else
+        {
+        dst = checkwritablehostmem(L, 6);
+        dstoffset = luaL_optinteger(L, 7, 0);
+        if(dstoffset > dst->size || dstlen > dst->size - dstoffset)
+            return luaL_argerror(L, 7, errstring(ERR_BOUNDARIES));
+        dstptr = dst->ptr + dstoffset;
+        lua_pushvalue(L, 6);
+        }
+    ConvertData(srctype, (const char*)src, dsttype, dstptr, n);
+    return 1;
+    }
+
+/*------------------------------------------------------------------------------*
+ | Transforms                                                                   |
+ *------------------------------------------------------------------------------*/
+
+#define AXPY(name, T, VT)                                           \
+static void name(T a, const T *x, T *y, size_t n)                   \
+/* y = a*x + y */                                                   \
+    {                                                               \
+    size_t i;                                                       \
+    VT vx, vy;                                                      \
+    for(i = 0; i + VLEN <= n; i += VLEN)                            \
+        {                                                           \
+        memcpy(&vx, x + i, sizeof(vx));                             \
+        memcpy(&vy, y + i, sizeof(vy));                             \
+        vy += a * vx;                                               \
+        memcpy(y + i, &vy, sizeof(vy));                             \
+        }                                                           \
+    for(; i < n; i++)                                               \
+        y[i] += a * x[i];                                           \
+    }
+
+#define SCALE(name, T, VT)                                          \
+static void name(T a, T b, T *y, size_t n)                          \
+/* y = a*y + b */                                                   \
+    {                                                               \
+    size_t i;                                                       \
+    VT vy;                                                          \
+    for(i = 0; i + VLEN <= n; i += VLEN)                            \
+        {                                                           \
+        memcpy(&vy, y + i, sizeof(vy));                             \
+        vy = a * vy + b;                                            \
+        memcpy(y + i, &vy, sizeof(vy));                             \
+        }                                                           \
+    for(; i < n; i++)                                               \
+        y[i] = a * y[i] + b;                                        \
+    }
+
+AXPY(AxpyFloat, float, vfloat_t)
+AXPY(AxpyDouble, double, vdouble_t)
+SCALE(ScaleFloat, float, vfloat_t)
+SCALE(ScaleDouble, double, vdouble_t)
+
+static int CheckFloatType(lua_State *L, int arg)
+    {
+    int type = checkprimtype(L, arg);
+    if(type != NONCL_TYPE_FLOAT && type != NONCL_TYPE_DOUBLE)
+        return luaL_argerror(L, arg, "expected 'float' or 'double'");
+    return type;
+    }
+
+static int Axpy(lua_State *L)
+/* hostmem:axpy(primtype, a, x, [offset], [count], [xoffset]) */
+    {
+    size_t n, xoffset;
+    cl_hostmem hostmem = checkwritablehostmem(L, 1);
+    int type = CheckFloatType(L, 2);
+    double a = luaL_checknumber(L, 3);
+    cl_hostmem x = checkhostmem(L, 4, NULL);
+    void *y = CheckRange(L, hostmem, type, 5, &n);
+    size_t esize = sizeofprimtype(type);
+    xoffset = luaL_optinteger(L, 7, 0);
+    if(xoffset > x->size || n > (x->size - xoffset) / esize)
+        return luaL_argerror(L, 7, errstring(ERR_BOUNDARIES));
+    if((xoffset % esize) != 0)
+        return luaL_argerror(L, 7, "offset must be a multiple of the element size");
+    if(type == NONCL_TYPE_FLOAT)
+        AxpyFloat((float)a, (const float*)(x->ptr + xoffset), (float*)y, n);
+    else
+        AxpyDouble(a, (const double*)(x->ptr + xoffset), (double*)y, n);
+    return 0;
+    }
+
+static int Scale(lua_State *L)
+/* hostmem:scale(primtype, a, [b=0], [offset], [count]) */
+    {
+    size_t n;
+    cl_hostmem hostmem = checkwritablehostmem(L, 1);
+    int type = CheckFloatType(L, 2);
+    double a = luaL_checknumber(L, 3);
+    double b = luaL_optnumber(L, 4, 0);
+    void *y = CheckRange(L, hostmem, type, 5, &n);
+    if(type == NONCL_TYPE_FLOAT)
+        ScaleFloat((float)a, (float)b, (float*)y, n);
+    else
+        ScaleDouble(a, b, (double*)y, n);
+    return 0;
+    }
+
+static const struct luaL_Reg Methods[] = 
+    {
+        { "reduce", Reduce },
+        { "convert", Convert },
+        { "axpy", Axpy },
+        { "scale", Scale },
+        { NULL, NULL } /* sentinel */
+    };
+
+void mooncl_open_hostops(lua_State *L)
+    {
+    udata_addmethods(L, HOSTMEM_MT, Methods);
+    }
+
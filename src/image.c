@@ -45,9 +45,8 @@ static void DestructorCallback(cl_image image, void *luastate)
 static ud_t *newimage(lua_State *L, cl_context context, cl_image image)
     {
     ud_t *ud;
-    ud = newuserdata(L, image, IMAGE_MT, "image");
+    ud = newuserdata(L, image, UD(context), IMAGE_MT, "image");
     ud->context = context;
-    ud->parent_ud = UD(context);
     ud->clext = ud->parent_ud->clext;
     ud->destructor = freeimage;  
     cl.SetMemObjectDestructorCallback(image, DestructorCallback, L);
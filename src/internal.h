@@ -74,6 +74,16 @@ int notavailable(lua_State *L, ...);
 void *Malloc(lua_State *L, size_t size);
 #define MallocNoErr mooncl_MallocNoErr
 void *MallocNoErr(lua_State *L, size_t size);
+#define ScratchAlloc mooncl_ScratchAlloc
+void *ScratchAlloc(lua_State *L, size_t size);
+#define ScratchReset mooncl_ScratchReset
+void ScratchReset(lua_State *L);
+#define ScratchEnter mooncl_ScratchEnter
+size_t ScratchEnter(lua_State *L);
+#define ScratchLeave mooncl_ScratchLeave
+void ScratchLeave(lua_State *L, size_t floor);
+#define scratchstats mooncl_scratchstats
+void scratchstats(lua_State *L, size_t *hits, size_t *misses, size_t *inuse);
 #define Strdup mooncl_Strdup
 char *Strdup(lua_State *L, const char *s);
 #define Free mooncl_Free
@@ -134,13 +144,31 @@ void pushlightuserdatalist(lua_State *L, void* *list, cl_uint count);
 size_t sizeofprimtype(int type);
 #define toflattable mooncl_toflattable
 int toflattable(lua_State *L, int arg);
-#define testdata mooncl_testdata
-int testdata(lua_State *L, int type, size_t n, void *dst, size_t dstsize);
+#define countdata mooncl_countdata
+size_t countdata(lua_State *L, int arg, int deep);
+#define packdata mooncl_packdata
+int packdata(lua_State *L, int arg, int type, void *dst, size_t dstsize, size_t *count);
 #define checkdata mooncl_checkdata
 int checkdata(lua_State *L, int arg, int type, void *dts, size_t dstsize);
 #define pushdata mooncl_pushdata
 int pushdata(lua_State *L, int type, void *src, size_t srcsize);
 
+/* parallel.c */
+#define parallelmemcpy mooncl_parallelmemcpy
+void parallelmemcpy(void *dst, const void *src, size_t size);
+#define parallelmemset mooncl_parallelmemset
+void parallelmemset(void *dst, int c, size_t size);
+
+/* half.c */
+#define tohalf mooncl_tohalf
+cl_half tohalf(double val);
+#define fromhalf mooncl_fromhalf
+float fromhalf(cl_half h);
+#define tohalfv mooncl_tohalfv
+void tohalfv(const float *src, cl_half *dst, size_t n);
+#define fromhalfv mooncl_fromhalfv
+void fromhalfv(const cl_half *src, float *dst, size_t n);
+
 #define checkflags(L, arg) (cl_bitfield)luaL_checkinteger((L), (arg))
 #define pushflags(L, val) lua_pushinteger((L), (val))
 
@@ -161,6 +189,56 @@ int pushdata(lua_State *L, int type, void *src, size_t srcsize);
 #define errstring mooncl_errstring
 const char* errstring(int err);
 
+/* batch.c */
+#define CMD_READ_BUFFER     0
+#define CMD_WRITE_BUFFER    1
+#define CMD_COPY_BUFFER     2
+#define CMD_FILL_BUFFER     3
+#define CMD_NDRANGE_KERNEL  4
+#define CMD_TASK            5
+#define CMD_MARKER          6
+#define CMD_BARRIER         7
+#define CMD_SET_KERNEL_ARG  8
+typedef struct {
+    cl_event event; /* event to wait for, if index=0 */
+    ud_t *ud;       /* the event's userdata */
+    cl_uint index;  /* position of the command in the list (1-based) whose event to wait for */
+} waitentry_t;
+#define COMMAND_MAXINLINEWAIT 4
+typedef struct {
+    int code;       /* CMD_XXX */
+    int ge;         /* the caller wants the event */
+    int needevent;  /* the event is needed (ge, or waited for by a later command) */
+    cl_mem mem, mem2;
+    cl_kernel kernel;
+    cl_bool blocking;
+    size_t offset, offset2, size;
+    void *ptr;
+    const void *pattern;
+    size_t pattern_size;
+    cl_uint work_dim;
+    int has_offset, has_local;
+    size_t global_offset[3], global_size[3], local_size[3];
+    cl_uint arg_index;
+    int arg_type;   /* primitive type of the kernel arg, or 0 */
+    kernelarg_t arg;
+    ud_t *objects[3]; /* userdata of the referenced objects (mem/kernel, mem2, kernel arg) */
+    cl_uint wc;
+    waitentry_t *wait; /* if wc > COMMAND_MAXINLINEWAIT, else inline */
+    waitentry_t inlinewait[COMMAND_MAXINLINEWAIT];
+} command_t;
+#define commandwait(cmd) ((cmd)->wc > COMMAND_MAXINLINEWAIT ? (cmd)->wait : (cmd)->inlinewait)
+#define anchoredalloc mooncl_anchoredalloc
+void *anchoredalloc(lua_State *L, int anchor, size_t size);
+#define checkcommand mooncl_checkcommand
+void checkcommand(lua_State *L, int arg, int anchor, command_t *cmds, cl_uint index);
+#define checkcommandobjects mooncl_checkcommandobjects
+cl_uint checkcommandobjects(command_t *cmds, cl_uint n);
+#define execcommands mooncl_execcommands
+cl_int execcommands(cl_queue queue, command_t *cmds, cl_uint n, cl_event *events, cl_event *wl, cl_uint *failed);
+#define releasecommandevents mooncl_releasecommandevents
+void releasecommandevents(cl_event *events, cl_uint n);
+
 /* tracing.c */
 #define trace_objects mooncl_trace_objects
 extern int trace_objects;
@@ -28,6 +28,7 @@
 static int freekernel(lua_State *L, ud_t *ud)
     {
     cl_kernel kernel = (cl_kernel)ud->handle;
+    freechildren(L, ARGSET_MT, ud);
     if(!freeuserdata(L, ud, "kernel")) return 0;
     ReleaseAll(Kernel, KERNEL, kernel);
     return 0;
@@ -37,9 +38,8 @@ static int newkernel(lua_State *L, cl_program program, cl_kernel kernel)
     {
     ud_t *ud;
 
-    ud = newuserdata(L, kernel, KERNEL_MT, "kernel");
+    ud = newuserdata(L, kernel, UD(program), KERNEL_MT, "kernel");
     ud->program = program;
-    ud->parent_ud = UD(program);
     ud->clext = ud->parent_ud->clext;
     ud->destructor = freekernel;  
     return 1;
@@ -102,94 +102,138 @@ static int CloneKernel(lua_State *L)
     return 1;
     }
 
-static int SetKernelArg(lua_State *L)
+int testkernelarg(lua_State *L, int arg, kernelarg_t *ka, int *faulty_arg)
+/* Checks a kernel argument given as in set_kernel_arg(), with the argument type 
+ * (or object, or size, or nil) at position arg and its value starting at arg+1.
+ * On success, ka describes the argument to be passed to clSetKernelArg(), and
+ * the function returns ERR_SUCCESS. On error, it returns an ERR_XXX code and 
+ * sets *faulty_arg to the offending position.
+ * If ka->allocated is set on return, the value must be released with Free().
+ */
     {
-    cl_int ec;
-    int t, err, type, n;
-    void *object;
-    cl_char value_char;
-    cl_uchar value_uchar;
-    cl_short value_short;
-    cl_ushort value_ushort;
-    cl_int value_int;
-    cl_uint value_uint;
-    cl_long value_long;
-    cl_ulong value_ulong;
-    cl_half value_half;
-    cl_float value_float;
-    cl_double value_double;
-    size_t arg_size = 0;
-    const void *arg_value = NULL;
-    void *data = NULL;
+    int t, err, isnum, type;
+    size_t n, esize;
+    void *object, *data;
+    lua_Integer ival;
+    lua_Number nval;
 
-    cl_kernel kernel = checkkernel(L, 1, NULL);
-    cl_uint arg_index = luaL_checkinteger(L, 2);
-
-    t = lua_type(L, 3);
+    memset(ka, 0, sizeof(kernelarg_t));
+    *faulty_arg = arg;
+    t = lua_type(L, arg);
 
     if(t == LUA_TUSERDATA)
         {
-        object = testmemobject(L, 3, NULL);
-        if(!object) object = testsampler(L, 3, NULL);
-        if(!object) object = testqueue(L, 3, NULL);
+        object = testmemobject(L, arg, NULL);
+        if(!object) object = testsampler(L, arg, NULL);
+        if(!object) object = testqueue(L, arg, NULL);
         if(!object)
-            return luaL_argerror(L, 3, errstring(ERR_TYPE));
-        arg_value = &object;
-        arg_size = sizeof(object);
+            return ERR_TYPE;
+        ka->u.object = object;
+        ka->size = sizeof(object);
+        ka->isinline = 1;
+        return ERR_SUCCESS;
         }
-    else if(t == LUA_TNUMBER)
+
+    if(t == LUA_TNUMBER)
         {
-        arg_size = luaL_checkinteger(L, 3);
-        arg_value = optlightuserdata(L, 4);
+        ival = lua_tointegerx(L, arg, &isnum);
+        if(!isnum || ival < 0)
+            return ERR_VALUE;
+        ka->size = ival;
+        if(!lua_isnoneornil(L, arg+1))
+            {
+            *faulty_arg = arg+1;
+            if(lua_type(L, arg+1) != LUA_TLIGHTUSERDATA)
+                return ERR_TYPE;
+            ka->value = lua_touserdata(L, arg+1);
+            }
+        return ERR_SUCCESS;
         }
-    else if(t == LUA_TNIL)
+
+    if(t == LUA_TNIL)
         {
-        arg_value = luaL_checklstring(L, 4, &arg_size);
+        *faulty_arg = arg+1;
+        if(lua_type(L, arg+1) != LUA_TSTRING)
+            return ERR_TYPE;
+        ka->value = lua_tolstring(L, arg+1, &ka->size);
+        return ERR_SUCCESS;
         }
-    else /* primitive type (scalar or vector) */
-        {
-        type = checkprimtype(L, 3);
-
-        if(lua_type(L, 4) == LUA_TTABLE || !lua_isnoneornil(L, 5)) 
-            { /* vector */
-            n = toflattable(L, 4);
-            arg_size = n * sizeofprimtype(type);
-            data = Malloc(L, arg_size);
-            err = testdata(L, type, n, data, arg_size);
-            if(err) 
-                { 
-                Free(L, data); 
-                return luaL_argerror(L, 4, errstring(err));
-                }
-            arg_value = data;
-            }
-        else /* scalar */
+
+    /* primitive type (scalar or vector) */
+    type = testprimtype(L, arg, &err);
+    if(err)
+        return err;
+
+    *faulty_arg = arg+1;
+    if(lua_type(L, arg+1) == LUA_TTABLE || !lua_isnoneornil(L, arg+2)) 
+        { /* vector */
+        /* try first with the inline buffer, which fits most vectors */
+        esize = sizeofprimtype(type);
+        err = packdata(L, arg+1, type, ka->u.data, KERNELARG_MAXINLINE, &n);
+        if(err != ERR_LENGTH)
             {
-            switch(type)
-                {
-#define CHECK(t, int_or_num) do {                           \
-                value_##t = luaL_check##int_or_num(L, 4);   \
-                arg_value = &value_##t;                     \
-                arg_size = sizeof(cl_##t);                  \
-            } while(0)
-                case NONCL_TYPE_CHAR:   CHECK(char, integer); break;
-                case NONCL_TYPE_UCHAR:  CHECK(uchar, integer); break;
-                case NONCL_TYPE_SHORT:  CHECK(short, integer); break;
-                case NONCL_TYPE_USHORT: CHECK(ushort, integer); break;
-                case NONCL_TYPE_INT:    CHECK(int, integer); break;
-                case NONCL_TYPE_UINT:   CHECK(uint, integer); break;
-                case NONCL_TYPE_LONG:   CHECK(long, integer); break;
-                case NONCL_TYPE_ULONG:  CHECK(ulong, integer); break;
-                case NONCL_TYPE_HALF:   CHECK(half, number); break;
-                case NONCL_TYPE_FLOAT:  CHECK(float, number); break;
-                case NONCL_TYPE_DOUBLE: CHECK(double, number); break;
-                default: return unexpected(L);
-#undef CHECK
-                }
+            ka->isinline = 1;
+            ka->size = n * esize;
+            return err;
             }
+        n = countdata(L, arg+1, 1);
+        ka->size = n * esize;
+        data = MallocNoErr(L, ka->size);
+        if(!data)
+            return ERR_MEMORY;
+        ka->value = data;
+        ka->allocated = 1;
+        err = packdata(L, arg+1, type, data, ka->size, NULL);
+        if(err)
+            { Free(L, data); ka->value = NULL; ka->allocated = 0; }
+        return err;
+        }
+
+    /* scalar */
+    ka->isinline = 1;
+    switch(type)
+        {
+#define SCALAR(t, int_or_num, v) do {                       \
+            v = lua_to##int_or_num##x(L, arg+1, &isnum);    \
+            if(!isnum) return ERR_TYPE;                     \
+            *(cl_##t*)ka->u.data = (cl_##t)v;               \
+            ka->size = sizeof(cl_##t);                      \
+        } while(0)
+        case NONCL_TYPE_CHAR:   SCALAR(char, integer, ival); break;
+        case NONCL_TYPE_UCHAR:  SCALAR(uchar, integer, ival); break;
+        case NONCL_TYPE_SHORT:  SCALAR(short, integer, ival); break;
+        case NONCL_TYPE_USHORT: SCALAR(ushort, integer, ival); break;
+        case NONCL_TYPE_INT:    SCALAR(int, integer, ival); break;
+        case NONCL_TYPE_UINT:   SCALAR(uint, integer, ival); break;
+        case NONCL_TYPE_LONG:   SCALAR(long, integer, ival); break;
+        case NONCL_TYPE_ULONG:  SCALAR(ulong, integer, ival); break;
+        case NONCL_TYPE_HALF:
+            nval = lua_tonumberx(L, arg+1, &isnum);
+            if(!isnum) return ERR_TYPE;
+            *(cl_half*)ka->u.data = tohalf(nval);
+            ka->size = sizeof(cl_half);
+            break;
+        case NONCL_TYPE_FLOAT:  SCALAR(float, number, nval); break;
+        case NONCL_TYPE_DOUBLE: SCALAR(double, number, nval); break;
+        default: return ERR_UNKNOWN;
+#undef SCALAR
         }
-    ec = cl.SetKernelArg(kernel, arg_index, arg_size, arg_value);
-    if(data) Free(L, data);
+    return ERR_SUCCESS;
+    }
+
+static int SetKernelArg(lua_State *L)
+    {
+    cl_int ec;
+    int err, faulty_arg;
+    kernelarg_t ka;
+    cl_kernel kernel = checkkernel(L, 1, NULL);
+    cl_uint arg_index = luaL_checkinteger(L, 2);
+
+    err = testkernelarg(L, 3, &ka, &faulty_arg);
+    if(err)
+        return luaL_argerror(L, faulty_arg, errstring(err));
+    ec = cl.SetKernelArg(kernel, arg_index, ka.size, kernelargvalue(&ka));
+    if(ka.allocated) Free(L, (void*)ka.value);
     CheckError(L, ec);
     return 0;
     }
@@ -274,6 +318,7 @@ static int SetKernelExecInfo(lua_State *L)
     {
     cl_kernel kernel = checkkernel(L, 1, NULL);
     cl_kernel_exec_info name = checkkernelexecinfo(L, 2);
+    ScratchReset(L);
 
     CheckPfn_2_0(L, SetKernelExecInfo);
 
@@ -472,6 +517,7 @@ static int GetKernelSubGroupInfo(lua_State *L)
     cl_kernel kernel = checkkernel(L, 1, NULL);
     cl_device device = testdevice(L, 2, NULL);
     cl_kernel_sub_group_info name = checkkernelsubgroupinfo(L, 3);
+    ScratchReset(L);
 
     CheckPfn_2_1(L, GetKernelSubGroupInfo);
 
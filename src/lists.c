@@ -189,7 +189,7 @@ size_t* checksizelist(lua_State *L, int arg, cl_uint *count, int *err)
     if(*count == 0)
         { *err = ERR_EMPTY; return NULL; }
 
-    list = (size_t*)MallocNoErr(L, sizeof(size_t) * (*count));
+    list = (size_t*)ScratchAlloc(L, sizeof(size_t) * (*count));
     if(!list)
         { *count = 0; *err = ERR_MEMORY; return NULL; }
 
@@ -278,7 +278,7 @@ void** checklightuserdatalist(lua_State *L, int arg, cl_uint *count, int *err)
     if(*count == 0)
         { *err = ERR_EMPTY; return NULL; }
 
-    list = (void**)MallocNoErr(L, sizeof(void*) * (*count));
+    list = (void**)ScratchAlloc(L, sizeof(void*) * (*count));
     if(!list)
         { *count = 0; *err = ERR_MEMORY; return NULL; }
 
@@ -61,20 +61,32 @@ int luaopen_mooncl(lua_State *L)
     mooncl_open_queue(L);
     mooncl_open_mem(L);
     mooncl_open_buffer(L);
+    mooncl_open_bufferpool(L);
     mooncl_open_image(L);
     mooncl_open_pipe(L);
     mooncl_open_gl_object(L);
     mooncl_open_sampler(L);
     mooncl_open_program(L);
+    mooncl_open_programcache(L);
     mooncl_open_kernel(L);
     mooncl_open_event(L);
+    mooncl_open_completion(L);
     mooncl_open_svm(L);
     mooncl_open_enqueue(L);
+    mooncl_open_batch(L);
     mooncl_open_hostmem(L);
+    mooncl_open_graph(L);
+    mooncl_open_argset(L);
+    mooncl_open_stream(L);
+    mooncl_open_array(L);
+    mooncl_open_hostops(L);
+    mooncl_open_parallel(L);
+    mooncl_open_hostmempool(L);
 
     /* Add functions implemented in Lua */
     lua_pushvalue(L, -1); lua_setglobal(L, "mooncl");
     if(luaL_dostring(L, "require('mooncl.utils')") != 0) lua_error(L);
+    if(luaL_dostring(L, "require('mooncl.variants')") != 0) lua_error(L);
     lua_pushnil(L);  lua_setglobal(L, "mooncl");
 
     return 1;
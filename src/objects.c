@@ -25,14 +25,61 @@
 
 #include "internal.h"
 
-ud_t *newuserdata(lua_State *L, void *handle, const char *mt, const char *tracename)
+static void linkchild(ud_t *parent_ud, ud_t *ud)
+/* inserts ud in the children list of parent_ud */
+    {
+    ud->parent_ud = parent_ud;
+    ud->prev_sibling = NULL;
+    ud->next_sibling = parent_ud->first_child;
+    if(parent_ud->first_child)
+        parent_ud->first_child->prev_sibling = ud;
+    parent_ud->first_child = ud;
+    parent_ud->nchildren++;
+    MarkLinked(ud);
+    }
+
+static void unlinkchild(ud_t *ud)
+/* removes ud from the children list of its parent */
+    {
+    ud_t *parent_ud = ud->parent_ud;
+    if(!IsLinked(ud)) return;
+    CancelLinked(ud);
+    if(ud->prev_sibling)
+        ud->prev_sibling->next_sibling = ud->next_sibling;
+    else
+        parent_ud->first_child = ud->next_sibling;
+    if(ud->next_sibling)
+        ud->next_sibling->prev_sibling = ud->prev_sibling;
+    ud->next_sibling = ud->prev_sibling = NULL;
+    parent_ud->nchildren--;
+    }
+
+static void orphanchildren(ud_t *parent_ud)
+/* detaches any child left in the list (i.e. not destroyed by the parent's destructor),
+ * so that it will not try to unlink itself from a parent that no longer exists */
+    {
+    ud_t *ud, *next;
+    for(ud = parent_ud->first_child; ud != NULL; ud = next)
+        {
+        next = ud->next_sibling;
+        ud->next_sibling = ud->prev_sibling = NULL;
+        CancelLinked(ud);
+        }
+    parent_ud->first_child = NULL;
+    parent_ud->nchildren = 0;
+    }
+
+ud_t *newuserdata(lua_State *L, void *handle, ud_t *parent_ud, const char *mt, const char *tracename)
     {
     ud_t *ud;
     /* we use handle as search key */
     ud = (ud_t*)udata_new(L, sizeof(ud_t), (uint64_t)(uintptr_t)handle, mt);
     memset(ud, 0, sizeof(ud_t));
     ud->handle = handle;
+    ud->mt = mt;
     MarkValid(ud);
+    if(parent_ud)
+        linkchild(parent_ud, ud);
     if(trace_objects)
         printf("create %s %p (%p)\n", tracename, (void*)ud, handle);
     return ud;
@@ -46,6 +93,8 @@ int freeuserdata(lua_State *L, ud_t *ud, const char *tracename)
      * by the script, or implicitly destroyed because child of a destroyed object). */
     if(!IsValid(ud)) return 0;
     CancelValid(ud);
+    unlinkchild(ud);
+    orphanchildren(ud);
     if(ud->info) 
         Free(L, ud->info);
     if(trace_objects)
@@ -54,21 +103,32 @@ int freeuserdata(lua_State *L, ud_t *ud, const char *tracename)
     return 1;
     }
 
-
-static int freeifchild(lua_State *L, const void *mem, const char *mt, const void *parent_ud)
-/* callback for udata_scan */
-    {
-    ud_t *ud = (ud_t*)mem;
-    (void)mt;
-    if(IsValid(ud) && (ud->parent_ud == parent_ud))
-        ud->destructor(L, ud);
-    return 0;
-    }
+static int samemt(const char *mt1, const char *mt2)
+    { return (mt1 == mt2) || (strcmp(mt1, mt2) == 0); }
 
 int freechildren(lua_State *L,  const char *mt, ud_t *parent_ud)
-/* calls the self destructor for all 'mt' objects that are children of the given parent_ud */
+/* calls the self destructor for all 'mt' objects that are children of the given parent_ud.
+ * Only the parent's own children list is visited, so this is O(number of children).
+ */
     {
-    return udata_scan(L, mt, parent_ud, freeifchild);
+    uint32_t count;
+    ud_t *ud = parent_ud->first_child;
+    ud_t *next;
+    while(ud)
+        {
+        next = ud->next_sibling;
+        if(samemt(ud->mt, mt))
+            {
+            count = parent_ud->nchildren;
+            ud->destructor(L, ud);
+            /* If the destructor caused other siblings to be deleted as well, 'next'
+             * may be gone, so we restart from the head of the (shortened) list. */
+            if(parent_ud->nchildren + 1 < count)
+                next = parent_ud->first_child;
+            }
+        ud = next;
+        }
+    return 0;
     }
 
 int pushuserdata(lua_State *L, ud_t *ud)
@@ -127,7 +187,8 @@ void** checkxxxlist(lua_State *L, int arg, cl_uint *count, int *err, const char
 /* cl_xxx* checkxxxlist(lua_State *L, int arg, cl_uint *count, int *err)
  * Checks if the variable at arg on the Lua stack is a list of cl_xxx objects.
  * On success, returns an array of cl_xxx handles and sets its length in *count.
- * The array s Malloc'd and must be released by the caller using Free(L, ...).
+ * The array is allocated with ScratchAlloc() and must be released by the caller
+ * using Free(L, ...) before returning to Lua.
  * On error, sets *err to ERR_XXX, *count to 0, and returns NULL. 
  */
     {
@@ -143,7 +204,7 @@ void** checkxxxlist(lua_State *L, int arg, cl_uint *count, int *err, const char
     *count = luaL_len(L, arg);
     if(*count == 0)
         { *err = ERR_EMPTY; return NULL; }
-    list = (void**)MallocNoErr(L, sizeof(void*) * (*count));
+    list = (void**)ScratchAlloc(L, sizeof(void*) * (*count));
 
     if(!list)
         { *count = 0; *err = ERR_MEMORY; return NULL; }
@@ -194,7 +255,7 @@ cl_mem* checkmemobjectlist(lua_State *L, int arg, cl_uint *count, int *err)
     *count = luaL_len(L, arg);
     if(*count == 0)
         { *err = ERR_EMPTY; return NULL; }
-    list = (cl_mem*)MallocNoErr(L, sizeof(cl_mem) * (*count));
+    list = (cl_mem*)ScratchAlloc(L, sizeof(cl_mem) * (*count));
 
     if(!list)
         { *count = 0; *err = ERR_MEMORY; return NULL; }
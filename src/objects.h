@@ -57,9 +57,35 @@ typedef struct {
 typedef struct {
     char *ptr; 
     size_t size;
+    int ref; /* reference to the Lua value owning the memory (string or parent hostmem), or LUA_NOREF */
 } hostmem_t;
 #define cl_hostmem hostmem_t*
 
+/* typed array (see array.c), it is also an hostmem: */
+typedef struct {
+    hostmem_t hostmem; /* must be the first field */
+    int type;          /* element primtype (NONCL_TYPE_XXX) */
+    size_t esize;      /* element size */
+    size_t n;          /* no. of elements */
+} array_t;
+#define cl_array array_t*
+
+/* hostmem pool (see hostmempool.c): */
+typedef struct mooncl_hostmempool_s hostmempool_t;
+#define cl_hostmempool hostmempool_t*
+
+/* device buffer pool (see bufferpool.c): */
+typedef struct mooncl_bufferpool_s bufferpool_t;
+#define cl_bufferpool bufferpool_t*
+
+/* recorded command graph (see graph.c): */
+typedef struct mooncl_graph_s graph_t;
+#define cl_graph graph_t*
+
+/* kernel argument set (see argset.c): */
+typedef struct mooncl_argset_s argset_t;
+#define cl_argset argset_t*
+
 /*------------------------------------------------------*/
 
 /* Objects' metatable names */
@@ -76,6 +102,11 @@ typedef struct {
 #define SAMPLER_MT "mooncl_sampler"
 #define SVM_MT "mooncl_svm"
 #define HOSTMEM_MT "mooncl_hostmem"
+#define GRAPH_MT "mooncl_graph"
+#define ARGSET_MT "mooncl_argset"
+#define ARRAY_MT "mooncl_array"
+#define HOSTMEMPOOL_MT "mooncl_hostmempool"
+#define BUFFERPOOL_MT "mooncl_bufferpool"
 
 /* Userdata memory associated with objects */
 #define ud_t mooncl_ud_t
@@ -89,6 +120,11 @@ struct mooncl_ud_s {
     cl_context context;
     cl_program program;     
     ud_t *parent_ud; /* the ud of the parent object */
+    ud_t *first_child; /* list of children objects (linked via next/prev_sibling) */
+    ud_t *next_sibling;
+    ud_t *prev_sibling;
+    uint32_t nchildren; /* number of objects in the children list */
+    const char *mt; /* metatable name, used to select children by type */
     mooncl_extdt_t *clext; /* extensions dispatch table */
     uint32_t marks;
     void *info; /* object specific info (ud_info_t, subject to Free() at destruction, if not NULL) */
@@ -139,6 +175,22 @@ struct mooncl_ud_s {
 #define MarkGLRenderbuffer(ud)     MarkSet((ud)->marks, 9) 
 #define CancelGLRenderbuffer(ud)   MarkReset((ud)->marks, 9)
 
+#define IsLinked(ud)            MarkGet((ud)->marks, 10) /* in the parent's children list */
+#define MarkLinked(ud)          MarkSet((ud)->marks, 10) 
+#define CancelLinked(ud)        MarkReset((ud)->marks, 10)
+
+#define IsMapped(ud)            MarkGet((ud)->marks, 11) /* hostmem backed by an mmap()ed area */
+#define MarkMapped(ud)          MarkSet((ud)->marks, 11) 
+#define CancelMapped(ud)        MarkReset((ud)->marks, 11)
+
+#define IsReadOnly(ud)          MarkGet((ud)->marks, 12) /* hostmem not writable */
+#define MarkReadOnly(ud)        MarkSet((ud)->marks, 12) 
+#define CancelReadOnly(ud)      MarkReset((ud)->marks, 12)
+
+#define IsPooled(ud)            MarkGet((ud)->marks, 13) /* hostmem or sub buffer owned by its parent pool */
+#define MarkPooled(ud)          MarkSet((ud)->marks, 13) 
+#define CancelPooled(ud)        MarkReset((ud)->marks, 13)
+
 #define IsGLObject(ud)  (IsGLBuffer(ud) || IsGLTexture(ud) || IsGLRenderbuffer(ud))
 
 
@@ -148,7 +200,7 @@ struct mooncl_ud_s {
 #endif
 
 #define newuserdata mooncl_newuserdata
-ud_t *newuserdata(lua_State *L, void *handle, const char *mt, const char *tracename);
+ud_t *newuserdata(lua_State *L, void *handle, ud_t *parent_ud, const char *mt, const char *tracename);
 #define freeuserdata mooncl_freeuserdata
 int freeuserdata(lua_State *L, ud_t *ud, const char *tracename);
 #define pushuserdata mooncl_pushuserdata 
@@ -212,6 +264,15 @@ cl_mem* checkmemobjectlist(lua_State *L, int arg, cl_uint *count, int *err);
 int testbufferboundaries(lua_State *L, cl_buffer buffer, size_t offset, size_t size);
 #define checkbufferboundaries mooncl_checkbufferboundaries
 int checkbufferboundaries(lua_State *L, cl_buffer buffer, size_t offset, size_t size);
+#define newpooledbuffer mooncl_newpooledbuffer
+ud_t *newpooledbuffer(lua_State *L, ud_t *pool_ud, cl_buffer slab, cl_buffer buffer, size_t origin, size_t size);
+
+/* bufferpool.c */
+#define checkbufferpool(L, arg, udp) (cl_bufferpool)checkxxx((L), (arg), (udp), BUFFERPOOL_MT)
+#define testbufferpool(L, arg, udp) (cl_bufferpool)testxxx((L), (arg), (udp), BUFFERPOOL_MT)
+#define pushbufferpool(L, handle) pushxxx((L), (handle))
+#define bufferpoolrelease mooncl_bufferpoolrelease
+void bufferpoolrelease(lua_State *L, cl_bufferpool pool, cl_buffer slab, size_t origin, size_t size);
 
 /* image.c */
 #define checkimage(L, arg, udp) (cl_image)checkxxx((L), (arg), (udp), IMAGE_MT)
@@ -236,20 +297,45 @@ int checkbufferboundaries(lua_State *L, cl_buffer buffer, size_t offset, size_t
 #define testprogram(L, arg, udp) (cl_program)testxxx((L), (arg), (udp), PROGRAM_MT)
 #define pushprogram(L, handle) pushxxx((L), (handle))
 #define checkprogramlist(L, arg, count, err) (cl_program*)checkxxxlist((L), (arg), (count), (err), PROGRAM_MT)
+#define newprogram mooncl_newprogram
+int newprogram(lua_State *L, cl_context context, cl_program program);
 
 /* kernel.c */
 #define checkkernel(L, arg, udp) (cl_kernel)checkxxx((L), (arg), (udp), KERNEL_MT)
 #define testkernel(L, arg, udp) (cl_kernel)testxxx((L), (arg), (udp), KERNEL_MT)
 #define pushkernel(L, handle) pushxxx((L), (handle))
 #define checkkernellist(L, arg, count, err) (cl_kernel*)checkxxxlist((L), (arg), (count), (err), KERNEL_MT)
+#define KERNELARG_MAXINLINE 128 /* large enough for any vector type (double16) */
+typedef struct {
+    size_t size;        /* arg_size */
+    const void *value;  /* arg_value, if not inline (NULL for __local arguments) */
+    int isinline;       /* arg_value is in u.data */
+    int allocated;      /* value was Malloc()ed and must be Free()d */
+    union {
+        void *object;
+        cl_double align_;
+        char data[KERNELARG_MAXINLINE];
+    } u;
+} kernelarg_t;
+#define kernelargvalue(ka) ((ka)->isinline ? (const void*)(ka)->u.data : (ka)->value)
+#define testkernelarg mooncl_testkernelarg
+int testkernelarg(lua_State *L, int arg, kernelarg_t *ka, int *faulty_arg);
 
 /* event.c */
 #define checkevent(L, arg, udp) (cl_event)checkxxx((L), (arg), (udp), EVENT_MT)
 #define testevent(L, arg, udp) (cl_event)testxxx((L), (arg), (udp), EVENT_MT)
 #define pushevent(L, handle) pushxxx((L), (handle))
-#define checkeventlist(L, arg, count, err) (cl_event*)checkxxxlist((L), (arg), (count), (err), EVENT_MT)
+#define checkeventlist mooncl_checkeventlist
+cl_event* checkeventlist(lua_State *L, int arg, cl_uint *count, int *err);
 #define newevent mooncl_newevent
 int newevent(lua_State *L, cl_context context, cl_event event);
+#define GET_EVENT_HANDLE 2
+#define optgetevent mooncl_optgetevent
+int optgetevent(lua_State *L, int arg);
+#define pushenqueuedevent mooncl_pushenqueuedevent
+int pushenqueuedevent(lua_State *L, cl_context context, cl_event event, int ge);
+#define eventringpurge mooncl_eventringpurge
+void eventringpurge(cl_context context);
 
 /* svm.c */
 #define checksvm(L, arg, udp) (cl_svm)checkxxx((L), (arg), (udp), SVM_MT)
@@ -262,6 +348,46 @@ int newevent(lua_State *L, cl_context context, cl_event event);
 #define testhostmem(L, arg, udp) (cl_hostmem)testxxx((L), (arg), (udp), HOSTMEM_MT)
 #define pushhostmem(L, handle) pushxxx((L), (handle))
 #define checkhostmemlist(L, arg, count, err) (cl_hostmem*)checkxxxlist((L), (arg), (count), (err), HOSTMEM_MT)
+#define checkwritablehostmem mooncl_checkwritablehostmem
+cl_hostmem checkwritablehostmem(lua_State *L, int arg);
+#define checkhostptr mooncl_checkhostptr
+void *checkhostptr(lua_State *L, int arg, size_t *size, ud_t **udp);
+#define newhostmemobject mooncl_newhostmemobject
+ud_t *newhostmemobject(lua_State *L, cl_hostmem hostmem, ud_t *parent_ud, const char *mt, const char *tracename);
+#define hostmemalloc mooncl_hostmemalloc
+void *hostmemalloc(size_t alignment, size_t size);
+#define newallocatedhostmem mooncl_newallocatedhostmem
+cl_hostmem newallocatedhostmem(lua_State *L, size_t alignment, size_t size);
+#define hostmemfree mooncl_hostmemfree
+void hostmemfree(void *ptr);
+
+/* completion.c */
+#define completioninit mooncl_completioninit
+int completioninit(lua_State *L);
+#define completionpush mooncl_completionpush
+void completionpush(cl_event event, cl_int status, lua_Integer handle);
+
+/* hostmempool.c */
+#define checkhostmempool(L, arg, udp) (cl_hostmempool)checkxxx((L), (arg), (udp), HOSTMEMPOOL_MT)
+#define testhostmempool(L, arg, udp) (cl_hostmempool)testxxx((L), (arg), (udp), HOSTMEMPOOL_MT)
+#define pushhostmempool(L, handle) pushxxx((L), (handle))
+#define hostmempoolrelease mooncl_hostmempoolrelease
+void hostmempoolrelease(lua_State *L, cl_hostmempool pool, void *ptr, size_t size);
+
+/* graph.c */
+#define checkgraph(L, arg, udp) (cl_graph)checkxxx((L), (arg), (udp), GRAPH_MT)
+#define testgraph(L, arg, udp) (cl_graph)testxxx((L), (arg), (udp), GRAPH_MT)
+#define pushgraph(L, handle) pushxxx((L), (handle))
+
+/* argset.c */
+#define checkargset(L, arg, udp) (cl_argset)checkxxx((L), (arg), (udp), ARGSET_MT)
+#define testargset(L, arg, udp) (cl_argset)testxxx((L), (arg), (udp), ARGSET_MT)
+#define pushargset(L, handle) pushxxx((L), (handle))
+
+/* array.c */
+#define checkarray(L, arg, udp) (cl_array)checkxxx((L), (arg), (udp), ARRAY_MT)
+#define testarray(L, arg, udp) (cl_array)testxxx((L), (arg), (udp), ARRAY_MT)
+#define pusharray(L, handle) pushxxx((L), (handle))
 
 /* used in main.c */
 void mooncl_open_platform(lua_State *L);
@@ -270,16 +396,27 @@ void mooncl_open_context(lua_State *L);
 void mooncl_open_queue(lua_State *L);
 void mooncl_open_mem(lua_State *L);
 void mooncl_open_buffer(lua_State *L);
+void mooncl_open_bufferpool(lua_State *L);
 void mooncl_open_image(lua_State *L);
 void mooncl_open_pipe(lua_State *L);
 void mooncl_open_gl_object(lua_State *L);
 void mooncl_open_sampler(lua_State *L);
 void mooncl_open_program(lua_State *L);
+void mooncl_open_programcache(lua_State *L);
 void mooncl_open_kernel(lua_State *L);
 void mooncl_open_event(lua_State *L);
+void mooncl_open_completion(lua_State *L);
 void mooncl_open_enqueue(lua_State *L);
+void mooncl_open_batch(lua_State *L);
 void mooncl_open_svm(lua_State *L);
 void mooncl_open_hostmem(lua_State *L);
+void mooncl_open_graph(lua_State *L);
+void mooncl_open_argset(lua_State *L);
+void mooncl_open_stream(lua_State *L);
+void mooncl_open_array(lua_State *L);
+void mooncl_open_hostops(lua_State *L);
+void mooncl_open_parallel(lua_State *L);
+void mooncl_open_hostmempool(lua_State *L);
 
 #define RAW_FUNC(xxx)                       \
 static int Raw(lua_State *L)                \
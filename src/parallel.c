@@ -0,0 +1,181 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Stefano Trettel
+ *
+ * Software repository: MoonCL, https://github.com/stetre/mooncl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define _GNU_SOURCE /* see man pthread_setaffinity_np(3) */
+#include "internal.h"
+
+/* Multithreaded memcpy() and memset() for large hostmem areas.
+ *
+ * Disabled by default (nthreads=1). When enabled, areas of at least min_size bytes
+ * are split in page aligned chunks, one per thread, with the calling thread taking
+ * the first one. Threads are created per call, since their cost is negligible
+ * compared to the areas that are worth parallelizing.
+ * If pinning is enabled, the i-th thread is bound to the i-th CPU of the process'
+ * affinity mask, so that zeroing a newly allocated area distributes its pages over
+ * the NUMA nodes according to the first-touch policy.
+ */
+
+#define CHUNK_ALIGN 65536
+#define MAX_THREADS 64
+
+static int NThreads = 1;
+static size_t MinSize = 16*1024*1024;
+static int Pin = 0;
+
+#if defined(LINUX)
+#include <pthread.h>
+#include <sched.h>
+
+typedef struct {
+    char *dst;
+    const char *src; /* NULL for memset */
+    int c;
+    size_t size;
+    int cpu; /* -1 = do not pin */
+} job_t;
+
+static void *Worker(void *arg)
+    {
+    job_t *job = (job_t*)arg;
+    cpu_set_t set;
+    if(job->cpu >= 0)
+        {
+        CPU_ZERO(&set);
+        CPU_SET(job->cpu, &set);
+        (void)pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        }
+    if(job->src)
+        memcpy(job->dst, job->src, job->size);
+    else
+        memset(job->dst, job->c, job->size);
+    return NULL;
+    }
+
+static int Cpus(int *cpus, int n)
+/* Gets the first n CPUs of the process' affinity mask, and returns their number */
+    {
+    int i, count = 0;
+    cpu_set_t set;
+    if(sched_getaffinity(0, sizeof(set), &set) != 0)
+        return 0;
+    for(i = 0; i < CPU_SETSIZE && count < n; i++)
+        if(CPU_ISSET(i, &set)) cpus[count++] = i;
+    return count;
+    }
+
+static void Run(char *dst, const char *src, int c, size_t size)
+    {
+    int i, n, ncpus = 0;
+    size_t chunk, offset;
+    int cpus[MAX_THREADS];
+    job_t job[MAX_THREADS];
+    pthread_t tid[MAX_THREADS];
+    int started[MAX_THREADS];
+
+    n = NThreads;
+    chunk = (size + n - 1) / n;
+    chunk = (chunk + CHUNK_ALIGN - 1) & ~((size_t)CHUNK_ALIGN - 1);
+    if(Pin) ncpus = Cpus(cpus, n);
+    for(i = 0, offset = 0; i < n; i++, offset += chunk)
+        {
+        job[i].dst = dst + offset;
+        job[i].src = src ? src + offset : NULL;
+        job[i].c = c;
+        job[i].size = offset >= size ? 0 : (size - offset < chunk ? size - offset : chunk);
+        job[i].cpu = ncpus > 0 ? cpus[i % ncpus] : -1;
+        started[i] = 0;
+        }
+    for(i = 1; i < n; i++)
+        {
+        if(job[i].size == 0) continue;
+        started[i] = (pthread_create(&tid[i], NULL, Worker, &job[i]) == 0);
+        if(!started[i]) Worker(&job[i]); /* do it here */
+        }
+    /* the calling thread does the first chunk (not pinned, not to affect the caller) */
+    job[0].cpu = -1;
+    Worker(&job[0]);
+    for(i = 1; i < n; i++)
+        if(started[i]) pthread_join(tid[i], NULL);
+    }
+
+#define Parallel(size) (NThreads > 1 && (size) >= MinSize)
+
+#else /* threads not supported */
+
+#define Parallel(size) 0
+#define Run(dst, src, c, size) do { } while(0)
+
+#endif
+
+void parallelmemcpy(void *dst, const void *src, size_t size)
+    {
+    if(Parallel(size))
+        Run((char*)dst, (const char*)src, 0, size);
+    else
+        memcpy(dst, src, size);
+    }
+
+void parallelmemset(void *dst, int c, size_t size)
+    {
+    if(Parallel(size))
+        Run((char*)dst, NULL, c, size);
+    else
+        memset(dst, c, size);
+    }
+
+static int HostmemThreads(lua_State *L)
+/* nthreads, min_size, pin = hostmem_threads([nthreads], [min_size], [pin]) */
+    {
+    lua_Integer n;
+    if(!lua_isnoneornil(L, 1))
+        {
+        n = luaL_checkinteger(L, 1);
+        if(n < 1 || n > MAX_THREADS)
+            return luaL_argerror(L, 1, "out of range");
+#if !defined(LINUX)
+        if(n > 1) return notavailable(L);
+#endif
+        NThreads = n;
+        MinSize = luaL_optinteger(L, 2, MinSize);
+        if(!lua_isnoneornil(L, 3))
+            Pin = checkboolean(L, 3);
+        }
+    lua_pushinteger(L, NThreads);
+    lua_pushinteger(L, MinSize);
+    lua_pushboolean(L, Pin);
+    return 3;
+    }
+
+static const struct luaL_Reg Functions[] = 
+    {
+        { "hostmem_threads", HostmemThreads },
+        { NULL, NULL } /* sentinel */
+    };
+
+void mooncl_open_parallel(lua_State *L)
+    {
+    luaL_setfuncs(L, Functions, 0);
+    }
+
@@ -46,9 +46,8 @@ static void DestructorCallback(cl_pipe pipe, void *luastate)
 static int newpipe(lua_State *L, cl_context context, cl_pipe pipe)
     {
     ud_t *ud;
-    ud = newuserdata(L, pipe, PIPE_MT, "pipe");
+    ud = newuserdata(L, pipe, UD(context), PIPE_MT, "pipe");
     ud->context = context;
-    ud->parent_ud = UD(context);
     ud->clext = ud->parent_ud->clext;
     ud->destructor = freepipe;  
     cl.SetMemObjectDestructorCallback(pipe, DestructorCallback, L);
@@ -41,10 +41,9 @@ static int freeplatform(lua_State *L, ud_t *ud)
 static int newplatform(lua_State *L, cl_platform platform)
     {
     ud_t *ud;
-    ud = newuserdata(L, platform, PLATFORM_MT, "platform");
+    ud = newuserdata(L, platform, NULL, PLATFORM_MT, "platform");
     ud->platform = platform;
     ud->device = NULL;
-    ud->parent_ud = NULL;
     ud->clext = mooncl_getproc_extensions(L, platform);
     ud->destructor = freeplatform;
     return 1;
@@ -23,23 +23,57 @@
  * SOFTWARE.
  */
 
+#define _DEFAULT_SOURCE /* for sysconf() */
 #include "internal.h"
+#if defined(LINUX)
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+/* State of an asynchronous build, shared by the program's userdata and the
+ * pfn_notify callback (which may run in a driver thread). It is allocated with
+ * malloc() and released by the last of the two that drops its reference.
+ */
+typedef struct {
+    int done;
+    int refs;
+} buildstate_t;
+
+typedef struct {
+    buildstate_t *build; /* last asynchronous build, or NULL */
+} udinfo_t;
+
+static void BuildStateUnref(buildstate_t *state)
+    {
+    if(__atomic_sub_fetch(&state->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(state);
+    }
+
+static void DropBuildState(ud_t *ud)
+    {
+    udinfo_t *udinfo = (udinfo_t*)ud->info;
+    if(udinfo && udinfo->build)
+        {
+        BuildStateUnref(udinfo->build);
+        udinfo->build = NULL;
+        }
+    }
 
 static int freeprogram(lua_State *L, ud_t *ud)
     {
     cl_program program = (cl_program)ud->handle;
+    DropBuildState(ud);
     freechildren(L, KERNEL_MT, ud);
     if(!freeuserdata(L, ud, "program")) return 0;
     ReleaseAll(Program, PROGRAM, program);
     return 0;
     }
 
-static int newprogram(lua_State *L, cl_context context, cl_program program)
+int newprogram(lua_State *L, cl_context context, cl_program program)
     {
     ud_t *ud;
-    ud = newuserdata(L, program, PROGRAM_MT, "program");
+    ud = newuserdata(L, program, UD(context), PROGRAM_MT, "program");
     ud->context = context;
-    ud->parent_ud = UD(context);
     ud->clext = ud->parent_ud->clext;
     ud->destructor = freeprogram;  
     return 1;
@@ -82,6 +116,7 @@ static int CreateProgramWithBinary(lua_State *L)
 } while(0)
 
     cl_context context = checkcontext(L, 1, NULL);
+    ScratchReset(L);
     devices = checkdevicelist(L, 2, &count, &err);
     if(err) return luaL_argerror(L, 2, errstring(err));
 
@@ -127,8 +162,10 @@ static int CreateProgramWithBuiltInKernels(lua_State *L)
     cl_program program;
     const char * names;
 
+    cl_device *devices;
     cl_context context = checkcontext(L, 1, NULL);
-    cl_device *devices = checkdevicelist(L, 2, &count, &err);
+    ScratchReset(L);
+    devices = checkdevicelist(L, 2, &count, &err);
     if(err) return luaL_argerror(L, 2, errstring(err));
     names = luaL_checkstring(L, 3);
 
@@ -164,6 +201,7 @@ static int BuildProgram(lua_State *L)
     const char *options;
 
     cl_program program = checkprogram(L, 1, NULL);
+    ScratchReset(L);
 
     devices = checkdevicelist(L, 2, &num_devices, &err); /* optional */
     if(err < 0) return luaL_argerror(L, 2, errstring(err));
@@ -184,6 +222,146 @@ static int BuildProgram(lua_State *L)
     return 1;
     }
 
+static void CL_CALLBACK BuildNotify(cl_program program, void *user_data)
+    {
+    buildstate_t *state = (buildstate_t*)user_data;
+    (void)program;
+    __atomic_store_n(&state->done, 1, __ATOMIC_RELEASE);
+    BuildStateUnref(state);
+    }
+
+static int BuildProgramAsync(lua_State *L)
+/* ok, errcode = build_program_async(program, [devices], [options]) */
+    {
+    int err;
+    cl_int ec;
+    ud_t *ud;
+    udinfo_t *udinfo;
+    cl_uint num_devices;
+    cl_device *devices;
+    const char *options;
+    buildstate_t *state;
+
+    cl_program program = checkprogram(L, 1, &ud);
+    ScratchReset(L);
+
+    devices = checkdevicelist(L, 2, &num_devices, &err); /* optional */
+    if(err < 0) return luaL_argerror(L, 2, errstring(err));
+
+    options = luaL_optstring(L, 3, NULL);
+
+    if(!ud->info)
+        {
+        ud->info = MallocNoErr(L, sizeof(udinfo_t));
+        if(!ud->info)
+            { Free(L, devices); return luaL_error(L, errstring(ERR_MEMORY)); }
+        memset(ud->info, 0, sizeof(udinfo_t));
+        }
+    udinfo = (udinfo_t*)ud->info;
+    state = (buildstate_t*)malloc(sizeof(buildstate_t));
+    if(!state)
+        { Free(L, devices); return luaL_error(L, errstring(ERR_MEMORY)); }
+    state->done = 0;
+    state->refs = 2; /* userdata + callback */
+    DropBuildState(ud);
+    udinfo->build = state;
+
+    ec = cl.BuildProgram(program, num_devices, devices, options, BuildNotify, state);
+    Free(L, devices);
+
+    if(ec)
+        {
+        /* The build is over in any case. On a build failure, synchronous implementations
+         * may have already called (or may still call) the callback, which owns its own
+         * reference, so we drop it only for errors where the build did not even start.
+         */
+        __atomic_store_n(&state->done, 1, __ATOMIC_RELEASE);
+        if(ec != CL_BUILD_PROGRAM_FAILURE)
+            BuildStateUnref(state);
+        lua_pushboolean(L, 0);
+        pusherrcode(L, ec);
+        return 2;
+        }
+    
+    lua_pushboolean(L, 1);
+    return 1;
+    }
+
+static cl_int BuildStatus(lua_State *L, cl_program program, ud_t *ud)
+/* Returns the overall status of the last asynchronous build of the program */
+    {
+    cl_int ec;
+    cl_uint count, i;
+    cl_device *devices;
+    cl_build_status status, result = CL_BUILD_SUCCESS;
+    udinfo_t *udinfo = (udinfo_t*)ud->info;
+    if(!udinfo || !udinfo->build)
+        return CL_BUILD_NONE;
+    if(!__atomic_load_n(&udinfo->build->done, __ATOMIC_ACQUIRE))
+        return CL_BUILD_IN_PROGRESS;
+    ec = cl.GetProgramInfo(program, CL_PROGRAM_NUM_DEVICES, sizeof(count), &count, NULL);
+    CheckError(L, ec);
+    devices = (cl_device*)Malloc(L, (count > 0 ? count : 1) * sizeof(cl_device));
+    ec = cl.GetProgramInfo(program, CL_PROGRAM_DEVICES, count * sizeof(cl_device), devices, NULL);
+    for(i = 0; i < count && !ec; i++)
+        {
+        ec = cl.GetProgramBuildInfo(program, devices[i], CL_PROGRAM_BUILD_STATUS, sizeof(status), &status, NULL);
+        if(!ec && status == CL_BUILD_ERROR) result = CL_BUILD_ERROR;
+        }
+    Free(L, devices);
+    CheckError(L, ec);
+    return result;
+    }
+
+static int CheckBuild(lua_State *L)
+/* status = check_build(program) */
+    {
+    ud_t *ud;
+    cl_program program = checkprogram(L, 1, &ud);
+    pushbuildstatus(L, BuildStatus(L, program, ud));
+    return 1;
+    }
+
+static int WaitBuilds(lua_State *L)
+/* done = wait_builds(program | {program}, [timeout]) */
+    {
+    int err, pending;
+    ud_t *ud;
+    udinfo_t *udinfo;
+    cl_uint count, i;
+    cl_program *programs, program;
+    double timeout = luaL_optnumber(L, 2, -1);
+    double t0 = now();
+    ScratchReset(L);
+    if(lua_type(L, 1) != LUA_TTABLE)
+        {
+        program = checkprogram(L, 1, NULL);
+        programs = &program;
+        count = 1;
+        }
+    else
+        {
+        programs = checkprogramlist(L, 1, &count, &err);
+        if(err) return luaL_argerror(L, 1, errstring(err));
+        }
+    while(1)
+        {
+        pending = 0;
+        for(i = 0; i < count && !pending; i++)
+            {
+            ud = UD(programs[i]);
+            udinfo = ud ? (udinfo_t*)ud->info : NULL;
+            if(udinfo && udinfo->build && !__atomic_load_n(&udinfo->build->done, __ATOMIC_ACQUIRE))
+                pending = 1;
+            }
+        if(!pending || (timeout >= 0 && since(t0) >= timeout)) break;
+        sleeep(0.001);
+        }
+    if(programs != &program) Free(L, programs);
+    lua_pushboolean(L, !pending);
+    return 1;
+    }
+
 static int CompileProgram(lua_State *L)
     {
     int err;
@@ -195,6 +373,7 @@ static int CompileProgram(lua_State *L)
     char **header_names;
 
     cl_program program = checkprogram(L, 1, NULL);
+    ScratchReset(L);
 
     devices = checkdevicelist(L, 2, &num_devices, &err); /* optional */
     if(err < 0) return luaL_argerror(L, 2, errstring(err));
@@ -252,6 +431,7 @@ static int LinkProgram(lua_State *L)
     cl_program *programs, program;
 
     cl_context context = checkcontext(L, 1, NULL);
+    ScratchReset(L);
 
     devices = checkdevicelist(L, 2, &num_devices, &err); /* optional */
     if(err < 0) return luaL_argerror(L, 2, errstring(err));
@@ -376,7 +556,7 @@ static int GetBinaries(lua_State *L, cl_program obj)
 
     binaries[0] = bin;
     for(i=1; i<num_devices; i++)
-        bin[i] = bin[i-1] + sizes[i-1];
+        binaries[i] = binaries[i-1] + sizes[i-1];
 
     ec = cl.GetProgramInfo(obj, CL_PROGRAM_BINARIES, num_devices*sizeof(char*), binaries, NULL);
     if(ec)
@@ -467,6 +647,174 @@ static int GetProgramBuildString(lua_State *L, cl_program program, cl_device dev
     return 1;
     }
 
+/*---------------------------------------------------------------------------*/
+
+/* Parallel build of a set of programs.
+ *
+ * Programs are created in the calling thread, then built by a pool of native
+ * threads, each taking the next program from a shared counter and calling
+ * clBuildProgram() on it (useful with drivers whose compiler runs in the calling
+ * thread). Logs are collected back in the calling thread.
+ */
+
+#define MAX_BUILD_THREADS 64
+
+typedef struct {
+    cl_program program;
+    cl_uint num_devices;
+    cl_device *devices; /* NULL = all the context's devices */
+    const char *options;
+    cl_int ec;
+} buildjob_t;
+
+typedef struct {
+    buildjob_t *jobs;
+    cl_uint count;
+    cl_uint next; /* next job to take (atomic) */
+} buildqueue_t;
+
+static void *BuildWorker(void *arg)
+    {
+    buildjob_t *job;
+    buildqueue_t *queue = (buildqueue_t*)arg;
+    cl_uint i;
+    while((i = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED)) < queue->count)
+        {
+        job = &queue->jobs[i];
+        job->ec = cl.BuildProgram(job->program, job->num_devices, job->devices, job->options, NULL, NULL);
+        }
+    return NULL;
+    }
+
+static void RunBuilds(buildqueue_t *queue, int nthreads)
+    {
+#if defined(LINUX)
+    int i;
+    pthread_t tid[MAX_BUILD_THREADS];
+    int started[MAX_BUILD_THREADS];
+    for(i = 1; i < nthreads; i++)
+        started[i] = (pthread_create(&tid[i], NULL, BuildWorker, queue) == 0);
+    BuildWorker(queue); /* the calling thread takes part too */
+    for(i = 1; i < nthreads; i++)
+        if(started[i]) pthread_join(tid[i], NULL);
+#else
+    (void)nthreads;
+    BuildWorker(queue);
+#endif
+    }
+
+static int DefaultBuildThreads(void)
+    {
+#if defined(LINUX)
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#else
+    return 1;
+#endif
+    }
+
+static void PushBuildError(lua_State *L, buildjob_t *job)
+/* Pushes the error message for a failed build, with the devices' logs */
+    {
+    cl_int ec;
+    cl_uint count, i;
+    cl_device *devices;
+    int top = lua_gettop(L);
+    pusherrcode(L, job->ec);
+    if(job->ec == CL_BUILD_PROGRAM_FAILURE)
+        {
+        ec = cl.GetProgramInfo(job->program, CL_PROGRAM_NUM_DEVICES, sizeof(count), &count, NULL);
+        if(!ec && count > 0)
+            {
+            devices = (cl_device*)Malloc(L, count * sizeof(cl_device));
+            ec = cl.GetProgramInfo(job->program, CL_PROGRAM_DEVICES, count * sizeof(cl_device), devices, NULL);
+            for(i = 0; i < count && !ec; i++)
+                {
+                lua_pushfstring(L, "\ndevice-%d log:\n", i+1);
+                GetProgramBuildString(L, job->program, devices[i], CL_PROGRAM_BUILD_LOG);
+                }
+            Free(L, devices);
+            }
+        }
+    lua_concat(L, lua_gettop(L) - top);
+    }
+
+static int BuildPrograms(lua_State *L)
+/* {program}, {errmsg}|nil = build_programs({{context, source, [options], [{device}]}}, [nthreads]) */
+    {
+    int err, nthreads, nfailed = 0;
+    cl_int ec;
+    cl_uint count, i, j;
+    size_t length;
+    const char *source;
+    cl_context context;
+    buildjob_t *jobs;
+    buildqueue_t queue;
+    ScratchReset(L);
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    nthreads = luaL_optinteger(L, 2, DefaultBuildThreads());
+    count = luaL_len(L, 1);
+    if(nthreads < 1) nthreads = 1;
+    if(nthreads > MAX_BUILD_THREADS) nthreads = MAX_BUILD_THREADS;
+    if((cl_uint)nthreads > count) nthreads = count;
+
+    lua_newtable(L); /* programs (keep them anchored, in case of errors) */
+    if(count == 0) return 1;
+    jobs = (buildjob_t*)Malloc(L, count * sizeof(buildjob_t));
+    memset(jobs, 0, count * sizeof(buildjob_t));
+
+#define CLEANUP() do {                                                  \
+    for(j = 0; j < count; j++) if(jobs[j].devices) Free(L, jobs[j].devices); \
+    Free(L, jobs);                                                      \
+} while(0)
+#define ENTRYERROR(msg) do {                                            \
+    CLEANUP();                                                          \
+    return luaL_error(L, "bad entry #%d in build list (%s)", i+1, (msg)); \
+} while(0)
+
+    for(i = 0; i < count; i++)
+        {
+        if(lua_rawgeti(L, 1, i+1) != LUA_TTABLE) ENTRYERROR("table expected");
+        lua_rawgeti(L, -1, 1);
+        context = testcontext(L, -1, NULL);
+        if(!context) ENTRYERROR("context expected");
+        lua_rawgeti(L, -2, 2);
+        source = lua_tolstring(L, -1, &length);
+        if(!source || lua_type(L, -1) != LUA_TSTRING) ENTRYERROR("source string expected");
+        lua_rawgeti(L, -3, 3);
+        jobs[i].options = lua_tostring(L, -1); /* anchored by the list */
+        if(!lua_isnil(L, -1) && (lua_type(L, -1) != LUA_TSTRING)) ENTRYERROR("options string expected");
+        lua_rawgeti(L, -4, 4);
+        jobs[i].devices = checkdevicelist(L, lua_absindex(L, -1), &jobs[i].num_devices, &err);
+        if(err < 0) ENTRYERROR(errstring(err));
+        lua_pop(L, 5);
+
+        jobs[i].program = cl.CreateProgramWithSource(context, 1, &source, &length, &ec);
+        if(ec)
+            { CLEANUP(); CheckError(L, ec); return 0; }
+        newprogram(L, context, jobs[i].program);
+        lua_rawseti(L, -2, i+1);
+        }
+
+    queue.jobs = jobs;
+    queue.count = count;
+    queue.next = 0;
+    RunBuilds(&queue, nthreads);
+
+    for(i = 0; i < count; i++)
+        {
+        if(!jobs[i].ec) continue;
+        if(nfailed++ == 0) lua_newtable(L); /* errors */
+        PushBuildError(L, &jobs[i]);
+        lua_rawseti(L, -2, i+1);
+        }
+    CLEANUP();
+#undef ENTRYERROR
+#undef CLEANUP
+    return nfailed > 0 ? 2 : 1;
+    }
+
 static int GetProgramBuildSize(lua_State *L, cl_program program, cl_device device, cl_program_build_info name)
     {
     size_t value;
@@ -560,6 +908,10 @@ static const struct luaL_Reg Functions[] =
         { "retain_program", Retain },
         { "release_program", Release },
         { "build_program_", BuildProgram },
+        { "build_program_async", BuildProgramAsync },
+        { "check_build", CheckBuild },
+        { "wait_builds", WaitBuilds },
+        { "build_programs", BuildPrograms },
         { "compile_program_", CompileProgram },
         { "link_program_", LinkProgram },
         { "unload_platform_compiler", UnloadPlatformCompiler },
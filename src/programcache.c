@@ -0,0 +1,436 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Stefano Trettel
+ *
+ * Software repository: MoonCL, https://github.com/stetre/mooncl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define _DEFAULT_SOURCE
+#include "internal.h"
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <errno.h>
+
+/* On-disk cache of program binaries.
+ *
+ * Each entry holds the binary of a program for a single device, and is keyed by
+ * the program source, the build options, and the device/driver/platform names
+ * and versions. The file name is a 64-bit hash of the key; the file contains
+ * the full key (except the source, which is verified by its length and a second
+ * hash), so that a hash collision results in a miss rather than in a wrong binary.
+ * Files are written to a temporary name and then renamed, so that concurrent
+ * processes never see a partially written entry.
+ *
+ * File format:
+ * "MOONCLB1" | keylen (u64) | key | srclen (u64) | srchash (u64) | binlen (u64) | binary
+ */
+
+#define MAGIC "MOONCLB1"
+#define MAGIC_LEN 8
+
+static char *CacheDir = NULL; /* NULL if the cache is disabled */
+static size_t Hits = 0;     /* programs loaded from the cache */
+static size_t Misses = 0;   /* programs not (or not entirely) in the cache */
+static size_t Invalid = 0;  /* cached binaries rejected by the driver */
+static size_t Stores = 0;   /* binaries written to the cache */
+
+/* FNV-1a (the second hash uses a different offset basis, and is only used for verification) */
+#define FNV_PRIME 0x100000001b3ULL
+#define FNV_BASIS1 0xcbf29ce484222325ULL
+#define FNV_BASIS2 0x84222325cbf29ce4ULL
+
+static uint64_t Hash(uint64_t h, const void *data, size_t len)
+    {
+    const unsigned char *p = (const unsigned char*)data;
+    size_t i;
+    for(i = 0; i < len; i++)
+        { h ^= p[i]; h *= FNV_PRIME; }
+    return h;
+    }
+
+static int AddDeviceString(lua_State *L, luaL_Buffer *b, cl_device device, cl_device_info name)
+    {
+    cl_int ec;
+    size_t size;
+    char *value;
+    ec = cl.GetDeviceInfo(device, name, 0, NULL, &size);
+    if(ec) return ec;
+    value = (char*)MallocNoErr(L, size + 1);
+    if(!value) return CL_OUT_OF_HOST_MEMORY;
+    ec = cl.GetDeviceInfo(device, name, size, value, NULL);
+    if(ec) { Free(L, value); return ec; }
+    value[size] = '\0';
+    luaL_addstring(b, value);
+    luaL_addchar(b, '\n');
+    Free(L, value);
+    return 0;
+    }
+
+static int AddPlatformString(lua_State *L, luaL_Buffer *b, cl_platform platform, cl_platform_info name)
+    {
+    cl_int ec;
+    size_t size;
+    char *value;
+    ec = cl.GetPlatformInfo(platform, name, 0, NULL, &size);
+    if(ec) return ec;
+    value = (char*)MallocNoErr(L, size + 1);
+    if(!value) return CL_OUT_OF_HOST_MEMORY;
+    ec = cl.GetPlatformInfo(platform, name, size, value, NULL);
+    if(ec) { Free(L, value); return ec; }
+    value[size] = '\0';
+    luaL_addstring(b, value);
+    luaL_addchar(b, '\n');
+    Free(L, value);
+    return 0;
+    }
+
+static cl_int PushKey(lua_State *L, cl_device device, const char *options)
+/* Pushes the key string (except the source) for the given device.
+ * Does not raise OpenCL errors, so that the callers can release their resources first:
+ * on error, returns the error code and leaves garbage on the stack (the callers restore
+ * their top).
+ */
+    {
+    cl_int ec;
+    cl_platform platform;
+    luaL_Buffer b;
+    ec = cl.GetDeviceInfo(device, CL_DEVICE_PLATFORM, sizeof(platform), &platform, NULL);
+    if(ec) return ec;
+    luaL_buffinit(L, &b);
+    luaL_addstring(&b, "options=");
+    luaL_addstring(&b, options ? options : "");
+    luaL_addchar(&b, '\n');
+    if((ec = AddPlatformString(L, &b, platform, CL_PLATFORM_NAME)) ||
+       (ec = AddPlatformString(L, &b, platform, CL_PLATFORM_VERSION)) ||
+       (ec = AddDeviceString(L, &b, device, CL_DEVICE_NAME)) ||
+       (ec = AddDeviceString(L, &b, device, CL_DEVICE_VENDOR)) ||
+       (ec = AddDeviceString(L, &b, device, CL_DEVICE_VERSION)) ||
+       (ec = AddDeviceString(L, &b, device, CL_DRIVER_VERSION)))
+        return ec;
+    luaL_pushresult(&b);
+    return 0;
+    }
+
+static const char *PushPath(lua_State *L, const char *source, size_t srclen, const char *key, size_t keylen)
+/* Pushes the path of the cache entry */
+    {
+    uint64_t h = Hash(FNV_BASIS1, source, srclen);
+    h = Hash(h, key, keylen);
+    return lua_pushfstring(L, "%s/%s.bin", CacheDir,
+        lua_pushfstring(L, "%08x%08x", (unsigned)(h >> 32), (unsigned)(h & 0xffffffff)));
+    }
+
+static void PutU64(luaL_Buffer *b, uint64_t val)
+    {
+    luaL_addlstring(b, (const char*)&val, sizeof(val));
+    }
+
+static int GetU64(const char **p, const char *end, uint64_t *val)
+    {
+    if((size_t)(end - *p) < sizeof(uint64_t)) return 0;
+    memcpy(val, *p, sizeof(uint64_t));
+    *p += sizeof(uint64_t);
+    return 1;
+    }
+
+static char *ReadEntry(lua_State *L, const char *path, const char *source, size_t srclen,
+        const char *key, size_t keylen, size_t *binlen)
+/* Reads and validates a cache entry. Returns the binary (to be released with Free()), or NULL */
+    {
+    FILE *f;
+    long size;
+    char *data, *bin;
+    const char *p, *end;
+    uint64_t len, hash;
+
+    if((f = fopen(path, "rb")) == NULL) return NULL;
+    if(fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) != 0)
+        { fclose(f); return NULL; }
+    data = (char*)MallocNoErr(L, size > 0 ? size : 1);
+    if(!data) { fclose(f); return NULL; }
+    if(fread(data, 1, size, f) != (size_t)size)
+        { fclose(f); Free(L, data); return NULL; }
+    fclose(f);
+
+#define FAIL() do { Free(L, data); return NULL; } while(0)
+    p = data; end = data + size;
+    if(size < MAGIC_LEN || memcmp(p, MAGIC, MAGIC_LEN) != 0) FAIL();
+    p += MAGIC_LEN;
+    if(!GetU64(&p, end, &len) || len != keylen || (size_t)(end - p) < len || memcmp(p, key, len) != 0) FAIL();
+    p += len;
+    if(!GetU64(&p, end, &len) || len != srclen) FAIL();
+    if(!GetU64(&p, end, &hash) || hash != Hash(FNV_BASIS2, source, srclen)) FAIL();
+    if(!GetU64(&p, end, &len) || len == 0 || (uint64_t)(end - p) != len) FAIL();
+#undef FAIL
+    bin = (char*)MallocNoErr(L, len);
+    if(bin) memcpy(bin, p, len);
+    *binlen = len;
+    Free(L, data);
+    return bin;
+    }
+
+static int WriteEntry(lua_State *L, const char *path, const char *source, size_t srclen,
+        const char *key, size_t keylen, const char *bin, size_t binlen)
+/* Writes a cache entry atomically. Returns 0 on success */
+    {
+    FILE *f;
+    size_t len;
+    const char *data, *tmppath;
+    int rc = -1;
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    luaL_addlstring(&b, MAGIC, MAGIC_LEN);
+    PutU64(&b, keylen);
+    luaL_addlstring(&b, key, keylen);
+    PutU64(&b, srclen);
+    PutU64(&b, Hash(FNV_BASIS2, source, srclen));
+    PutU64(&b, binlen);
+    luaL_addlstring(&b, bin, binlen);
+    luaL_pushresult(&b);
+    data = lua_tolstring(L, -1, &len);
+    tmppath = lua_pushfstring(L, "%s.%d.tmp", path, (int)getpid());
+    if((f = fopen(tmppath, "wb")) != NULL)
+        {
+        if(fwrite(data, 1, len, f) == len && fflush(f) == 0)
+            rc = 0;
+        if(fclose(f) != 0)
+            rc = -1;
+        if(rc == 0)
+            rc = rename(tmppath, path);
+        if(rc != 0)
+            remove(tmppath);
+        }
+    lua_pop(L, 2);
+    return rc;
+    }
+
+static int ContextDevices(lua_State *L, cl_context context, cl_device **devices, cl_uint *count)
+    {
+    cl_int ec;
+    size_t size;
+    ec = cl.GetContextInfo(context, CL_CONTEXT_DEVICES, 0, NULL, &size);
+    CheckError(L, ec);
+    *count = size / sizeof(cl_device);
+    *devices = (cl_device*)Malloc(L, size > 0 ? size : 1);
+    ec = cl.GetContextInfo(context, CL_CONTEXT_DEVICES, size, *devices, NULL);
+    if(ec) { Free(L, *devices); CheckError(L, ec); }
+    return 0;
+    }
+
+static int Load(lua_State *L)
+/* program | nil = program_cache_load(context, source, [devices], [options]) */
+    {
+    int err;
+    cl_int ec;
+    cl_uint count, i, nfound = 0;
+    size_t srclen, keylen;
+    cl_device *devices;
+    char **binaries;
+    size_t *lengths;
+    const char *key, *path;
+    cl_program program = NULL;
+    int top = lua_gettop(L);
+    cl_context context = checkcontext(L, 1, NULL);
+    const char *source = luaL_checklstring(L, 2, &srclen);
+    const char *options = luaL_optstring(L, 4, NULL);
+    ScratchReset(L);
+
+    if(!CacheDir)
+        { lua_pushnil(L); return 1; }
+    devices = checkdevicelist(L, 3, &count, &err);
+    if(err == ERR_NOTPRESENT)
+        ContextDevices(L, context, &devices, &count);
+    else if(err)
+        return luaL_argerror(L, 3, errstring(err));
+
+    if(count == 0)
+        { Free(L, devices); Misses++; lua_pushnil(L); return 1; }
+
+#define CLEANUP() do {                                          \
+    if(binaries) for(i = 0; i < nfound; i++) Free(L, binaries[i]); \
+    Free(L, binaries);                                          \
+    Free(L, lengths);                                           \
+    Free(L, devices);                                           \
+} while(0)
+    binaries = (char**)MallocNoErr(L, count * sizeof(char*));
+    lengths = (size_t*)MallocNoErr(L, count * sizeof(size_t));
+    if(!binaries || !lengths)
+        { CLEANUP(); return luaL_error(L, errstring(ERR_MEMORY)); }
+    for(i = 0; i < count; i++)
+        {
+        if((ec = PushKey(L, devices[i], options)) != CL_SUCCESS)
+            { lua_settop(L, top); CLEANUP(); CheckError(L, ec); return 0; }
+        key = lua_tolstring(L, -1, &keylen);
+        path = PushPath(L, source, srclen, key, keylen);
+        binaries[i] = ReadEntry(L, path, source, srclen, key, keylen, &lengths[i]);
+        lua_settop(L, top);
+        if(!binaries[i]) break;
+        nfound++;
+        }
+
+    if(nfound == count)
+        {
+        program = cl.CreateProgramWithBinary(context, count, devices, lengths,
+                (const unsigned char **)binaries, NULL, &ec);
+        if(!ec)
+            {
+            ec = cl.BuildProgram(program, count, devices, options, NULL, NULL);
+            if(ec)
+                { cl.ReleaseProgram(program); program = NULL; }
+            }
+        else
+            program = NULL;
+        if(!program) Invalid++; /* e.g. CL_INVALID_BINARY after a driver update */
+        }
+
+    CLEANUP();
+#undef CLEANUP
+
+    if(!program)
+        { Misses++; lua_pushnil(L); return 1; }
+    Hits++;
+    newprogram(L, context, program);
+    return 1;
+    }
+
+static int Store(lua_State *L)
+/* nstored = program_cache_store(program, source, [options]) */
+    {
+    cl_int ec;
+    ud_t *ud;
+    cl_uint count, i;
+    size_t srclen, keylen, total = 0, nstored = 0;
+    cl_device *devices;
+    size_t *sizes;
+    char **binaries, *bin;
+    const char *key, *path;
+    int top = lua_gettop(L);
+    cl_program program = checkprogram(L, 1, &ud);
+    const char *source = luaL_checklstring(L, 2, &srclen);
+    const char *options = luaL_optstring(L, 3, NULL);
+
+    if(!CacheDir)
+        { lua_pushinteger(L, 0); return 1; }
+    ec = cl.GetProgramInfo(program, CL_PROGRAM_NUM_DEVICES, sizeof(count), &count, NULL);
+    CheckError(L, ec);
+    if(count == 0)
+        { lua_pushinteger(L, 0); return 1; }
+
+    devices = (cl_device*)MallocNoErr(L, count * sizeof(cl_device));
+    sizes = (size_t*)MallocNoErr(L, count * sizeof(size_t));
+    binaries = (char**)MallocNoErr(L, count * sizeof(char*));
+#define CLEANUP() do { Free(L, devices); Free(L, sizes); Free(L, binaries); } while(0)
+    if(!devices || !sizes || !binaries)
+        { CLEANUP(); return luaL_error(L, errstring(ERR_MEMORY)); }
+    ec = cl.GetProgramInfo(program, CL_PROGRAM_DEVICES, count * sizeof(cl_device), devices, NULL);
+    if(!ec)
+        ec = cl.GetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, count * sizeof(size_t), sizes, NULL);
+    if(ec)
+        { CLEANUP(); CheckError(L, ec); return 0; }
+    for(i = 0; i < count; i++) total += sizes[i];
+    bin = (char*)MallocNoErr(L, total > 0 ? total : 1);
+    if(!bin)
+        { CLEANUP(); return luaL_error(L, errstring(ERR_MEMORY)); }
+    binaries[0] = bin;
+    for(i = 1; i < count; i++)
+        binaries[i] = binaries[i-1] + sizes[i-1];
+    ec = cl.GetProgramInfo(program, CL_PROGRAM_BINARIES, count * sizeof(char*), binaries, NULL);
+    if(ec)
+        { Free(L, bin); CLEANUP(); CheckError(L, ec); return 0; }
+
+    for(i = 0; i < count; i++)
+        {
+        if(sizes[i] == 0) continue; /* not built for this device */
+        if((ec = PushKey(L, devices[i], options)) != CL_SUCCESS)
+            { lua_settop(L, top); Free(L, bin); CLEANUP(); CheckError(L, ec); return 0; }
+        key = lua_tolstring(L, -1, &keylen);
+        path = PushPath(L, source, srclen, key, keylen);
+        if(WriteEntry(L, path, source, srclen, key, keylen, binaries[i], sizes[i]) == 0)
+            { nstored++; Stores++; }
+        lua_settop(L, top);
+        }
+    Free(L, bin);
+    CLEANUP();
+#undef CLEANUP
+    lua_pushinteger(L, nstored);
+    return 1;
+    }
+
+static int SetDir(lua_State *L, const char *dir)
+    {
+    if(CacheDir)
+        { Free(L, CacheDir); CacheDir = NULL; }
+    if(!dir || dir[0] == '\0') return 0;
+#if defined(MINGW)
+    if(mkdir(dir) != 0 && errno != EEXIST)
+#else
+    if(mkdir(dir, 0755) != 0 && errno != EEXIST)
+#endif
+        return -1;
+    CacheDir = (char*)Malloc(L, strlen(dir) + 1);
+    strcpy(CacheDir, dir);
+    return 0;
+    }
+
+static int ProgramCache(lua_State *L)
+/* dir = program_cache([dir | false]) */
+    {
+    if(!lua_isnone(L, 1))
+        {
+        const char *dir = lua_toboolean(L, 1) ? luaL_checkstring(L, 1) : NULL;
+        if(SetDir(L, dir) != 0)
+            return luaL_error(L, "cannot create '%s': %s", dir, strerror(errno));
+        }
+    if(!CacheDir) return 0;
+    lua_pushstring(L, CacheDir);
+    return 1;
+    }
+
+static int ProgramCacheStats(lua_State *L)
+/* {stats} = program_cache_stats() */
+    {
+    lua_newtable(L);
+#define F(name, val) do { lua_pushinteger(L, (val)); lua_setfield(L, -2, name); } while(0)
+    F("hits", Hits);
+    F("misses", Misses);
+    F("invalid", Invalid);
+    F("stores", Stores);
+#undef F
+    return 1;
+    }
+
+static const struct luaL_Reg Functions[] = 
+    {
+        { "program_cache", ProgramCache },
+        { "program_cache_stats", ProgramCacheStats },
+        { "program_cache_load", Load },
+        { "program_cache_store", Store },
+        { NULL, NULL } /* sentinel */
+    };
+
+void mooncl_open_programcache(lua_State *L)
+    {
+    const char *dir = getenv("MOONCL_PROGRAM_CACHE");
+    if(dir) SetDir(L, dir);
+    luaL_setfuncs(L, Functions, 0);
+    }
+
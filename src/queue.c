@@ -37,11 +37,10 @@ static int freequeue(lua_State *L, ud_t *ud)
 static int newqueue(lua_State *L, cl_queue queue, cl_context context, cl_device device)
     {
     ud_t *ud;
-    ud = newuserdata(L, queue, COMMAND_QUEUE_MT, "queue");
+    ud = newuserdata(L, queue, UD(context), COMMAND_QUEUE_MT, "queue");
     ud->platform = UD(context)->platform;
     ud->context = context;
     ud->device = device;
-    ud->parent_ud = UD(context);
     ud->clext = ud->parent_ud->clext;
     ud->destructor = freequeue;  
     return 1;
@@ -36,9 +36,8 @@ static int freesampler(lua_State *L, ud_t *ud)
 static int newsampler(lua_State *L, cl_context context, cl_sampler sampler)
     {
     ud_t *ud;
-    ud = newuserdata(L, sampler, SAMPLER_MT, "sampler");
+    ud = newuserdata(L, sampler, UD(context), SAMPLER_MT, "sampler");
     ud->context = context;
-    ud->parent_ud = UD(context);
     ud->clext = ud->parent_ud->clext;
     ud->destructor = freesampler;  
     return 1;
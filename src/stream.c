@@ -0,0 +1,251 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Stefano Trettel
+ *
+ * Software repository: MoonCL, https://github.com/stetre/mooncl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "internal.h"
+
+/* Streaming of a large hostmem through a set of device buffers.
+ *
+ * The source is split in chunks that are assigned round-robin to the buffers
+ * (slots). For each chunk, a non-blocking write to the slot's buffer is enqueued,
+ * followed by a launch of the kernel on it and, optionally, by a non-blocking read
+ * of the results back into a destination hostmem. The write for a chunk waits for
+ * the last command enqueued on the same slot, so that with two or more slots on
+ * different queues (or on an out-of-order queue) the transfer of a chunk overlaps
+ * with the processing of the previous one.
+ */
+
+typedef struct {
+    cl_kernel kernel;
+    cl_uint buffer_arg; /* index of the kernel arg receiving the slot's buffer */
+    cl_uint count_arg;  /* index of the kernel arg receiving the no. of elements (if has_count) */
+    int has_count;
+    size_t elem_size;   /* bytes per work-item */
+    size_t local_size;  /* 0 = let the implementation choose */
+    char *dst;          /* destination host memory (or NULL) */
+    size_t dst_size;
+    int callback;       /* index of the callback function on the stack (or 0) */
+} streamspec_t;
+
+static int CheckSpec(lua_State *L, int arg, streamspec_t *spec)
+    {
+    lua_Integer n;
+    cl_hostmem dst;
+    ud_t *dst_ud;
+    memset(spec, 0, sizeof(streamspec_t));
+    luaL_checktype(L, arg, LUA_TTABLE);
+
+    lua_getfield(L, arg, "kernel");
+    spec->kernel = testkernel(L, -1, NULL);
+    if(!spec->kernel)
+        return luaL_argerror(L, arg, "missing or invalid 'kernel' field");
+    lua_pop(L, 1);
+
+#define OPTINT(field, dflt, minval) do {                                            \
+    lua_getfield(L, arg, field);                                                    \
+    n = lua_isnil(L, -1) ? (dflt) : lua_tointeger(L, -1);                           \
+    if(!lua_isnil(L, -1) && (!lua_isinteger(L, -1) || n < (minval)))                \
+        return luaL_argerror(L, arg, "invalid '"field"' field");                    \
+    lua_pop(L, 1);                                                                  \
+} while(0)
+    OPTINT("buffer_arg", 0, 0);
+    spec->buffer_arg = n;
+    OPTINT("count_arg", -1, 0);
+    spec->has_count = (n >= 0);
+    spec->count_arg = spec->has_count ? n : 0;
+    OPTINT("elem_size", 1, 1);
+    spec->elem_size = n;
+    OPTINT("local_size", 0, 1);
+    spec->local_size = n;
+#undef OPTINT
+
+    lua_getfield(L, arg, "dst");
+    if(!lua_isnil(L, -1))
+        {
+        dst = testhostmem(L, -1, &dst_ud);
+        if(!dst)
+            return luaL_argerror(L, arg, "invalid 'dst' field");
+        if(IsReadOnly(dst_ud))
+            return luaL_argerror(L, arg, "read-only 'dst' hostmem");
+        spec->dst = dst->ptr;
+        spec->dst_size = dst->size;
+        }
+    lua_pop(L, 1);
+
+    lua_getfield(L, arg, "callback");
+    if(lua_isnil(L, -1))
+        lua_pop(L, 1);
+    else if(lua_isfunction(L, -1))
+        spec->callback = lua_gettop(L); /* leave it on the stack */
+    else
+        return luaL_argerror(L, arg, "invalid 'callback' field");
+    return 0;
+    }
+
+static void WaitAndRelease(cl_event *events, cl_uint n)
+/* Waits for the outstanding events and releases them */
+    {
+    cl_uint i;
+    for(i = 0; i < n; i++)
+        {
+        if(!events[i]) continue;
+        cl.WaitForEvents(1, &events[i]);
+        cl.ReleaseEvent(events[i]);
+        events[i] = NULL;
+        }
+    }
+
+static int Stream(lua_State *L)
+/* nchunks = stream(queue|{queue}, src, {buffer}, chunk_size, spec) */
+    {
+    int err;
+    cl_int ec = CL_SUCCESS;
+    cl_uint nqueues, nslots = 0, slot, chunk;
+    cl_uint count;
+    size_t offset, size, global_size, local_size, mark;
+    cl_queue queue, *queues = NULL;
+    cl_buffer *buffers = NULL;
+    cl_event *last = NULL; /* last event on each slot */
+    cl_event write_event, kernel_event, read_event;
+    streamspec_t spec;
+    cl_hostmem src = checkhostmem(L, 2, NULL);
+    size_t chunk_size = luaL_checkinteger(L, 4);
+#define CLEANUP() do {                                  \
+    if(last) WaitAndRelease(last, nslots);              \
+    Free(L, last);                                      \
+    Free(L, buffers);                                   \
+    Free(L, queues);                                    \
+} while(0)
+
+    ScratchReset(L);
+    if(chunk_size == 0)
+        return luaL_argerror(L, 4, errstring(ERR_VALUE));
+    CheckSpec(L, 5, &spec);
+    if(spec.dst && spec.dst_size < src->size)
+        return luaL_argerror(L, 5, "destination hostmem is too small");
+
+    queue = testqueue(L, 1, NULL);
+    if(queue)
+        {
+        queues = (cl_queue*)Malloc(L, sizeof(cl_queue));
+        queues[0] = queue;
+        nqueues = 1;
+        }
+    else
+        {
+        queues = checkqueuelist(L, 1, &nqueues, &err);
+        if(err)
+            return luaL_argerror(L, 1, errstring(err));
+        }
+
+    buffers = checkbufferlist(L, 3, &nslots, &err);
+    if(err)
+        { CLEANUP(); return luaL_argerror(L, 3, errstring(err)); }
+    for(slot = 0; slot < nslots; slot++)
+        {
+        if(!testbufferboundaries(L, buffers[slot], 0, chunk_size))
+            { CLEANUP(); return luaL_argerror(L, 3, "buffers must be at least chunk_size bytes"); }
+        }
+
+    last = (cl_event*)MallocNoErr(L, nslots * sizeof(cl_event));
+    if(!last)
+        { CLEANUP(); return luaL_error(L, errstring(ERR_MEMORY)); }
+    memset(last, 0, nslots * sizeof(cl_event));
+
+    for(chunk = 0, offset = 0; offset < src->size; chunk++, offset += size)
+        {
+        slot = chunk % nslots;
+        queue = queues[slot % nqueues];
+        size = src->size - offset;
+        if(size > chunk_size) size = chunk_size;
+
+        ec = cl.EnqueueWriteBuffer(queue, buffers[slot], CL_FALSE, 0, size, src->ptr + offset,
+                last[slot] ? 1 : 0, last[slot] ? &last[slot] : NULL, &write_event);
+        if(ec) break;
+        if(last[slot]) cl.ReleaseEvent(last[slot]);
+        last[slot] = write_event;
+
+        ec = cl.SetKernelArg(spec.kernel, spec.buffer_arg, sizeof(cl_mem), &buffers[slot]);
+        if(ec) break;
+        count = (size + spec.elem_size - 1) / spec.elem_size;
+        if(spec.has_count)
+            {
+            ec = cl.SetKernelArg(spec.kernel, spec.count_arg, sizeof(cl_uint), &count);
+            if(ec) break;
+            }
+        if(spec.callback)
+            {
+            lua_pushvalue(L, spec.callback);
+            lua_pushinteger(L, chunk + 1);
+            lua_pushinteger(L, offset);
+            lua_pushinteger(L, size);
+            mark = ScratchEnter(L); /* the callback may call other API functions */
+            err = lua_pcall(L, 3, 0, 0);
+            ScratchLeave(L, mark);
+            if(err != LUA_OK)
+                { CLEANUP(); return lua_error(L); }
+            }
+
+        local_size = spec.local_size;
+        global_size = count;
+        if(local_size > 0 && (global_size % local_size) != 0)
+            global_size += local_size - (global_size % local_size);
+        ec = cl.EnqueueNDRangeKernel(queue, spec.kernel, 1, NULL, &global_size,
+                local_size > 0 ? &local_size : NULL, 1, &last[slot], &kernel_event);
+        if(ec) break;
+        cl.ReleaseEvent(last[slot]);
+        last[slot] = kernel_event;
+
+        if(spec.dst)
+            {
+            ec = cl.EnqueueReadBuffer(queue, buffers[slot], CL_FALSE, 0, size, spec.dst + offset,
+                    1, &last[slot], &read_event);
+            if(ec) break;
+            cl.ReleaseEvent(last[slot]);
+            last[slot] = read_event;
+            }
+
+        /* Flush so that the device can start working on this chunk while
+         * the next ones are being enqueued on the other queues. */
+        if(nqueues > 1) cl.Flush(queue);
+        }
+
+    CLEANUP();
+    CheckError(L, ec);
+    lua_pushinteger(L, chunk);
+    return 1;
+#undef CLEANUP
+    }
+
+static const struct luaL_Reg Functions[] = 
+    {
+        { "stream", Stream },
+        { NULL, NULL } /* sentinel */
+    };
+
+void mooncl_open_stream(lua_State *L)
+    {
+    luaL_setfuncs(L, Functions, 0);
+    }
+
@@ -41,9 +41,8 @@ static int freesvm(lua_State *L, ud_t *ud)
 static int newsvm(lua_State *L, cl_context context, cl_svm svm)
     {
     ud_t *ud;
-    ud = newuserdata(L, svm, SVM_MT, "svm");
+    ud = newuserdata(L, svm, UD(context), SVM_MT, "svm");
     ud->context = context;
-    ud->parent_ud = UD(context);
     ud->clext = ud->parent_ud->clext;
     ud->destructor = freesvm;
     return 1;
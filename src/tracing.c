@@ -33,6 +33,7 @@ static int Type(lua_State *L)
     TRY(context);
     TRY(queue);
     TRY(buffer);
+    TRY(bufferpool);
     TRY(image);
     TRY(pipe);
     TRY(program);
@@ -40,7 +41,11 @@ static int Type(lua_State *L)
     TRY(event);
     TRY(sampler);
     TRY(svm);
+    TRY(array); /* before hostmem, since arrays are also hostmems */
     TRY(hostmem);
+    TRY(hostmempool);
+    TRY(graph);
+    TRY(argset);
     return 0;
 #undef TRY
     }
@@ -66,6 +71,16 @@ static int Since(lua_State *L)
     return 1;
     }
 
+static int ScratchStats(lua_State *L)
+    {
+    size_t hits, misses, inuse;
+    scratchstats(L, &hits, &misses, &inuse);
+    lua_pushinteger(L, hits);
+    lua_pushinteger(L, misses);
+    lua_pushinteger(L, inuse);
+    return 3;
+    }
+
 /* ----------------------------------------------------------------------- */
 
 static const struct luaL_Reg Functions[] = 
@@ -74,6 +89,7 @@ static const struct luaL_Reg Functions[] =
         { "trace_objects", TraceObjects },
         { "now", Now },
         { "since", Since },
+        { "scratch_stats", ScratchStats },
         { NULL, NULL } /* sentinel */
     };
 
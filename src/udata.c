@@ -25,14 +25,22 @@
 
 #include <string.h>
 #include <stdlib.h>
-#include "tree.h"
 #include "udata.h"
 #include "lua.h"
 #include "lauxlib.h"
 #include "lualib.h"
 
+/* The udata database is an open-addressing hash table (linear probing) that maps
+ * object ids to udata_t nodes. The nodes are not allocated separately: each one
+ * is embedded in the memory block of the Lua userdata it refers to, right after
+ * the area used by the caller (so the pointer returned by udata_new() is still 
+ * the one returned by lua_newuserdata(), as expected by luaL_testudata() & co.).
+ *
+ * Deleted entries are replaced by a tombstone, so that entries never move while
+ * the table is being scanned (udata_scan callbacks may delete objects).
+ */
+
 struct mooncl_udata_s {
-    RB_ENTRY(mooncl_udata_s) entry;
     uint64_t id; /* object id (search key) */
     /* references on the Lua registry */
     int ref;    /* the correspoding userdata */
@@ -42,34 +50,101 @@ struct mooncl_udata_s {
 
 #define UNEXPECTED_ERROR "unexpected error (%s, %d)", __FILE__, __LINE__
 
-static int cmp(udata_t *udata1, udata_t *udata2) /* the compare function */
-    { return (udata1->id < udata2->id ? -1 : udata1->id > udata2->id); } 
+#define MIN_CAPACITY 64 /* must be a power of 2 */
+#define NODE_OFFSET(size) (((size) + 7) & ~((size_t)7)) /* offset of the node in the block */
+
+static udata_t Tombstone_;
+#define TOMBSTONE (&Tombstone_)
 
-static RB_HEAD(udatatree_s, udata_s) Head = RB_INITIALIZER(&Head);
+static udata_t **Table = NULL;
+static size_t Capacity = 0; /* number of slots (a power of 2, or 0) */
+static size_t Count = 0;    /* number of live entries */
+static size_t Used = 0;     /* number of live entries + tombstones */
+static unsigned int Shift = 64;
+
+static size_t hash(uint64_t id)
+/* Fibonacci hashing (ids are mostly pointers, whose low bits are poorly distributed) */
+    { return (size_t)((id * UINT64_C(0x9E3779B97F4A7C15)) >> Shift); }
 
-RB_PROTOTYPE_STATIC(udatatree_s, udata_s, entry, cmp) 
-RB_GENERATE_STATIC(udatatree_s, udata_s, entry, cmp) 
- 
-static udata_t *udata_remove(udata_t *udata) 
-    { return RB_REMOVE(udatatree_s, &Head, udata); }
-static udata_t *udata_insert(udata_t *udata) 
-    { return RB_INSERT(udatatree_s, &Head, udata); }
 static udata_t *udata_search(uint64_t id) 
-    { udata_t tmp; tmp.id = id; return RB_FIND(udatatree_s, &Head, &tmp); }
-static udata_t *udata_first(uint64_t id) 
-    { udata_t tmp; tmp.id = id; return RB_NFIND(udatatree_s, &Head, &tmp); }
-#if 0
-static udata_t *udata_next(udata_t *udata)
-    { return RB_NEXT(udatatree_s, &Head, udata); }
-static udata_t *udata_prev(udata_t *udata)
-    { return RB_PREV(udatatree_s, &Head, udata); }
-static udata_t *udata_min(void)
-    { return RB_MIN(udatatree_s, &Head); }
-static udata_t *udata_max(void)
-    { return RB_MAX(udatatree_s, &Head); }
-static udata_t *udata_root(void)
-    { return RB_ROOT(&Head); }
-#endif
+    {
+    size_t i, mask = Capacity - 1;
+    udata_t *udata;
+    if(Count == 0) return NULL;
+    for(i = hash(id); (udata = Table[i]) != NULL; i = (i + 1) & mask)
+        {
+        if(udata != TOMBSTONE && udata->id == id)
+            return udata;
+        }
+    return NULL;
+    }
+
+static void place(udata_t **table, size_t capacity, unsigned int shift, udata_t *udata)
+    {
+    size_t mask = capacity - 1;
+    size_t i = (size_t)((udata->id * UINT64_C(0x9E3779B97F4A7C15)) >> shift);
+    while(table[i] != NULL && table[i] != TOMBSTONE)
+        i = (i + 1) & mask;
+    table[i] = udata;
+    }
+
+static int rehash(lua_State *L, size_t capacity)
+/* moves all the live entries to a new table with the given capacity */
+    {
+    size_t i;
+    unsigned int shift = 64;
+    udata_t **table = (udata_t**)MallocNoErr(L, capacity * sizeof(udata_t*));
+    if(!table) return -1;
+    for(i = capacity; i > 1; i >>= 1) shift--;
+    for(i = 0; i < Capacity; i++)
+        {
+        if(Table[i] != NULL && Table[i] != TOMBSTONE)
+            place(table, capacity, shift, Table[i]);
+        }
+    Free(L, Table);
+    Table = table;
+    Capacity = capacity;
+    Shift = shift;
+    Used = Count;
+    return 0;
+    }
+
+static int udata_insert(lua_State *L, udata_t *udata) 
+    {
+    size_t capacity;
+    if((Used + 1) * 4 > Capacity * 3) /* max load factor = 0.75 */
+        {
+        /* grow if at least half of the used slots are live, otherwise just get rid 
+         * of the tombstones */
+        capacity = Capacity < MIN_CAPACITY ? MIN_CAPACITY : Capacity;
+        while((Count + 1) * 2 > capacity) capacity *= 2;
+        if(rehash(L, capacity) != 0)
+            return -1;
+        }
+    place(Table, Capacity, Shift, udata);
+    Count++;
+    Used++;
+    return 0;
+    }
+
+static void udata_remove(udata_t *udata) 
+    {
+    size_t i, mask = Capacity - 1;
+    for(i = hash(udata->id); Table[i] != NULL; i = (i + 1) & mask)
+        {
+        if(Table[i] == udata)
+            {
+            /* if the next slot is empty no probe sequence goes through this one,
+             * so it can be emptied instead of tombstoned */
+            if(Table[(i + 1) & mask] == NULL)
+                { Table[i] = NULL; Used--; }
+            else
+                Table[i] = TOMBSTONE;
+            Count--;
+            return;
+            }
+        }
+    }
 
 void *udata_new(lua_State *L, size_t size, uint64_t id_, const char *mt)
 /* Creates a new Lua userdata, optionally sets its metatable to mt (if != NULL),
@@ -83,27 +158,31 @@ void *udata_new(lua_State *L, size_t size, uint64_t id_, const char *mt)
  */
     {
     udata_t *udata;
-    if((udata = (udata_t*)Malloc(L, sizeof(udata_t))) == NULL) 
-        { luaL_error(L, "cannot allocate memory"); return NULL; }
-    memset(udata, 0, sizeof(udata_t));
-    udata->mem = lua_newuserdata(L, size);
-    if(!udata->mem)
+    void *mem;
+    if(id_ != 0 && udata_search(id_))
+        { 
+        luaL_error(L, "duplicated object %I", id_); 
+        return NULL; 
+        }
+    mem = lua_newuserdata(L, NODE_OFFSET(size) + sizeof(udata_t));
+    if(!mem)
         {
-        Free(L, udata);
         luaL_error(L, "lua_newuserdata error"); 
         return NULL;
         }
+    udata = (udata_t*)((char*)mem + NODE_OFFSET(size));
+    memset(udata, 0, sizeof(udata_t));
+    udata->mem = mem;
     udata->id = id_ != 0 ? id_ : (uint64_t)(uintptr_t)(udata->mem);
-    if(udata_search(udata->id))
-        { 
-        Free(L, udata);
-        luaL_error(L, "duplicated object %I", id_); 
-        return NULL; 
-        }
     /* create a reference for later push's */
     lua_pushvalue(L, -1); /* the newly created userdata */
     udata->ref = luaL_ref(L, LUA_REGISTRYINDEX);
-    udata_insert(udata);
+    if(udata_insert(L, udata) != 0)
+        {
+        luaL_unref(L, LUA_REGISTRYINDEX, udata->ref);
+        luaL_error(L, "cannot allocate memory"); 
+        return NULL;
+        }
     if(mt)
         {
         udata->mt = mt;
@@ -146,8 +225,7 @@ int udata_free(lua_State *L, uint64_t id)
     if(udata->ref != LUA_NOREF)
         luaL_unref(L, LUA_REGISTRYINDEX, udata->ref);
     udata_remove(udata);
-    Free(L, udata);
-    /* mem is released by Lua at garbage collection */
+    /* mem (and the embedded node) is released by Lua at garbage collection */
     return 0;
     }
 
@@ -167,28 +245,27 @@ int udata_push(lua_State *L, uint64_t id)
 void udata_free_all(lua_State *L)
 /* free all without unreferencing (for atexit()) */
     {
-    udata_t *udata;
-    while((udata = udata_first(0)))
-        {
-        udata_remove(udata);
-        Free(L, udata);
-        }
+    Free(L, Table);
+    Table = NULL;
+    Capacity = Count = Used = 0;
+    Shift = 64;
     }
 
 int udata_scan(lua_State *L, const char *mt,  
             void *info, int (*func)(lua_State *L, const void *mem, const char* mt, const void *info))
 /* scans the udata database, and calls the func callback for every 'mt' object found
- * (the object may be deleted in the callback).
+ * (the object may be deleted in the callback, but no new object must be created).
  * func must return 0 to continue the scan, !=0 to interrupt it.
  * returns 1 if interrupted, 0 otherwise
  */
     {
     int stop = 0;
-    uint64_t id = 0;
+    size_t i;
     udata_t *udata;
-    while((udata = udata_first(id)))
+    for(i = 0; i < Capacity; i++)
         {
-        id = udata->id + 1;
+        udata = Table[i];
+        if(udata == NULL || udata == TOMBSTONE) continue;
         if(mt == udata->mt)
             {
             stop = func(L, (const void*)(udata->mem), mt, info);
@@ -201,8 +278,14 @@ int udata_scan(lua_State *L, const char *mt,
 
 static int is_subclass(lua_State *L, int arg, int mt_index)
     {
-    int ok;
-    if(luaL_getmetafield(L, arg, "__index") == LUA_TNIL)
+    int ok, t;
+    t = luaL_getmetafield(L, arg, "__index");
+    if(t == LUA_TFUNCTION) /* see udata_setindex() */
+        {
+        lua_pop(L, 1);
+        t = luaL_getmetafield(L, arg, "__methods");
+        }
+    if(t == LUA_TNIL)
         return 0;
     if(lua_rawequal(L, mt_index, lua_gettop(L)))
         {
@@ -277,6 +360,25 @@ int udata_inherit(lua_State *L, const char *sub, const char *super)
     return 0;
     }
 
+int udata_setindex(lua_State *L, const char *mt, lua_CFunction index)
+/* Replaces metatable(mt).__index with the index function, for types that need
+ * to handle non-method keys (e.g. array elements).
+ * The function gets the methods table (i.e. the former __index) as upvalue, to
+ * look up the other keys. The methods table is also saved in the __methods field,
+ * so that udata_test() can still follow the inheritance chain.
+ */
+    {
+    if(luaL_getmetatable(L, mt)!=LUA_TTABLE)
+        return luaL_error(L, "cannot find metatable '%s'", mt);
+    lua_getfield(L, -1, "__index");
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -3, "__methods");
+    lua_pushcclosure(L, index, 1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+    return 0;
+    }
+
 int udata_addmethods(lua_State *L, const char* mt, const luaL_Reg* methods)
 /* Adds methods to the metatable mt */
     {
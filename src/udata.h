@@ -36,6 +36,8 @@ extern "C" {
 #ifndef Malloc
 #define Malloc mooncl_Malloc
 void *Malloc(lua_State *L, size_t size);
+#define MallocNoErr mooncl_MallocNoErr
+void *MallocNoErr(lua_State *L, size_t size);
 #define Free mooncl_Free
 void Free(lua_State *L, void *ptr);
 #endif
@@ -65,6 +67,8 @@ int udata_define(lua_State*, const char*, const luaL_Reg*, const luaL_Reg*);
 int udata_inherit(lua_State*, const char*, const char*);
 #define udata_test mooncl_udata_test
 void *udata_test(lua_State*, int, const char*);
+#define udata_setindex mooncl_udata_setindex
+int udata_setindex(lua_State*, const char*, lua_CFunction);
 #define udata_addmethods mooncl_udata_addmethods
 int udata_addmethods(lua_State*, const char*, const luaL_Reg*);
 
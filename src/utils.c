@@ -105,11 +105,134 @@ char *Strdup(lua_State *L, const char *s)
     }
 
 
+/*------------------------------------------------------------------------------*
+ | Scratch arena                                                                |
+ *------------------------------------------------------------------------------*/
+
+/* Short-lived arrays (e.g. the wait lists and size lists marshalled by the enqueue
+ * functions) are bump-allocated from a scratch arena instead of the heap. Each
+ * lua_State has its own arena, stored in the registry and created when the module
+ * is loaded. The API functions that use it call ScratchReset() on entry, which
+ * releases anything left over by the previous call, including the blocks that an
+ * error path did not release. Scratch blocks are released with Free() as usual,
+ * which just ignores them. When the arena is full, ScratchAlloc() falls back to
+ * the heap.
+ * A function that calls back into Lua while holding scratch blocks must protect
+ * them with ScratchEnter()/ScratchLeave() around the (protected) call.
+ */
+#define SCRATCH_SIZE  (32*1024)
+#define SCRATCH_ALIGN 16
+typedef struct scratch_s {
+    struct scratch_s *next; /* next in the Arenas list */
+    size_t top;     /* first free byte */
+    size_t floor;   /* ScratchReset() resets top to this */
+    size_t hits;    /* no. of allocations served by the arena */
+    size_t misses;  /* no. of allocations that fell back to the heap */
+    union { char data[SCRATCH_SIZE]; long double align_; } mem;
+} scratch_t;
+
+static const char ScratchKey = 0; /* its address is the registry key for the arena */
+static scratch_t *Arenas = NULL; /* all the live arenas (Free() does not look them up by L) */
+
+#define IsScratch(s, ptr) \
+    (((char*)(ptr) >= (s)->mem.data) && ((char*)(ptr) < (s)->mem.data + SCRATCH_SIZE))
+
+static scratch_t *GetScratch(lua_State *L)
+    {
+    scratch_t *s;
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &ScratchKey);
+    s = (scratch_t*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return s;
+    }
+
+static int ScratchGC(lua_State *L)
+    {
+    scratch_t **pp, *s = (scratch_t*)lua_touserdata(L, 1);
+    for(pp = &Arenas; *pp; pp = &(*pp)->next)
+        if(*pp == s) { *pp = s->next; break; }
+    return 0;
+    }
+
+static void scratch_init(lua_State *L)
+/* Creates the arena for this lua_State */
+    {
+    scratch_t *s;
+    if(GetScratch(L)) return; /* already created */
+    s = (scratch_t*)lua_newuserdata(L, sizeof(scratch_t));
+    s->top = s->floor = s->hits = s->misses = 0;
+    lua_newtable(L);
+    lua_pushcfunction(L, ScratchGC);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &ScratchKey);
+    s->next = Arenas;
+    Arenas = s;
+    }
+
+void ScratchReset(lua_State *L)
+/* Releases all the scratch blocks allocated by the current API call, if any */
+    {
+    scratch_t *s = GetScratch(L);
+    if(s) s->top = s->floor;
+    }
+
+size_t ScratchEnter(lua_State *L)
+/* Protects the blocks allocated so far from the resets done by nested API calls.
+ * Returns the value to be passed to the matching ScratchLeave().
+ */
+    {
+    size_t floor;
+    scratch_t *s = GetScratch(L);
+    if(!s) return 0;
+    floor = s->floor;
+    s->floor = s->top;
+    return floor;
+    }
+
+void ScratchLeave(lua_State *L, size_t floor)
+    {
+    scratch_t *s = GetScratch(L);
+    if(!s) return;
+    s->top = s->floor;
+    s->floor = floor;
+    }
+
+void *ScratchAlloc(lua_State *L, size_t size) /* do not raise errors (check the retval) */
+/* Same as MallocNoErr(), but the memory is not zeroed. */
+    {
+    void *ptr;
+    scratch_t *s = GetScratch(L);
+    size_t aligned = (size + SCRATCH_ALIGN - 1) & ~(size_t)(SCRATCH_ALIGN - 1);
+    if(!s) return MallocNoErr(L, size);
+    if(size > 0 && aligned <= SCRATCH_SIZE - s->top)
+        {
+        ptr = s->mem.data + s->top;
+        s->top += aligned;
+        s->hits++;
+        return ptr;
+        }
+    s->misses++;
+    return MallocNoErr(L, size);
+    }
+
+void scratchstats(lua_State *L, size_t *hits, size_t *misses, size_t *inuse)
+    {
+    scratch_t *s = GetScratch(L);
+    *hits = s ? s->hits : 0;
+    *misses = s ? s->misses : 0;
+    *inuse = s ? s->top : 0;
+    }
+
 void Free(lua_State *L, void *ptr)
     {
+    scratch_t *s;
     (void)L;
     //DBG("Free %p\n", ptr);
-    if(ptr) Free_(ptr);
+    if(!ptr) return;
+    for(s = Arenas; s; s = s->next)
+        if(IsScratch(s, ptr)) return; /* released by the next ScratchReset() */
+    Free_(ptr);
     }
 
 /*------------------------------------------------------------------------------*
@@ -444,5 +567,6 @@ void mooncl_utils_init(lua_State *L)
     {
     malloc_init(L);
     time_init(L);
+    scratch_init(L);
     }
 